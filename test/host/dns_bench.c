@@ -0,0 +1,289 @@
+/*
+ * Captive DNS replay benchmark.
+ *
+ * Feeds queries to wm_dns_captive_reply() and reports queries/sec and per
+ * query latency percentiles. Queries come from a pcap file (-p) or, by
+ * default, from a synthetic mix of the connectivity checks Android, iOS,
+ * macOS, Windows and Firefox send right after joining the AP.
+ *
+ *     dns_bench [-n queries] [-p capture.pcap]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wm_dns_msg.h"
+
+#define BENCH_DEFAULT_QUERIES 1000000
+#define BENCH_SYNTHETIC_QUERIES 4096
+// 192.168.4.1, the SoftAP default
+#define BENCH_AP_ADDR 0x0104A8C0
+
+typedef struct {
+    uint16_t len;
+    char data[DNS_PACKET_LEN];
+} query_t;
+
+typedef struct {
+    const char* name;
+    uint16_t qtype;
+    bool edns;
+    // Relative frequency
+    uint8_t weight;
+} probe_t;
+
+// Connectivity checks and the lookups that come with them
+static const probe_t probes[] = {
+    // Android
+    {"connectivitycheck.gstatic.com", QTYPE_A,     false, 12},
+    {"connectivitycheck.gstatic.com", QTYPE_AAAA,  false, 12},
+    {"www.google.com",                QTYPE_A,     false, 6},
+    {"www.google.com",                QTYPE_AAAA,  false, 6},
+    {"clients3.google.com",           QTYPE_A,     false, 3},
+    {"mtalk.google.com",              QTYPE_A,     false, 2},
+    // iOS and macOS
+    {"captive.apple.com",             QTYPE_A,     true,  10},
+    {"captive.apple.com",             QTYPE_AAAA,  true,  10},
+    {"captive.apple.com",             QTYPE_HTTPS, true,  10},
+    {"www.apple.com",                 QTYPE_A,     true,  3},
+    {"time.apple.com",                QTYPE_A,     true,  2},
+    // Windows
+    {"www.msftconnecttest.com",       QTYPE_A,     false, 6},
+    {"www.msftconnecttest.com",       QTYPE_AAAA,  false, 6},
+    {"dns.msftncsi.com",              QTYPE_A,     false, 3},
+    {"dns.msftncsi.com",              QTYPE_AAAA,  false, 3},
+    // Firefox
+    {"detectportal.firefox.com",      QTYPE_A,     true,  3},
+    {"detectportal.firefox.com",      QTYPE_AAAA,  true,  3},
+    // The portal itself
+    {"esp32.config",                  QTYPE_A,     false, 4},
+};
+
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int build_query(char* buf, uint16_t id, const char* name, uint16_t qtype, bool edns) {
+    DnsHeader* hdr = (DnsHeader*)buf;
+    memset(hdr, 0, sizeof(*hdr));
+    setn16(&hdr->id, id);
+    hdr->flags = FLAG_RD;
+    setn16(&hdr->qdcount, 1);
+
+    char* p = buf + sizeof(DnsHeader);
+    while(*name) {
+        const char* dot = strchr(name, '.');
+        size_t len = dot ? (size_t)(dot - name) : strlen(name);
+        *p++ = len;
+        memcpy(p, name, len);
+        p += len;
+        name += len + (dot ? 1 : 0);
+    }
+    *p++ = 0;
+    DnsQuestionFooter* qf = (DnsQuestionFooter*)p;
+    setn16(&qf->type, qtype);
+    setn16(&qf->class, QCLASS_IN);
+    p += sizeof(DnsQuestionFooter);
+
+    if(edns) {
+        // OPT record: root name, 1232 bytes UDP payload, no options
+        setn16(&hdr->arcount, 1);
+        *p++ = 0;
+        DnsResourceFooter* rf = (DnsResourceFooter*)p;
+        setn16(&rf->type, QTYPE_OPT);
+        setn16(&rf->class, 1232);
+        setn32(&rf->ttl, 0);
+        setn16(&rf->rdlength, 0);
+        p += sizeof(DnsResourceFooter);
+    }
+    return p - buf;
+}
+
+static size_t synthetic_queries(query_t* queries, size_t count) {
+    unsigned total_weight = 0;
+    for(size_t i = 0; i < sizeof(probes) / sizeof(probes[0]); i++) total_weight += probes[i].weight;
+
+    for(size_t i = 0; i < count; i++) {
+        unsigned pick = rand() % total_weight;
+        const probe_t* probe = probes;
+        while(pick >= probe->weight) pick -= (probe++)->weight;
+        queries[i].len = build_query(queries[i].data, rand(), probe->name, probe->qtype, probe->edns);
+    }
+    return count;
+}
+
+static uint32_t pcap_u32(const uint8_t* p, bool swap) {
+    return swap
+        ? ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | (p[2] << 8) | p[3]
+        : ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+/*
+ * UDP payload of a query to port 53 inside a captured frame, or NULL
+ */
+static const uint8_t* pcap_dns_payload(const uint8_t* frame, size_t len, uint32_t linktype, size_t* payload_len) {
+    size_t offset;
+    uint16_t ethertype = 0x0800;
+    switch(linktype) {
+        case 0:   offset = 4; ethertype = 0; break;     // BSD loopback, AF in host order
+        case 1:   offset = 14; break;                   // Ethernet
+        case 101:
+        case 228: offset = 0; ethertype = 0; break;     // Raw IP
+        case 113: offset = 16; break;                   // Linux cooked
+        case 276: offset = 20; break;                   // Linux cooked v2
+        default:  return NULL;
+    }
+    if(len < offset) return NULL;
+    if(linktype == 1) {
+        ethertype = (frame[12] << 8) | frame[13];
+        // 802.1Q tag
+        if(ethertype == 0x8100 && len >= 18) {
+            ethertype = (frame[16] << 8) | frame[17];
+            offset += 4;
+        }
+    } else if(linktype == 113) {
+        ethertype = (frame[14] << 8) | frame[15];
+    } else if(linktype == 276) {
+        ethertype = (frame[0] << 8) | frame[1];
+    }
+
+    const uint8_t* ip = frame + offset;
+    len -= offset;
+    if(len < 1) return NULL;
+    uint8_t version = ip[0] >> 4;
+    if(ethertype != 0 && ethertype != (version == 6 ? 0x86DD : 0x0800)) return NULL;
+
+    const uint8_t* udp;
+    if(version == 4) {
+        size_t ihl = (ip[0] & 0x0F) * 4;
+        if(len < ihl + 8 || ip[9] != 17) return NULL;
+        udp = ip + ihl;
+        len -= ihl;
+    } else if(version == 6) {
+        // Extension headers aren't followed
+        if(len < 40 + 8 || ip[6] != 17) return NULL;
+        udp = ip + 40;
+        len -= 40;
+    } else {
+        return NULL;
+    }
+    if(((udp[2] << 8) | udp[3]) != 53) return NULL;
+    *payload_len = len - 8;
+    return udp + 8;
+}
+
+static size_t pcap_queries(const char* path, query_t* queries, size_t max) {
+    FILE* f = fopen(path, "rb");
+    if(f == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    uint8_t header[24];
+    if(fread(header, 1, sizeof(header), f) != sizeof(header)) {
+        fprintf(stderr, "%s: not a pcap file\n", path);
+        exit(1);
+    }
+    uint32_t magic = pcap_u32(header, false);
+    bool swap;
+    if(magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) swap = false;
+    else if(magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) swap = true;
+    else {
+        fprintf(stderr, "%s: not a pcap file (pcapng isn't supported)\n", path);
+        exit(1);
+    }
+    uint32_t linktype = pcap_u32(header + 20, swap);
+
+    size_t count = 0;
+    uint8_t record[16];
+    static uint8_t frame[65536];
+    while(count < max && fread(record, 1, sizeof(record), f) == sizeof(record)) {
+        uint32_t caplen = pcap_u32(record + 8, swap);
+        if(caplen > sizeof(frame) || fread(frame, 1, caplen, f) != caplen) break;
+
+        size_t len;
+        const uint8_t* payload = pcap_dns_payload(frame, caplen, linktype, &len);
+        if(payload == NULL || len > DNS_PACKET_LEN) continue;
+        // Queries only, answers going back to clients are skipped
+        if(len >= sizeof(DnsHeader) && (payload[2] & FLAG_QR)) continue;
+        memcpy(queries[count].data, payload, len);
+        queries[count].len = len;
+        count++;
+    }
+    fclose(f);
+    return count;
+}
+
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char** argv) {
+    size_t iterations = BENCH_DEFAULT_QUERIES;
+    const char* pcap = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "n:p:")) != -1) {
+        switch(opt) {
+            case 'n': iterations = strtoul(optarg, NULL, 10); break;
+            case 'p': pcap = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-n queries] [-p capture.pcap]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(iterations == 0) iterations = 1;
+
+    size_t max_queries = pcap ? 1 << 20 : BENCH_SYNTHETIC_QUERIES;
+    query_t* queries = malloc(max_queries * sizeof(query_t));
+    uint32_t* latencies = malloc(iterations * sizeof(uint32_t));
+    if(queries == NULL || latencies == NULL) return 1;
+
+    srand(1);
+    size_t count = pcap ? pcap_queries(pcap, queries, max_queries) : synthetic_queries(queries, max_queries);
+    if(count == 0) {
+        fprintf(stderr, "no DNS queries to replay\n");
+        return 1;
+    }
+
+    char msg[DNS_PACKET_LEN];
+    uint64_t reply_bytes = 0;
+    size_t replies = 0;
+
+    // Throughput: no per query timing in the loop
+    int64_t start = now_ns();
+    for(size_t i = 0; i < iterations; i++) {
+        query_t* q = &queries[i % count];
+        memcpy(msg, q->data, q->len);
+        int len = wm_dns_captive_reply(msg, q->len, BENCH_AP_ADDR);
+        reply_bytes += len;
+        replies += len > 0;
+    }
+    int64_t elapsed = now_ns() - start;
+
+    // Latency: every query timed on its own
+    int64_t overhead = now_ns();
+    overhead = now_ns() - overhead;
+    for(size_t i = 0; i < iterations; i++) {
+        query_t* q = &queries[i % count];
+        memcpy(msg, q->data, q->len);
+        int64_t t = now_ns();
+        wm_dns_captive_reply(msg, q->len, BENCH_AP_ADDR);
+        latencies[i] = now_ns() - t;
+    }
+    qsort(latencies, iterations, sizeof(uint32_t), compare_u32);
+
+    printf("queries:    %zu (%zu distinct, %s)\n", iterations, count, pcap ? pcap : "synthetic probe mix");
+    printf("answered:   %zu, %.1f bytes avg\n", replies, replies ? (double)reply_bytes / replies : 0.0);
+    printf("throughput: %.0f queries/s\n", iterations * 1e9 / (elapsed ? elapsed : 1));
+    printf("latency:    p50 %u ns, p99 %u ns, max %u ns (timer overhead ~%d ns)\n",
+        latencies[iterations / 2], latencies[iterations * 99 / 100], latencies[iterations - 1], (int)overhead);
+
+    free(latencies);
+    free(queries);
+    return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * libFuzzer target for the captive DNS parser and reply builder.
+ *
+ * Besides crashes (run it under ASan/UBSan), it checks that every reply is
+ * a well-formed DNS message that fits in DNS_PACKET_LEN.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "wm_dns_msg.h"
+
+#define FUZZ_AP_ADDR 0x0104A8C0
+
+#define FUZZ_CHECK(cond) do { if(!(cond)) __builtin_trap(); } while(0)
+
+static void check_reply(char* msg, int len) {
+    FUZZ_CHECK(len >= (int)sizeof(DnsHeader) && len <= DNS_PACKET_LEN);
+    DnsHeader* hdr = (DnsHeader*)msg;
+    FUZZ_CHECK(hdr->flags & FLAG_QR);
+
+    char* end = msg + len;
+    char* p = msg + sizeof(DnsHeader);
+    for(int i = my_ntohs(&hdr->qdcount); i > 0; i--) {
+        p = wm_dns_skip_label(p, end);
+        FUZZ_CHECK(p != NULL && p + sizeof(DnsQuestionFooter) <= end);
+        p += sizeof(DnsQuestionFooter);
+    }
+    int records = my_ntohs(&hdr->ancount) + my_ntohs(&hdr->nscount) + my_ntohs(&hdr->arcount);
+    for(; records > 0; records--) {
+        p = wm_dns_skip_label(p, end);
+        FUZZ_CHECK(p != NULL && p + sizeof(DnsResourceFooter) <= end);
+        DnsResourceFooter* rf = (DnsResourceFooter*)p;
+        p += sizeof(DnsResourceFooter) + my_ntohs(&rf->rdlength);
+        FUZZ_CHECK(p <= end);
+    }
+    FUZZ_CHECK(p == end);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if(size > DNS_PACKET_LEN) return 0;
+
+    // Straight on the input, sized exactly, so ASan catches reads past the datagram
+    char* name = (char*)data;
+    char* next = wm_dns_skip_label(name, name + size);
+    FUZZ_CHECK(next == NULL || (next > name && next <= name + size));
+
+    // The reply is built in a DNS_PACKET_LEN buffer, as on the device
+    char msg[DNS_PACKET_LEN];
+    memcpy(msg, data, size);
+    int len = wm_dns_captive_reply(msg, size, FUZZ_AP_ADDR);
+    if(len > 0) check_reply(msg, len);
+    return 0;
+}
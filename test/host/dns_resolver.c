@@ -0,0 +1,229 @@
+#include <ctype.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "dns_resolver.h"
+#include "wm_dns_msg.h"
+
+#define RESOLVER_MAX_RECORDS 16
+#define RESOLVER_MAX_HELD 16
+#define RESOLVER_POLL_MS 20
+
+typedef struct {
+    char name[DNS_NAME_MAX_LEN + 1];
+    uint32_t addr;
+    uint32_t ttl;
+} record_t;
+
+typedef struct {
+    struct sockaddr_in from;
+    int len;
+    char msg[DNS_PACKET_LEN];
+} held_t;
+
+struct dns_resolver {
+    int sock;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    volatile bool running;
+    record_t records[RESOLVER_MAX_RECORDS];
+    int nrecords;
+    bool hold;
+    held_t held[RESOLVER_MAX_HELD];
+    int nheld;
+    unsigned queries;
+    uint16_t last_id;
+    struct sockaddr_in last_from;
+};
+
+/*
+ * Dotted form of the question name, or -1 if the query isn't a single
+ * uncompressed question
+ */
+static int question_name(const char* msg, int len, char* name, int* qlen) {
+    const DnsHeader* hdr = (const DnsHeader*)msg;
+    if(len < (int)sizeof(DnsHeader) || my_ntohs((uint16_t*)&hdr->qdcount) != 1) return -1;
+
+    const char* p = msg + sizeof(DnsHeader);
+    const char* end = msg + len;
+    char* out = name;
+    while(p < end && *p != 0) {
+        uint8_t label = *p++;
+        if(label > 63 || p + label > end || out + label + 1 > name + DNS_NAME_MAX_LEN) return -1;
+        if(out != name) *out++ = '.';
+        memcpy(out, p, label);
+        out += label;
+        p += label;
+    }
+    *out = 0;
+    if(p + 1 + sizeof(DnsQuestionFooter) > end) return -1;
+    *qlen = p + 1 + sizeof(DnsQuestionFooter) - (msg + sizeof(DnsHeader));
+    return 0;
+}
+
+static void answer(dns_resolver_t* resolver, char* msg, int len, const struct sockaddr_in* to) {
+    char name[DNS_NAME_MAX_LEN + 1];
+    int qlen;
+    if(question_name(msg, len, name, &qlen) != 0) return;
+
+    DnsHeader* hdr = (DnsHeader*)msg;
+    DnsQuestionFooter* qf = (DnsQuestionFooter*)(msg + sizeof(DnsHeader) + qlen - sizeof(DnsQuestionFooter));
+    hdr->flags = (hdr->flags & FLAG_RD) | FLAG_QR;
+    hdr->rcode = 0x80;     // RA
+    setn16(&hdr->ancount, 0);
+    setn16(&hdr->nscount, 0);
+    setn16(&hdr->arcount, 0);
+    char* p = msg + sizeof(DnsHeader) + qlen;
+
+    const record_t* record = NULL;
+    pthread_mutex_lock(&resolver->lock);
+    for(int i = 0; i < resolver->nrecords; i++) {
+        if(strcasecmp(resolver->records[i].name, name) == 0) record = &resolver->records[i];
+    }
+    if(record == NULL) {
+        hdr->rcode |= RCODE_NXDOMAIN;
+    } else if(my_ntohs(&qf->type) == QTYPE_A) {
+        setn16(&hdr->ancount, 1);
+        setn16(p, 0xC000 | sizeof(DnsHeader));     // Pointer to the question name
+        p += 2;
+        DnsResourceFooter* rf = (DnsResourceFooter*)p;
+        setn16(&rf->type, QTYPE_A);
+        setn16(&rf->class, QCLASS_IN);
+        setn32(&rf->ttl, record->ttl);
+        setn16(&rf->rdlength, 4);
+        p += sizeof(DnsResourceFooter);
+        memcpy(p, &record->addr, 4);
+        p += 4;
+    }
+    pthread_mutex_unlock(&resolver->lock);
+
+    sendto(resolver->sock, msg, p - msg, 0, (const struct sockaddr*)to, sizeof(*to));
+}
+
+static void* resolver_thread(void* arg) {
+    dns_resolver_t* resolver = arg;
+    struct pollfd pfd = {.fd = resolver->sock, .events = POLLIN};
+    char msg[DNS_PACKET_LEN];
+
+    while(resolver->running) {
+        if(poll(&pfd, 1, RESOLVER_POLL_MS) <= 0) continue;
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+        int len = recvfrom(resolver->sock, msg, sizeof(msg), 0, (struct sockaddr*)&from, &fromlen);
+        if(len < (int)sizeof(DnsHeader) || (((DnsHeader*)msg)->flags & FLAG_QR)) continue;
+
+        pthread_mutex_lock(&resolver->lock);
+        resolver->queries++;
+        resolver->last_id = ((DnsHeader*)msg)->id;
+        resolver->last_from = from;
+        bool hold = resolver->hold && resolver->nheld < RESOLVER_MAX_HELD;
+        if(hold) {
+            held_t* held = &resolver->held[resolver->nheld++];
+            held->from = from;
+            held->len = len;
+            memcpy(held->msg, msg, len);
+        }
+        pthread_mutex_unlock(&resolver->lock);
+        if(!hold) answer(resolver, msg, len, &from);
+    }
+    return NULL;
+}
+
+dns_resolver_t* dns_resolver_start(const char* addr, uint16_t port) {
+    dns_resolver_t* resolver = calloc(1, sizeof(dns_resolver_t));
+    if(resolver == NULL) return NULL;
+
+    struct sockaddr_in bind_addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    inet_aton(addr, &bind_addr.sin_addr);
+    resolver->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if(resolver->sock == -1 || bind(resolver->sock, (struct sockaddr*)&bind_addr, sizeof(bind_addr)) != 0) {
+        if(resolver->sock != -1) close(resolver->sock);
+        free(resolver);
+        return NULL;
+    }
+    pthread_mutex_init(&resolver->lock, NULL);
+    resolver->running = true;
+    pthread_create(&resolver->thread, NULL, resolver_thread, resolver);
+    return resolver;
+}
+
+void dns_resolver_stop(dns_resolver_t* resolver) {
+    resolver->running = false;
+    pthread_join(resolver->thread, NULL);
+    close(resolver->sock);
+    pthread_mutex_destroy(&resolver->lock);
+    free(resolver);
+}
+
+void dns_resolver_add(dns_resolver_t* resolver, const char* name, const char* a_addr, uint32_t ttl) {
+    pthread_mutex_lock(&resolver->lock);
+    if(resolver->nrecords < RESOLVER_MAX_RECORDS) {
+        record_t* record = &resolver->records[resolver->nrecords++];
+        strncpy(record->name, name, DNS_NAME_MAX_LEN);
+        record->addr = inet_addr(a_addr);
+        record->ttl = ttl;
+    }
+    pthread_mutex_unlock(&resolver->lock);
+}
+
+unsigned dns_resolver_queries(dns_resolver_t* resolver) {
+    pthread_mutex_lock(&resolver->lock);
+    unsigned queries = resolver->queries;
+    pthread_mutex_unlock(&resolver->lock);
+    return queries;
+}
+
+void dns_resolver_hold(dns_resolver_t* resolver, bool hold) {
+    held_t held[RESOLVER_MAX_HELD];
+    pthread_mutex_lock(&resolver->lock);
+    resolver->hold = hold;
+    int nheld = hold ? 0 : resolver->nheld;
+    memcpy(held, resolver->held, nheld * sizeof(held_t));
+    if(!hold) resolver->nheld = 0;
+    pthread_mutex_unlock(&resolver->lock);
+
+    for(int i = 0; i < nheld; i++) answer(resolver, held[i].msg, held[i].len, &held[i].from);
+}
+
+void dns_resolver_last_query(dns_resolver_t* resolver, uint16_t* id, struct sockaddr_in* from) {
+    pthread_mutex_lock(&resolver->lock);
+    *id = resolver->last_id;
+    *from = resolver->last_from;
+    pthread_mutex_unlock(&resolver->lock);
+}
+
+void dns_resolver_send_answer(dns_resolver_t* resolver, uint16_t id, const char* name, const struct sockaddr_in* to) {
+    char msg[DNS_PACKET_LEN];
+    int len = dns_build_query(msg, 0, name, QTYPE_A);
+    ((DnsHeader*)msg)->id = id;
+    answer(resolver, msg, len, to);
+}
+
+int dns_build_query(char* msg, uint16_t id, const char* name, uint16_t qtype) {
+    DnsHeader* hdr = (DnsHeader*)msg;
+    memset(hdr, 0, sizeof(*hdr));
+    setn16(&hdr->id, id);
+    hdr->flags = FLAG_RD;
+    setn16(&hdr->qdcount, 1);
+
+    char* p = msg + sizeof(DnsHeader);
+    while(*name) {
+        const char* dot = strchr(name, '.');
+        size_t len = dot ? (size_t)(dot - name) : strlen(name);
+        *p++ = len;
+        memcpy(p, name, len);
+        p += len;
+        name += len + (dot ? 1 : 0);
+    }
+    *p++ = 0;
+    DnsQuestionFooter* qf = (DnsQuestionFooter*)p;
+    setn16(&qf->type, qtype);
+    setn16(&qf->class, QCLASS_IN);
+    return p + sizeof(DnsQuestionFooter) - msg;
+}
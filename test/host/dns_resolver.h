@@ -0,0 +1,36 @@
+#pragma once
+
+/*
+ * Stand-in upstream resolver for forwarder tests: a UDP server on its own
+ * thread that answers A queries from a fixed record table and everything
+ * else with NXDOMAIN.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+typedef struct dns_resolver dns_resolver_t;
+
+// Listen on 'addr':'port' (IPv4, dotted). Returns NULL on error
+dns_resolver_t* dns_resolver_start(const char* addr, uint16_t port);
+void dns_resolver_stop(dns_resolver_t* resolver);
+
+// Answer A queries for 'name' with 'a_addr' (dotted) and 'ttl' seconds
+void dns_resolver_add(dns_resolver_t* resolver, const char* name, const char* a_addr, uint32_t ttl);
+
+// Queries received so far
+unsigned dns_resolver_queries(dns_resolver_t* resolver);
+
+// While held, queries are counted but only answered on release
+void dns_resolver_hold(dns_resolver_t* resolver, bool hold);
+
+// Send an answer to 'to' for an A query of 'name' with transaction ID 'id'
+// (network order), as if it had been asked
+void dns_resolver_send_answer(dns_resolver_t* resolver, uint16_t id, const char* name, const struct sockaddr_in* to);
+
+// Transaction ID (network order) and source of the last query received
+void dns_resolver_last_query(dns_resolver_t* resolver, uint16_t* id, struct sockaddr_in* from);
+
+// Build a single question query with the RD flag. Returns its length
+int dns_build_query(char* msg, uint16_t id, const char* name, uint16_t qtype);
@@ -0,0 +1,127 @@
+/*
+ * Stand-alone driver for libFuzzer targets, used when the compiler has no
+ * -fsanitize=fuzzer (e.g. GCC). It runs the files given on the command line,
+ * then -runs=N inputs mutated from them, or from random bytes if none is
+ * given. Accepts the libFuzzer flags used in ctest: -runs=N and -seed=N.
+ */
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define FUZZ_MAX_LEN 4096
+#define FUZZ_MAX_SEEDS 256
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+static uint8_t* _seeds[FUZZ_MAX_SEEDS];
+static size_t _seed_lens[FUZZ_MAX_SEEDS];
+static size_t _seed_count;
+
+static void run_file(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if(f == NULL) return;
+    uint8_t* data = malloc(FUZZ_MAX_LEN);
+    size_t len = fread(data, 1, FUZZ_MAX_LEN, f);
+    fclose(f);
+
+    LLVMFuzzerTestOneInput(data, len);
+    if(_seed_count < FUZZ_MAX_SEEDS) {
+        _seeds[_seed_count] = data;
+        _seed_lens[_seed_count++] = len;
+    } else {
+        free(data);
+    }
+}
+
+static void run_path(const char* path) {
+    struct stat st;
+    if(stat(path, &st) != 0) return;
+    if(!S_ISDIR(st.st_mode)) {
+        run_file(path);
+        return;
+    }
+    DIR* dir = opendir(path);
+    struct dirent* entry;
+    while(dir && (entry = readdir(dir)) != NULL) {
+        if(entry->d_name[0] == '.') continue;
+        char child[4096];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        run_file(child);
+    }
+    if(dir) closedir(dir);
+}
+
+static size_t mutate(uint8_t* buf, size_t len) {
+    int edits = 1 + rand() % 8;
+    while(edits--) {
+        size_t pos = len ? rand() % len : 0;
+        switch(rand() % 6) {
+            case 0:     // Flip a bit
+                if(len) buf[pos] ^= 1 << (rand() % 8);
+                break;
+            case 1:     // Interesting byte: label lengths, compression pointers
+                if(len) {
+                    static const uint8_t interesting[] = {0x00, 0x01, 0x3F, 0x40, 0x80, 0xC0, 0xC0, 0xFF};
+                    buf[pos] = interesting[rand() % sizeof(interesting)];
+                }
+                break;
+            case 2:     // Random byte
+                if(len) buf[pos] = rand();
+                break;
+            case 3:     // Truncate
+                len = pos;
+                break;
+            case 4:     // Insert a random byte
+                if(len < FUZZ_MAX_LEN) {
+                    memmove(buf + pos + 1, buf + pos, len - pos);
+                    buf[pos] = rand();
+                    len++;
+                }
+                break;
+            case 5:     // Duplicate a chunk
+                if(len && len < FUZZ_MAX_LEN) {
+                    size_t chunk = 1 + rand() % (len - pos);
+                    if(len + chunk > FUZZ_MAX_LEN) chunk = FUZZ_MAX_LEN - len;
+                    memmove(buf + pos + chunk, buf + pos, len - pos);
+                    len += chunk;
+                }
+                break;
+        }
+    }
+    return len;
+}
+
+int main(int argc, char** argv) {
+    long runs = 100000;
+    unsigned seed = 1;
+    for(int i = 1; i < argc; i++) {
+        if(strncmp(argv[i], "-runs=", 6) == 0) runs = atol(argv[i] + 6);
+        else if(strncmp(argv[i], "-seed=", 6) == 0) seed = strtoul(argv[i] + 6, NULL, 10);
+        else if(argv[i][0] != '-') run_path(argv[i]);
+    }
+    srand(seed);
+
+    uint8_t* buf = malloc(FUZZ_MAX_LEN);
+    for(long run = 0; run < runs; run++) {
+        size_t len;
+        if(_seed_count > 0 && rand() % 8 != 0) {
+            size_t s = rand() % _seed_count;
+            memcpy(buf, _seeds[s], _seed_lens[s]);
+            len = mutate(buf, _seed_lens[s]);
+        } else {
+            len = rand() % 600;
+            for(size_t i = 0; i < len; i++) buf[i] = rand();
+        }
+        // Exact size copy, so out of bounds reads are caught by ASan
+        uint8_t* input = malloc(len ? len : 1);
+        memcpy(input, buf, len);
+        LLVMFuzzerTestOneInput(input, len);
+        free(input);
+    }
+    printf("Done %ld runs, %zu seed inputs\n", runs, _seed_count);
+    free(buf);
+    return 0;
+}
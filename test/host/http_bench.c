@@ -0,0 +1,570 @@
+/*
+ * Portal web server load benchmark.
+ *
+ * Runs wm_webserver.c on the stand-in esp_http_server (shim/) with the scan
+ * cache, storage and provisioning calls mocked, and drives it with client
+ * threads, each one a phone or laptop joined to the AP with its own source
+ * address (127.0.0.10 and up, so the per-client socket cap applies as on
+ * the device). Every client runs the connectivity check of its OS on fresh
+ * connections, and page loads on a keep-alive one: the portal page
+ * (revalidated with If-None-Match once cached), /networks, /favicon.ico on
+ * the first load, and now and then /api/scan and a credentials POST.
+ * Meanwhile one more client follows /api/events, idle: the server must not
+ * close its stream to make room for the others.
+ *
+ * Reports requests/s, latency percentiles, bytes sent and handler times
+ * (server counters, CONFIG_WM_WEBSERVER_STATS) and peak heap use.
+ *
+ *     http_bench [-c clients] [-n requests] [-P probe %] [-p port]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+
+#include "wifi_manager.h"
+#include "lwip/sockets.h"
+#include "wm_host.h"
+
+#define BENCH_DEFAULT_CLIENTS 8
+#define BENCH_DEFAULT_REQUESTS 20000
+#define BENCH_DEFAULT_PROBE_PCT 50
+#define BENCH_DEFAULT_PORT 15380
+#define BENCH_RECV_TIMEOUT_S 5
+#define BENCH_RESP_BUF_LEN 4096
+
+/*
+ * Mocks of the rest of the component
+ */
+wm_network_info_t wm_network_info_default = {.times_used = 0};
+
+static wifi_ap_record_t _ap_records[WM_SCAN_MAX_NETWORKS];
+static uint16_t _ap_count;
+
+// A busy apartment block: a few SSIDs on several BSSIDs, one hidden network
+// and names that need escaping
+static const char* ap_names[] = {
+    "FRITZ!Box 7590 KQ", "Vodafone-A1B2", "eduroam", "HUAWEI-5G-3x9T", "Telekom_FON",
+    "DIRECT-3F-HP LaserJet", "Caf\xc3\xa9 \"Corner\" <guest>", "eduroam", "", "UPC1234567",
+    "Vodafone-A1B2", "TP-Link_2.4GHz_0A4C", "iPhone de Marta", "MOVISTAR_PLUS_7E21", "Livebox-5A3C",
+    "NETGEAR42", "FRITZ!Box 7590 KQ", "WLAN-837261", "Guest & Friends", "Tenda_F1A2B0",
+};
+
+static void mock_scan_init() {
+    _ap_count = sizeof(ap_names) / sizeof(ap_names[0]);
+    for(int i = 0; i < _ap_count; i++) {
+        wifi_ap_record_t* record = &_ap_records[i];
+        memset(record, 0, sizeof(*record));
+        strncpy((char*)record->ssid, ap_names[i], sizeof(record->ssid) - 1);
+        record->bssid[5] = i;
+        record->primary = 1 + (i * 5) % 11;
+        record->rssi = -38 - i * 3;
+        record->authmode = i % 3 == 0 ? WIFI_AUTH_WPA2_PSK : i % 3 == 1 ? WIFI_AUTH_WPA_WPA2_PSK : WIFI_AUTH_OPEN;
+    }
+}
+
+esp_err_t wm_scan_cache_get(wifi_ap_record_t* ap_records, uint16_t* ap_num, TickType_t wait) {
+    if(*ap_num > _ap_count) *ap_num = _ap_count;
+    memcpy(ap_records, _ap_records, *ap_num * sizeof(wifi_ap_record_t));
+    return ESP_OK;
+}
+
+esp_err_t wm_storage_read(wm_network_info_t* networks, size_t* count) {
+    static const char* stored[] = { "eduroam", "Vodafone-A1B2" };
+    size_t stored_count = sizeof(stored) / sizeof(stored[0]);
+    if(*count > stored_count) *count = stored_count;
+    for(int i = 0; i < *count; i++) {
+        networks[i] = wm_network_info_default;
+        memcpy(networks[i].ssid, stored[i], strlen(stored[i]) + 1);
+    }
+    return ESP_OK;
+}
+
+void wm_provision_get_status(wm_provision_status_t* status) {
+    memset(status, 0, sizeof(*status));
+    status->state = WM_PROVISION_IDLE;
+}
+
+esp_err_t wm_provision_connect(wm_network_info_t* network_info) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_mode(wifi_mode_t* mode) {
+    *mode = WIFI_MODE_AP;
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_config(esp_interface_t interface, wifi_config_t* config) {
+    memset(config, 0, sizeof(*config));
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config(esp_interface_t interface, wifi_config_t* config) {
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void) {
+    return ESP_OK;
+}
+
+/*
+ * Load generator
+ */
+typedef struct {
+    const char* path;
+    const char* host;
+} probe_t;
+
+// Connectivity checks of each OS, see probe_uris in wm_webserver.c
+static const probe_t probes[][3] = {
+    [WM_PROBE_ANDROID] = {
+        {"/generate_204", "connectivitycheck.gstatic.com"},
+        {"/gen_204", "clients3.google.com"},
+    },
+    [WM_PROBE_APPLE] = {
+        {"/hotspot-detect.html", "captive.apple.com"},
+        {"/library/test/success.html", "www.apple.com"},
+    },
+    [WM_PROBE_WINDOWS] = {
+        {"/connecttest.txt", "www.msftconnecttest.com"},
+        {"/ncsi.txt", "www.msftncsi.com"},
+        {"/redirect", "www.msftconnecttest.com"},
+    },
+    [WM_PROBE_FIREFOX] = {
+        {"/success.txt", "detectportal.firefox.com"},
+        {"/canonical.html", "detectportal.firefox.com"},
+    },
+};
+
+static const char* user_agents[] = {
+    [WM_PROBE_ANDROID] = "Mozilla/5.0 (Linux; Android 13; Pixel 6) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0 Mobile Safari/537.36",
+    [WM_PROBE_APPLE]   = "Mozilla/5.0 (iPhone; CPU iPhone OS 17_0 like Mac OS X) AppleWebKit/605.1.15 (KHTML, like Gecko) Mobile/15E148",
+    [WM_PROBE_WINDOWS] = "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0 Safari/537.36 Edg/118.0",
+    [WM_PROBE_FIREFOX] = "Mozilla/5.0 (X11; Linux x86_64; rv:118.0) Gecko/20100101 Firefox/118.0",
+};
+
+typedef struct {
+    int fd;
+    // Received and not consumed yet
+    char buf[BENCH_RESP_BUF_LEN];
+    size_t len;
+} conn_t;
+
+typedef struct {
+    int status;
+    bool close;
+    char etag[40];
+} response_t;
+
+typedef struct {
+    int id;
+    wm_probe_client_t os;
+    uint32_t addr;
+    unsigned seed;
+    // Keep-alive connection of the browser, -1 if none
+    conn_t page;
+    conn_t probe;
+    char etag[40];
+    bool loaded;
+
+    uint32_t errors;
+    uint32_t reconnects;
+    uint64_t bytes_received;
+} client_t;
+
+static uint16_t _port = BENCH_DEFAULT_PORT;
+static size_t _requests = BENCH_DEFAULT_REQUESTS;
+static unsigned _probe_pct = BENCH_DEFAULT_PROBE_PCT;
+static size_t _next_request;
+static uint32_t* _latencies_us;
+
+static int64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void conn_close(conn_t* conn) {
+    if(conn->fd >= 0) close(conn->fd);
+    conn->fd = -1;
+    conn->len = 0;
+}
+
+static bool conn_open(conn_t* conn, uint32_t addr) {
+    conn->len = 0;
+    conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(conn->fd < 0) return false;
+
+    int one = 1;
+    struct timeval timeout = { .tv_sec = BENCH_RECV_TIMEOUT_S };
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    struct sockaddr_in local = { .sin_family = AF_INET, .sin_addr.s_addr = addr };
+    struct sockaddr_in server = {
+        .sin_family = AF_INET,
+        .sin_port = htons(_port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    if(bind(conn->fd, (struct sockaddr*)&local, sizeof(local)) != 0
+            || connect(conn->fd, (struct sockaddr*)&server, sizeof(server)) != 0) {
+        conn_close(conn);
+        return false;
+    }
+    return true;
+}
+
+static bool conn_fill(conn_t* conn, client_t* client) {
+    if(conn->len == sizeof(conn->buf)) return false;
+    int ret = recv(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len, 0);
+    if(ret <= 0) return false;
+    conn->len += ret;
+    client->bytes_received += ret;
+    return true;
+}
+
+static void conn_consume(conn_t* conn, size_t len) {
+    memmove(conn->buf, conn->buf + len, conn->len - len);
+    conn->len -= len;
+}
+
+/*
+ * Offset right after the first "\r\n\r\n" (or "\r\n" if 'lines' is 1) in the
+ * buffer, reading more until there is one. 0 on failure.
+ */
+static size_t conn_until(conn_t* conn, client_t* client, int lines) {
+    const char* end = lines == 1 ? "\r\n" : "\r\n\r\n";
+    size_t end_len = strlen(end);
+    while(true) {
+        char* found = memmem(conn->buf, conn->len, end, end_len);
+        if(found) return found + end_len - conn->buf;
+        if(!conn_fill(conn, client)) return 0;
+    }
+}
+
+static bool conn_skip(conn_t* conn, client_t* client, size_t len) {
+    while(len > 0) {
+        if(conn->len == 0 && !conn_fill(conn, client)) return false;
+        size_t take = len < conn->len ? len : conn->len;
+        conn_consume(conn, take);
+        len -= take;
+    }
+    return true;
+}
+
+static const char* header_value(const char* headers, const char* field) {
+    size_t field_len = strlen(field);
+    for(const char* line = strstr(headers, "\r\n"); line && line[2] != '\r'; line = strstr(line + 2, "\r\n")) {
+        if(strncasecmp(line + 2, field, field_len) == 0 && line[2 + field_len] == ':') {
+            const char* value = line + 3 + field_len;
+            while(*value == ' ') value++;
+            return value;
+        }
+    }
+    return NULL;
+}
+
+static bool read_response(conn_t* conn, client_t* client, response_t* resp) {
+    size_t head_len = conn_until(conn, client, 2);
+    if(head_len == 0) return false;
+    char head[BENCH_RESP_BUF_LEN + 1];
+    memcpy(head, conn->buf, head_len);
+    head[head_len] = '\0';
+    conn_consume(conn, head_len);
+
+    if(sscanf(head, "HTTP/1.%*d %d", &resp->status) != 1) return false;
+    const char* value = header_value(head, "Connection");
+    resp->close = value && strncasecmp(value, "close", 5) == 0;
+    resp->etag[0] = '\0';
+    value = header_value(head, "ETag");
+    if(value) sscanf(value, "%39[^\r]", resp->etag);
+
+    value = header_value(head, "Transfer-Encoding");
+    if(value == NULL || strncasecmp(value, "chunked", 7) != 0) {
+        value = header_value(head, "Content-Length");
+        return conn_skip(conn, client, value ? strtoul(value, NULL, 10) : 0);
+    }
+    while(true) {
+        size_t line_len = conn_until(conn, client, 1);
+        if(line_len == 0) return false;
+        size_t chunk_len = strtoul(conn->buf, NULL, 16);
+        conn_consume(conn, line_len);
+        if(chunk_len == 0) return conn_skip(conn, client, 2);
+        if(!conn_skip(conn, client, chunk_len + 2)) return false;
+    }
+}
+
+static bool send_all(int fd, const char* buf, size_t len) {
+    while(len > 0) {
+        ssize_t ret = send(fd, buf, len, MSG_NOSIGNAL);
+        if(ret <= 0) return false;
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+/*
+ * Claim a request slot, false once the run is over
+ */
+static bool claim(size_t* slot) {
+    *slot = __atomic_fetch_add(&_next_request, 1, __ATOMIC_RELAXED);
+    return *slot < _requests;
+}
+
+/*
+ * Send a request and read its response. A keep-alive connection found closed
+ * (evicted, purged, or closed by the server after an error) is reopened once,
+ * as browsers do. The time of the retry counts in the latency.
+ */
+static void request(client_t* client, conn_t* conn, size_t slot, const char* req, size_t req_len,
+        int expected, int expected_alt, response_t* resp) {
+    int64_t started = now_us();
+    bool done = false;
+    for(int attempt = 0; attempt < 2 && !done; attempt++) {
+        bool reused = conn->fd >= 0;
+        if(!reused && !conn_open(conn, client->addr)) break;
+        done = send_all(conn->fd, req, req_len) && read_response(conn, client, resp);
+        if(!done) {
+            conn_close(conn);
+            if(!reused) break;
+            client->reconnects++;
+        }
+    }
+    _latencies_us[slot] = now_us() - started;
+
+    if(!done || (resp->status != expected && resp->status != expected_alt)) {
+        if(client->errors++ == 0) {
+            fprintf(stderr, "client %d: %.*s -> %s %d\n", client->id, (int)strcspn(req, "\r"), req,
+                done ? "status" : "failed", done ? resp->status : 0);
+        }
+        conn_close(conn);
+        return;
+    }
+    if(resp->close) conn_close(conn);
+}
+
+static void run_probe(client_t* client, size_t slot) {
+    size_t count = 0;
+    while(count < 3 && probes[client->os][count].path) count++;
+    const probe_t* probe = &probes[client->os][rand_r(&client->seed) % count];
+
+    char req[512];
+    int len = snprintf(req, sizeof(req),
+        "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: %s\r\nConnection: close\r\n\r\n",
+        probe->path, probe->host, user_agents[client->os]);
+    response_t resp;
+    request(client, &client->probe, slot, req, len, 302, 302, &resp);
+    // Each check is a new connection
+    conn_close(&client->probe);
+}
+
+static void page_get(client_t* client, size_t slot, const char* path, const char* accept, int expected, int expected_alt,
+        response_t* resp) {
+    char if_none_match[64] = "";
+    if(strcmp(path, "/") == 0 && client->etag[0]) {
+        snprintf(if_none_match, sizeof(if_none_match), "If-None-Match: %s\r\n", client->etag);
+    }
+    char req[1024];
+    int len = snprintf(req, sizeof(req),
+        "GET %s HTTP/1.1\r\nHost: esp32.config\r\nUser-Agent: %s\r\nAccept: %s\r\n"
+        "Accept-Encoding: gzip, deflate\r\nAccept-Language: en-US,en;q=0.9\r\n%s"
+        "Connection: keep-alive\r\n\r\n",
+        path, user_agents[client->os], accept, if_none_match);
+    request(client, &client->page, slot, req, len, expected, expected_alt, resp);
+}
+
+static void page_post_ssid(client_t* client, size_t slot) {
+    const char* body = "ssid=eduroam&password=correct+horse+battery+staple";
+    char req[1024];
+    int len = snprintf(req, sizeof(req),
+        "POST /ssid HTTP/1.1\r\nHost: esp32.config\r\nUser-Agent: %s\r\n"
+        "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: %zu\r\n"
+        "Connection: keep-alive\r\n\r\n%s",
+        user_agents[client->os], strlen(body), body);
+    response_t resp;
+    request(client, &client->page, slot, req, len, 202, 202, &resp);
+}
+
+/*
+ * One page load, as many requests as slots are left for
+ */
+static bool run_page_load(client_t* client) {
+    size_t slot;
+    response_t resp;
+    if(!claim(&slot)) return false;
+    page_get(client, slot, "/", "text/html,*/*;q=0.8", 200, 304, &resp);
+    if(resp.status == 200 && resp.etag[0]) strcpy(client->etag, resp.etag);
+
+    if(!claim(&slot)) return false;
+    page_get(client, slot, "/networks", "*/*", 200, 200, &resp);
+
+    if(!client->loaded) {
+        client->loaded = true;
+        // Unknown path: redirected to the portal by the 404 handler, which closes the socket
+        if(!claim(&slot)) return false;
+        page_get(client, slot, "/favicon.ico", "image/*", 302, 302, &resp);
+    }
+    if(rand_r(&client->seed) % 4 == 0) {
+        if(!claim(&slot)) return false;
+        page_get(client, slot, "/api/scan", "application/json", 200, 200, &resp);
+    }
+    if(rand_r(&client->seed) % 10 == 0) {
+        if(!claim(&slot)) return false;
+        page_post_ssid(client, slot);
+    }
+    return true;
+}
+
+/*
+ * Subscribe to /api/events and read the response headers and first event
+ */
+static bool events_subscribe(client_t* watcher, conn_t* conn) {
+    const char* req = "GET /api/events HTTP/1.1\r\nHost: esp32.config\r\nAccept: text/event-stream\r\n\r\n";
+    if(!conn_open(conn, watcher->addr) || !send_all(conn->fd, req, strlen(req))) return false;
+
+    size_t head_len = conn_until(conn, watcher, 2);
+    if(head_len == 0) return false;
+    conn_consume(conn, head_len);
+    size_t line_len = conn_until(conn, watcher, 1);
+    if(line_len == 0) return false;
+    size_t chunk_len = strtoul(conn->buf, NULL, 16);
+    conn_consume(conn, line_len);
+    return chunk_len > 0 && conn_skip(conn, watcher, chunk_len + 2);
+}
+
+static bool events_open(conn_t* conn) {
+    char byte;
+    ssize_t ret = recv(conn->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return ret > 0 || (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+static void* client_thread(void* arg) {
+    client_t* client = arg;
+    while(true) {
+        if(rand_r(&client->seed) % 100 < _probe_pct) {
+            size_t slot;
+            if(!claim(&slot)) break;
+            run_probe(client, slot);
+        } else if(!run_page_load(client)) {
+            break;
+        }
+    }
+    conn_close(&client->page);
+    conn_close(&client->probe);
+    return NULL;
+}
+
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char** argv) {
+    int clients = BENCH_DEFAULT_CLIENTS;
+    int opt;
+    while((opt = getopt(argc, argv, "c:n:P:p:")) != -1) {
+        switch(opt) {
+            case 'c': clients = atoi(optarg); break;
+            case 'n': _requests = strtoul(optarg, NULL, 10); break;
+            case 'P': _probe_pct = atoi(optarg); break;
+            case 'p': _port = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-c clients] [-n requests] [-P probe %%] [-p port]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(clients < 1 || clients > 200 || _requests == 0 || _probe_pct > 100) {
+        fprintf(stderr, "clients must be 1-200, requests over 0, probe percentage 0-100\n");
+        return 2;
+    }
+
+    client_t* client_data = calloc(clients, sizeof(client_t));
+    pthread_t* threads = calloc(clients, sizeof(pthread_t));
+    _latencies_us = calloc(_requests, sizeof(uint32_t));
+    if(client_data == NULL || threads == NULL || _latencies_us == NULL) return 1;
+    mock_scan_init();
+
+    size_t heap_base = wm_host_heap_used();
+    wm_host_heap_reset_peak();
+    wm_host_http_port = _port;
+    wm_start_webserver();
+    size_t heap_idle = wm_host_heap_used() - heap_base;
+    wm_webserver_reset_stats();
+
+    // Right below the load clients' addresses
+    client_t watcher = { .id = -1, .addr = htonl(INADDR_LOOPBACK + 8) };
+    conn_t events = { .fd = -1 };
+    if(!events_subscribe(&watcher, &events)) {
+        fprintf(stderr, "events: subscription failed\n");
+        watcher.errors++;
+    }
+
+    int64_t started = now_us();
+    for(int i = 0; i < clients; i++) {
+        client_t* client = &client_data[i];
+        client->id = i;
+        client->os = i % WM_PROBE_MAX;
+        client->addr = htonl(INADDR_LOOPBACK + 9 + i);
+        client->seed = i + 1;
+        client->page.fd = client->probe.fd = -1;
+        if(pthread_create(&threads[i], NULL, client_thread, client) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for(int i = 0; i < clients; i++) pthread_join(threads[i], NULL);
+    int64_t elapsed = now_us() - started;
+
+    if(events.fd >= 0 && !events_open(&events)) {
+        fprintf(stderr, "events: stream closed by the server\n");
+        watcher.errors++;
+    }
+    conn_close(&events);
+
+    // Stopped first: the last handlers may still be counting after their response went out
+    wm_stop_webserver();
+    wm_webserver_stats_t stats;
+    wm_webserver_get_stats(&stats);
+    size_t heap_peak = wm_host_heap_peak() - heap_base;
+
+    uint32_t errors = watcher.errors, reconnects = 0;
+    uint64_t bytes_received = watcher.bytes_received;
+    for(int i = 0; i < clients; i++) {
+        errors += client_data[i].errors;
+        reconnects += client_data[i].reconnects;
+        bytes_received += client_data[i].bytes_received;
+    }
+    qsort(_latencies_us, _requests, sizeof(uint32_t), compare_u32);
+
+    printf("requests:   %zu from %d clients, %u%% probes\n", _requests, clients, _probe_pct);
+    printf("throughput: %.0f requests/s\n", _requests * 1e6 / (elapsed ? elapsed : 1));
+    printf("latency:    p50 %u us, p90 %u us, p99 %u us, max %u us\n",
+        _latencies_us[_requests / 2], _latencies_us[_requests * 90 / 100],
+        _latencies_us[_requests * 99 / 100], _latencies_us[_requests - 1]);
+    printf("errors:     %u, %u keep-alive reconnects\n", errors, reconnects);
+    printf("sent:       %u bytes, %.0f per request (clients got %llu)\n", stats.bytes_sent,
+        stats.requests ? (double)stats.bytes_sent / stats.requests : 0.0, (unsigned long long)bytes_received);
+    printf("handlers:   %u requests, avg %.1f us, max %u us\n", stats.requests,
+        stats.requests ? (double)stats.request_time_us / stats.requests : 0.0, stats.request_time_max_us);
+    printf("sockets:    %u rejected, %u evicted\n", stats.rejected, stats.evicted);
+    printf("probes:     android %u, apple %u, windows %u, firefox %u\n", stats.probes[WM_PROBE_ANDROID],
+        stats.probes[WM_PROBE_APPLE], stats.probes[WM_PROBE_WINDOWS], stats.probes[WM_PROBE_FIREFOX]);
+    // Relative to what was in use before the server started, the bench's own buffers aside
+    printf("heap:       %zu bytes idle server, %zu bytes peak\n", heap_idle, heap_peak);
+
+    free(_latencies_us);
+    free(threads);
+    free(client_data);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,739 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+#include "esp_http_server.h"
+#include "esp_log.h"
+#include "wm_host.h"
+
+/*
+ * Stand-in for esp_http_server: one server thread multiplexing the listening
+ * socket, a control socket for queued work and up to max_open_sockets
+ * sessions with select(), like the httpd task. Requests are handled one at a
+ * time on that thread. Only what the component relies on is modelled: session
+ * contexts, open/close callbacks, send and receive overrides, LRU purge, error handlers,
+ * Content-Length request bodies and plain or chunked responses.
+ */
+
+static const char* TAG = "httpd";
+
+#define HTTPD_WORK_QUEUE_LEN 16
+#define HTTPD_RESP_HDR_MAX_LEN 512
+
+volatile uint16_t wm_host_http_port;
+
+typedef struct httpd_sess {
+    // -1 when the slot is free
+    int fd;
+    void* ctx;
+    httpd_free_ctx_fn_t free_ctx;
+    httpd_send_func_t send_fn;
+    httpd_recv_func_t recv_fn;
+    // Last use, for the LRU purge
+    uint64_t lru;
+    // Received bytes not consumed yet
+    char buf[HTTPD_MAX_REQ_HDR_LEN];
+    size_t buf_len;
+} httpd_sess_t;
+
+typedef struct httpd_req_aux {
+    httpd_sess_t* sess;
+    // Header lines of the request being handled, NUL-terminated
+    char headers[HTTPD_MAX_REQ_HDR_LEN];
+    // Body bytes the handler hasn't read
+    size_t remaining;
+    const char* status;
+    const char* type;
+    const char** resp_fields;
+    const char** resp_values;
+    uint16_t resp_hdr_count;
+    // Response headers sent with chunked encoding
+    bool chunked;
+} httpd_req_aux_t;
+
+typedef struct {
+    httpd_work_fn_t fn;
+    void* arg;
+} httpd_work_t;
+
+typedef struct httpd_data {
+    httpd_config_t config;
+    int listen_fd;
+    // Wakes the server thread up for queued work and stop
+    int ctrl_fd[2];
+    pthread_t thread;
+    volatile bool stop;
+
+    httpd_uri_t* uris;
+    uint16_t uri_count;
+    httpd_err_handler_func_t err_handlers[HTTPD_ERR_CODE_MAX];
+
+    httpd_sess_t* sessions;
+    uint64_t lru_counter;
+
+    pthread_mutex_t work_lock;
+    httpd_work_t work[HTTPD_WORK_QUEUE_LEN];
+    unsigned work_head;
+    unsigned work_count;
+
+    // Only one request is handled at a time
+    httpd_req_t req;
+    httpd_req_aux_t aux;
+} httpd_data_t;
+
+static const char* err_status[HTTPD_ERR_CODE_MAX] = {
+    [HTTPD_500_INTERNAL_SERVER_ERROR]    = "500 Internal Server Error",
+    [HTTPD_501_METHOD_NOT_IMPLEMENTED]   = "501 Method Not Implemented",
+    [HTTPD_505_VERSION_NOT_SUPPORTED]    = "505 Version Not Supported",
+    [HTTPD_400_BAD_REQUEST]              = "400 Bad Request",
+    [HTTPD_401_UNAUTHORIZED]             = "401 Unauthorized",
+    [HTTPD_403_FORBIDDEN]                = "403 Forbidden",
+    [HTTPD_404_NOT_FOUND]                = "404 Not Found",
+    [HTTPD_405_METHOD_NOT_ALLOWED]       = "405 Method Not Allowed",
+    [HTTPD_408_REQ_TIMEOUT]              = "408 Request Timeout",
+    [HTTPD_411_LENGTH_REQUIRED]          = "411 Length Required",
+    [HTTPD_414_URI_TOO_LONG]             = "414 URI Too Long",
+    [HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE] = "431 Request Header Fields Too Large",
+};
+
+static const char* method_names[] = {
+    [HTTP_DELETE] = "DELETE",
+    [HTTP_GET]    = "GET",
+    [HTTP_HEAD]   = "HEAD",
+    [HTTP_POST]   = "POST",
+    [HTTP_PUT]    = "PUT",
+};
+
+static httpd_sess_t* sess_get(httpd_data_t* hd, int fd) {
+    for(int i = 0; i < hd->config.max_open_sockets; i++) {
+        if(hd->sessions[i].fd == fd) return &hd->sessions[i];
+    }
+    return NULL;
+}
+
+static void sess_close(httpd_data_t* hd, httpd_sess_t* sess) {
+    int fd = sess->fd;
+    if(sess->ctx) {
+        if(sess->free_ctx) sess->free_ctx(sess->ctx);
+        else free(sess->ctx);
+    }
+    sess->fd = -1;
+    sess->ctx = NULL;
+    sess->free_ctx = NULL;
+    sess->buf_len = 0;
+
+    if(hd->config.close_fn) hd->config.close_fn(hd, fd);
+    else close(fd);
+}
+
+static int default_send(httpd_handle_t hd, int sockfd, const char* buf, size_t buf_len, int flags) {
+    if(buf == NULL) return HTTPD_SOCK_ERR_INVALID;
+    int ret = send(sockfd, buf, buf_len, flags);
+    if(ret < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+            ? HTTPD_SOCK_ERR_TIMEOUT
+            : HTTPD_SOCK_ERR_FAIL;
+    }
+    return ret;
+}
+
+static int default_recv(httpd_handle_t hd, int sockfd, char* buf, size_t buf_len, int flags) {
+    if(buf == NULL) return HTTPD_SOCK_ERR_INVALID;
+    int ret = recv(sockfd, buf, buf_len, flags);
+    if(ret < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+            ? HTTPD_SOCK_ERR_TIMEOUT
+            : HTTPD_SOCK_ERR_FAIL;
+    }
+    return ret;
+}
+
+static esp_err_t sess_send_all(httpd_data_t* hd, httpd_sess_t* sess, const char* buf, size_t len) {
+    while(len > 0) {
+        int ret = sess->send_fn(hd, sess->fd, buf, len, 0);
+        if(ret < 0) return ESP_ERR_HTTPD_RESP_SEND;
+        buf += ret;
+        len -= ret;
+    }
+    return ESP_OK;
+}
+
+/*
+ * Status line and headers. 'content_len' < 0 starts a chunked response.
+ */
+static esp_err_t resp_send_headers(httpd_req_t* r, ssize_t content_len) {
+    httpd_req_aux_t* aux = r->aux;
+    char head[HTTPD_RESP_HDR_MAX_LEN];
+    int len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: %s\r\n", aux->status, aux->type);
+    if(content_len < 0) {
+        len += snprintf(head + len, sizeof(head) - len, "Transfer-Encoding: chunked\r\n");
+    } else {
+        len += snprintf(head + len, sizeof(head) - len, "Content-Length: %zd\r\n", content_len);
+    }
+    for(int i = 0; i < aux->resp_hdr_count && len < sizeof(head); i++) {
+        len += snprintf(head + len, sizeof(head) - len, "%s: %s\r\n", aux->resp_fields[i], aux->resp_values[i]);
+    }
+    if(len + 2 >= sizeof(head)) return ESP_ERR_HTTPD_RESP_HDR;
+    len += snprintf(head + len, sizeof(head) - len, "\r\n");
+    return sess_send_all(r->handle, aux->sess, head, len);
+}
+
+esp_err_t httpd_resp_send(httpd_req_t* r, const char* buf, ssize_t buf_len) {
+    if(buf_len == HTTPD_RESP_USE_STRLEN) buf_len = buf ? strlen(buf) : 0;
+    esp_err_t err = resp_send_headers(r, buf_len);
+    if(err != ESP_OK) return err;
+    if(buf == NULL || buf_len == 0) return ESP_OK;
+    return sess_send_all(r->handle, ((httpd_req_aux_t*)r->aux)->sess, buf, buf_len);
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t* r, const char* buf, ssize_t buf_len) {
+    httpd_req_aux_t* aux = r->aux;
+    if(buf_len == HTTPD_RESP_USE_STRLEN) buf_len = buf ? strlen(buf) : 0;
+    if(!aux->chunked) {
+        esp_err_t err = resp_send_headers(r, -1);
+        if(err != ESP_OK) return err;
+        aux->chunked = true;
+    }
+
+    char size[12];
+    int size_len = snprintf(size, sizeof(size), "%zx\r\n", buf_len);
+    if(sess_send_all(r->handle, aux->sess, size, size_len) != ESP_OK) return ESP_ERR_HTTPD_RESP_SEND;
+    if(buf != NULL && buf_len > 0 && sess_send_all(r->handle, aux->sess, buf, buf_len) != ESP_OK) {
+        return ESP_ERR_HTTPD_RESP_SEND;
+    }
+    return sess_send_all(r->handle, aux->sess, "\r\n", 2);
+}
+
+esp_err_t httpd_resp_sendstr(httpd_req_t* r, const char* str) {
+    return httpd_resp_send(r, str, str ? strlen(str) : 0);
+}
+
+esp_err_t httpd_resp_sendstr_chunk(httpd_req_t* r, const char* str) {
+    return httpd_resp_send_chunk(r, str, str ? strlen(str) : 0);
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t* r, const char* status) {
+    ((httpd_req_aux_t*)r->aux)->status = status;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t* r, const char* type) {
+    ((httpd_req_aux_t*)r->aux)->type = type;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t* r, const char* field, const char* value) {
+    httpd_req_aux_t* aux = r->aux;
+    httpd_data_t* hd = r->handle;
+    if(aux->resp_hdr_count >= hd->config.max_resp_headers) return ESP_ERR_HTTPD_RESP_HDR;
+    // Kept by reference, as on the device
+    aux->resp_fields[aux->resp_hdr_count] = field;
+    aux->resp_values[aux->resp_hdr_count] = value;
+    aux->resp_hdr_count++;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t* req, httpd_err_code_t error, const char* msg) {
+    if(error >= HTTPD_ERR_CODE_MAX) return ESP_ERR_INVALID_ARG;
+    httpd_resp_set_status(req, err_status[error]);
+    httpd_resp_set_type(req, HTTPD_TYPE_TEXT);
+    esp_err_t err = httpd_resp_sendstr(req, msg ? msg : err_status[error]);
+    switch(error) {
+        // Malformed requests, the session is closed
+        case HTTPD_501_METHOD_NOT_IMPLEMENTED:
+        case HTTPD_505_VERSION_NOT_SUPPORTED:
+        case HTTPD_400_BAD_REQUEST:
+        case HTTPD_414_URI_TOO_LONG:
+        case HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE:
+            return ESP_FAIL;
+        default:
+            return err;
+    }
+}
+
+esp_err_t httpd_resp_send_404(httpd_req_t* r) {
+    return httpd_resp_send_err(r, HTTPD_404_NOT_FOUND, NULL);
+}
+
+esp_err_t httpd_resp_send_408(httpd_req_t* r) {
+    return httpd_resp_send_err(r, HTTPD_408_REQ_TIMEOUT, NULL);
+}
+
+esp_err_t httpd_resp_send_500(httpd_req_t* r) {
+    return httpd_resp_send_err(r, HTTPD_500_INTERNAL_SERVER_ERROR, NULL);
+}
+
+/*
+ * Value of header 'field' of the current request, or NULL
+ */
+static const char* req_hdr_value(httpd_req_t* r, const char* field) {
+    httpd_req_aux_t* aux = r->aux;
+    size_t field_len = strlen(field);
+    for(const char* line = aux->headers; *line; line += strlen(line) + 1) {
+        if(strncasecmp(line, field, field_len) != 0 || line[field_len] != ':') continue;
+        const char* value = line + field_len + 1;
+        while(*value == ' ' || *value == '\t') value++;
+        return value;
+    }
+    return NULL;
+}
+
+size_t httpd_req_get_hdr_value_len(httpd_req_t* r, const char* field) {
+    const char* value = req_hdr_value(r, field);
+    return value ? strlen(value) : 0;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t* r, const char* field, char* val, size_t val_size) {
+    const char* value = req_hdr_value(r, field);
+    if(value == NULL) return ESP_ERR_NOT_FOUND;
+    if(val_size == 0) return ESP_ERR_INVALID_ARG;
+    size_t len = strlen(value);
+    size_t copy = len < val_size ? len : val_size - 1;
+    memcpy(val, value, copy);
+    val[copy] = '\0';
+    return copy < len ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+int httpd_req_recv(httpd_req_t* r, char* buf, size_t buf_len) {
+    httpd_req_aux_t* aux = r->aux;
+    httpd_sess_t* sess = aux->sess;
+    if(buf_len > aux->remaining) buf_len = aux->remaining;
+    if(buf_len == 0) return 0;
+
+    // Body bytes that came with the headers first
+    if(sess->buf_len > 0) {
+        size_t len = buf_len < sess->buf_len ? buf_len : sess->buf_len;
+        memcpy(buf, sess->buf, len);
+        memmove(sess->buf, sess->buf + len, sess->buf_len - len);
+        sess->buf_len -= len;
+        aux->remaining -= len;
+        return len;
+    }
+
+    int ret = sess->recv_fn(r->handle, sess->fd, buf, buf_len, 0);
+    if(ret < 0) return ret;
+    aux->remaining -= ret;
+    return ret;
+}
+
+int httpd_req_to_sockfd(httpd_req_t* r) {
+    return ((httpd_req_aux_t*)r->aux)->sess->fd;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t* uri_handler) {
+    httpd_data_t* hd = handle;
+    for(int i = 0; i < hd->uri_count; i++) {
+        if(hd->uris[i].method == uri_handler->method && strcmp(hd->uris[i].uri, uri_handler->uri) == 0) {
+            return ESP_ERR_HTTPD_HANDLER_EXISTS;
+        }
+    }
+    if(hd->uri_count >= hd->config.max_uri_handlers) return ESP_ERR_HTTPD_HANDLERS_FULL;
+
+    // The URI string is copied, as on the device
+    httpd_uri_t* uri = &hd->uris[hd->uri_count];
+    *uri = *uri_handler;
+    uri->uri = strdup(uri_handler->uri);
+    if(uri->uri == NULL) return ESP_ERR_HTTPD_ALLOC_MEM;
+    hd->uri_count++;
+    return ESP_OK;
+}
+
+esp_err_t httpd_register_err_handler(httpd_handle_t handle, httpd_err_code_t error, httpd_err_handler_func_t handler_fn) {
+    httpd_data_t* hd = handle;
+    if(error >= HTTPD_ERR_CODE_MAX) return ESP_ERR_INVALID_ARG;
+    hd->err_handlers[error] = handler_fn;
+    return ESP_OK;
+}
+
+static esp_err_t req_handle_err(httpd_data_t* hd, httpd_req_t* req, httpd_err_code_t error) {
+    if(hd->err_handlers[error]) return hd->err_handlers[error](req, error);
+    return httpd_resp_send_err(req, error, NULL);
+}
+
+static const httpd_uri_t* uri_find(httpd_data_t* hd, const char* uri, int method, httpd_err_code_t* err) {
+    // The query string isn't part of the match
+    size_t len = strcspn(uri, "?");
+    *err = HTTPD_404_NOT_FOUND;
+    for(int i = 0; i < hd->uri_count; i++) {
+        const httpd_uri_t* handler = &hd->uris[i];
+        bool match = hd->config.uri_match_fn
+            ? hd->config.uri_match_fn(handler->uri, uri, len)
+            : strlen(handler->uri) == len && strncmp(handler->uri, uri, len) == 0;
+        if(!match) continue;
+        if(handler->method == method) return handler;
+        *err = HTTPD_405_METHOD_NOT_ALLOWED;
+    }
+    return NULL;
+}
+
+/*
+ * Parse and handle the request whose headers are the first 'hdr_len' bytes
+ * of the session buffer. Returns ESP_FAIL if the session must be closed.
+ */
+static esp_err_t sess_handle_request(httpd_data_t* hd, httpd_sess_t* sess, size_t hdr_len) {
+    httpd_req_t* req = &hd->req;
+    httpd_req_aux_t* aux = &hd->aux;
+    memset(req, 0, sizeof(*req));
+    req->handle = hd;
+    req->aux = aux;
+    req->sess_ctx = sess->ctx;
+    req->free_ctx = sess->free_ctx;
+    aux->sess = sess;
+    aux->status = "200 OK";
+    aux->type = HTTPD_TYPE_TEXT;
+    aux->resp_hdr_count = 0;
+    aux->chunked = false;
+    aux->remaining = 0;
+
+    // Request line and header lines, each NUL-terminated, then an empty one
+    char line[HTTPD_MAX_REQ_HDR_LEN];
+    memcpy(line, sess->buf, hdr_len);
+    memmove(sess->buf, sess->buf + hdr_len, sess->buf_len - hdr_len);
+    sess->buf_len -= hdr_len;
+    line[hdr_len - 4] = '\0';
+
+    char* headers = strstr(line, "\r\n");
+    if(headers) {
+        *headers = '\0';
+        headers += 2;
+    } else {
+        headers = line + strlen(line);
+    }
+    size_t headers_len = 0;
+    for(char* h = strtok(headers, "\r\n"); h != NULL; h = strtok(NULL, "\r\n")) {
+        size_t len = strlen(h) + 1;
+        memcpy(aux->headers + headers_len, h, len);
+        headers_len += len;
+    }
+    aux->headers[headers_len] = '\0';
+
+    char* method = line;
+    char* uri = strchr(method, ' ');
+    char* version = uri ? strchr(uri + 1, ' ') : NULL;
+    if(version == NULL) return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, NULL);
+    *uri++ = '\0';
+    *version++ = '\0';
+    if(strncmp(version, "HTTP/1.", 7) != 0) return httpd_resp_send_err(req, HTTPD_505_VERSION_NOT_SUPPORTED, NULL);
+
+    req->method = -1;
+    for(int i = 0; i < sizeof(method_names) / sizeof(method_names[0]); i++) {
+        if(strcmp(method, method_names[i]) == 0) req->method = i;
+    }
+    if(req->method < 0) return httpd_resp_send_err(req, HTTPD_501_METHOD_NOT_IMPLEMENTED, NULL);
+    if(strlen(uri) > HTTPD_MAX_URI_LEN) return httpd_resp_send_err(req, HTTPD_414_URI_TOO_LONG, NULL);
+    strcpy((char*)req->uri, uri);
+
+    const char* content_len = req_hdr_value(req, "Content-Length");
+    req->content_len = content_len ? strtoul(content_len, NULL, 10) : 0;
+    aux->remaining = req->content_len;
+
+    httpd_err_code_t error;
+    const httpd_uri_t* handler = uri_find(hd, req->uri, req->method, &error);
+    esp_err_t ret;
+    if(handler) {
+        req->user_ctx = handler->user_ctx;
+        ret = handler->handler(req);
+    } else {
+        ret = req_handle_err(hd, req, error);
+    }
+
+    // Session context set by the handler
+    if(sess->ctx != req->sess_ctx) {
+        if(sess->ctx) {
+            if(sess->free_ctx) sess->free_ctx(sess->ctx);
+            else free(sess->ctx);
+        }
+        sess->ctx = req->sess_ctx;
+    }
+    sess->free_ctx = req->free_ctx;
+    if(ret != ESP_OK) return ESP_FAIL;
+
+    // Drop what the handler left of the body
+    char discard[128];
+    while(aux->remaining > 0) {
+        if(httpd_req_recv(req, discard, sizeof(discard)) <= 0) return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/*
+ * Read from a session and handle every complete request received
+ */
+static void sess_process(httpd_data_t* hd, httpd_sess_t* sess) {
+    int ret = sess->recv_fn(hd, sess->fd, sess->buf + sess->buf_len, sizeof(sess->buf) - sess->buf_len, 0);
+    if(ret <= 0) {
+        ESP_LOGD(TAG, "Session %d closed by peer", sess->fd);
+        sess_close(hd, sess);
+        return;
+    }
+    sess->buf_len += ret;
+    sess->lru = ++hd->lru_counter;
+
+    while(sess->fd >= 0) {
+        char* end = memmem(sess->buf, sess->buf_len, "\r\n\r\n", 4);
+        if(end == NULL) {
+            if(sess->buf_len == sizeof(sess->buf)) {
+                ESP_LOGW(TAG, "Request headers too long on session %d", sess->fd);
+                sess_close(hd, sess);
+            }
+            return;
+        }
+        if(sess_handle_request(hd, sess, end + 4 - sess->buf) != ESP_OK) {
+            sess_close(hd, sess);
+            return;
+        }
+    }
+}
+
+static void sess_accept(httpd_data_t* hd) {
+    httpd_sess_t* sess = sess_get(hd, -1);
+    if(sess == NULL && hd->config.lru_purge_enable) {
+        for(int i = 0; i < hd->config.max_open_sockets; i++) {
+            if(sess == NULL || hd->sessions[i].lru < sess->lru) sess = &hd->sessions[i];
+        }
+        ESP_LOGD(TAG, "No free session, closing the least recently used one (%d)", sess->fd);
+        sess_close(hd, sess);
+    }
+    if(sess == NULL) return;
+
+    int fd = accept(hd->listen_fd, NULL, NULL);
+    if(fd < 0) return;
+
+    struct timeval timeout = { .tv_sec = hd->config.recv_wait_timeout };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    timeout.tv_sec = hd->config.send_wait_timeout;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    // Headers and body are separate writes: with Nagle, delayed ACKs on the
+    // host would hold the body back and measure nothing but the ACK timer
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    sess->fd = fd;
+    sess->send_fn = default_send;
+    sess->recv_fn = default_recv;
+    sess->buf_len = 0;
+    sess->lru = ++hd->lru_counter;
+    if(hd->config.open_fn && hd->config.open_fn(hd, fd) != ESP_OK) {
+        ESP_LOGD(TAG, "Session %d refused by open_fn", fd);
+        sess_close(hd, sess);
+    }
+}
+
+static void run_work(httpd_data_t* hd) {
+    char drain[16];
+    while(recv(hd->ctrl_fd[0], drain, sizeof(drain), MSG_DONTWAIT) > 0);
+
+    while(true) {
+        pthread_mutex_lock(&hd->work_lock);
+        if(hd->work_count == 0) {
+            pthread_mutex_unlock(&hd->work_lock);
+            return;
+        }
+        httpd_work_t work = hd->work[hd->work_head];
+        hd->work_head = (hd->work_head + 1) % HTTPD_WORK_QUEUE_LEN;
+        hd->work_count--;
+        pthread_mutex_unlock(&hd->work_lock);
+        work.fn(work.arg);
+    }
+}
+
+static void* httpd_thread(void* arg) {
+    httpd_data_t* hd = arg;
+    while(!hd->stop) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(hd->ctrl_fd[0], &fds);
+        int max_fd = hd->ctrl_fd[0];
+        // Without LRU purge nothing is accepted while all sessions are taken
+        if(hd->config.lru_purge_enable || sess_get(hd, -1) != NULL) {
+            FD_SET(hd->listen_fd, &fds);
+            if(hd->listen_fd > max_fd) max_fd = hd->listen_fd;
+        }
+        for(int i = 0; i < hd->config.max_open_sockets; i++) {
+            int fd = hd->sessions[i].fd;
+            if(fd < 0) continue;
+            FD_SET(fd, &fds);
+            if(fd > max_fd) max_fd = fd;
+        }
+
+        if(select(max_fd + 1, &fds, NULL, NULL, NULL) < 0) {
+            if(errno == EINTR) continue;
+            ESP_LOGE(TAG, "select() failed: %s", strerror(errno));
+            break;
+        }
+        if(FD_ISSET(hd->ctrl_fd[0], &fds)) run_work(hd);
+        if(hd->stop) break;
+
+        for(int i = 0; i < hd->config.max_open_sockets; i++) {
+            httpd_sess_t* sess = &hd->sessions[i];
+            // A session closed by earlier work may have had its fd reused
+            if(sess->fd >= 0 && FD_ISSET(sess->fd, &fds)) {
+                FD_CLR(sess->fd, &fds);
+                sess_process(hd, sess);
+            }
+        }
+        if(FD_ISSET(hd->listen_fd, &fds)) sess_accept(hd);
+    }
+    return NULL;
+}
+
+esp_err_t httpd_queue_work(httpd_handle_t handle, httpd_work_fn_t work, void* arg) {
+    httpd_data_t* hd = handle;
+    if(hd == NULL || work == NULL) return ESP_ERR_INVALID_ARG;
+
+    pthread_mutex_lock(&hd->work_lock);
+    if(hd->work_count == HTTPD_WORK_QUEUE_LEN) {
+        pthread_mutex_unlock(&hd->work_lock);
+        return ESP_FAIL;
+    }
+    hd->work[(hd->work_head + hd->work_count) % HTTPD_WORK_QUEUE_LEN] = (httpd_work_t){ work, arg };
+    hd->work_count++;
+    pthread_mutex_unlock(&hd->work_lock);
+
+    char wake = 0;
+    send(hd->ctrl_fd[1], &wake, 1, MSG_DONTWAIT);
+    return ESP_OK;
+}
+
+typedef struct {
+    httpd_data_t* hd;
+    int fd;
+} httpd_close_work_t;
+
+static void close_work(void* arg) {
+    httpd_close_work_t* work = arg;
+    httpd_sess_t* sess = sess_get(work->hd, work->fd);
+    if(sess) sess_close(work->hd, sess);
+    free(work);
+}
+
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd) {
+    httpd_data_t* hd = handle;
+    if(sockfd < 0 || sess_get(hd, sockfd) == NULL) return ESP_ERR_NOT_FOUND;
+
+    // Closed from the server thread once the current request is done
+    httpd_close_work_t* work = malloc(sizeof(httpd_close_work_t));
+    if(work == NULL) return ESP_ERR_NO_MEM;
+    work->hd = hd;
+    work->fd = sockfd;
+    esp_err_t err = httpd_queue_work(hd, close_work, work);
+    if(err != ESP_OK) free(work);
+    return err;
+}
+
+esp_err_t httpd_sess_set_send_override(httpd_handle_t hd, int sockfd, httpd_send_func_t send_func) {
+    httpd_sess_t* sess = sockfd < 0 ? NULL : sess_get(hd, sockfd);
+    if(sess == NULL) return ESP_ERR_INVALID_ARG;
+    sess->send_fn = send_func;
+    return ESP_OK;
+}
+
+esp_err_t httpd_sess_set_recv_override(httpd_handle_t hd, int sockfd, httpd_recv_func_t recv_func) {
+    httpd_sess_t* sess = sockfd < 0 ? NULL : sess_get(hd, sockfd);
+    if(sess == NULL) return ESP_ERR_INVALID_ARG;
+    sess->recv_fn = recv_func;
+    return ESP_OK;
+}
+
+int httpd_socket_send(httpd_handle_t hd, int sockfd, const char* buf, size_t buf_len, int flags) {
+    httpd_sess_t* sess = sockfd < 0 ? NULL : sess_get(hd, sockfd);
+    if(sess == NULL) return HTTPD_SOCK_ERR_INVALID;
+    return sess->send_fn(hd, sockfd, buf, buf_len, flags);
+}
+
+static void httpd_free(httpd_data_t* hd) {
+    if(hd->listen_fd >= 0) close(hd->listen_fd);
+    if(hd->ctrl_fd[0] >= 0) close(hd->ctrl_fd[0]);
+    if(hd->ctrl_fd[1] >= 0) close(hd->ctrl_fd[1]);
+    for(int i = 0; i < hd->uri_count; i++) free((char*)hd->uris[i].uri);
+    free(hd->uris);
+    free(hd->sessions);
+    free(hd->aux.resp_fields);
+    free(hd->aux.resp_values);
+    pthread_mutex_destroy(&hd->work_lock);
+    free(hd);
+}
+
+esp_err_t httpd_start(httpd_handle_t* handle, const httpd_config_t* config) {
+    // Clients going away mid-response must fail send(), not kill the process
+    signal(SIGPIPE, SIG_IGN);
+
+    httpd_data_t* hd = calloc(1, sizeof(httpd_data_t));
+    if(hd == NULL) return ESP_ERR_HTTPD_ALLOC_MEM;
+    hd->config = *config;
+    hd->listen_fd = hd->ctrl_fd[0] = hd->ctrl_fd[1] = -1;
+    pthread_mutex_init(&hd->work_lock, NULL);
+    hd->uris = calloc(config->max_uri_handlers, sizeof(httpd_uri_t));
+    hd->sessions = calloc(config->max_open_sockets, sizeof(httpd_sess_t));
+    hd->aux.resp_fields = calloc(config->max_resp_headers, sizeof(char*));
+    hd->aux.resp_values = calloc(config->max_resp_headers, sizeof(char*));
+    if(!hd->uris || !hd->sessions || !hd->aux.resp_fields || !hd->aux.resp_values) {
+        httpd_free(hd);
+        return ESP_ERR_HTTPD_ALLOC_MEM;
+    }
+    for(int i = 0; i < config->max_open_sockets; i++) hd->sessions[i].fd = -1;
+
+    // Loopback only: the host build is for tests and benchmarks
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(wm_host_http_port ? wm_host_http_port : config->server_port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    int one = 1;
+    hd->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(hd->listen_fd < 0
+            || setsockopt(hd->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0
+            || bind(hd->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+            || listen(hd->listen_fd, config->backlog_conn) != 0
+            || socketpair(AF_UNIX, SOCK_STREAM, 0, hd->ctrl_fd) != 0) {
+        ESP_LOGE(TAG, "Can't listen on port %d: %s", ntohs(addr.sin_port), strerror(errno));
+        httpd_free(hd);
+        return ESP_FAIL;
+    }
+
+    if(pthread_create(&hd->thread, NULL, httpd_thread, hd) != 0) {
+        httpd_free(hd);
+        return ESP_ERR_HTTPD_TASK;
+    }
+    *handle = hd;
+    return ESP_OK;
+}
+
+static void stop_work(void* arg) {
+    ((httpd_data_t*)arg)->stop = true;
+}
+
+esp_err_t httpd_stop(httpd_handle_t handle) {
+    httpd_data_t* hd = handle;
+    if(hd == NULL) return ESP_ERR_INVALID_ARG;
+    if(httpd_queue_work(hd, stop_work, hd) != ESP_OK) {
+        // Queue full: the flag is enough, the thread checks it after the work
+        hd->stop = true;
+        char wake = 0;
+        send(hd->ctrl_fd[1], &wake, 1, MSG_DONTWAIT);
+    }
+    pthread_join(hd->thread, NULL);
+
+    for(int i = 0; i < hd->config.max_open_sockets; i++) {
+        if(hd->sessions[i].fd >= 0) sess_close(hd, &hd->sessions[i]);
+    }
+    // Work queued after the thread stopped, close requests included
+    while(hd->work_count > 0) {
+        httpd_work_t work = hd->work[hd->work_head];
+        hd->work_head = (hd->work_head + 1) % HTTPD_WORK_QUEUE_LEN;
+        hd->work_count--;
+        if(work.fn == close_work) free(work.arg);
+    }
+    httpd_free(hd);
+    return ESP_OK;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdio.h>
+
+typedef enum {
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+// Printed to stderr up to WM_HOST_LOG (environment, 0-5, default 2: warnings)
+void wm_host_log(esp_log_level_t level, const char* tag, const char* fmt, ...)
+    __attribute__ ((format (printf, 3, 4)));
+
+#define ESP_LOGE(tag, fmt, ...) wm_host_log(ESP_LOG_ERROR, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) wm_host_log(ESP_LOG_WARN, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) wm_host_log(ESP_LOG_INFO, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) wm_host_log(ESP_LOG_DEBUG, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...) wm_host_log(ESP_LOG_VERBOSE, tag, fmt, ##__VA_ARGS__)
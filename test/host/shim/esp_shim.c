@@ -0,0 +1,83 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "tcpip_adapter.h"
+#include "wm_host.h"
+
+volatile int64_t wm_host_time_offset_us;
+volatile uint32_t wm_host_ap_addr = 0x0104A8C0;    // 192.168.4.1
+volatile uint32_t wm_host_sta_addr;
+volatile uint32_t wm_host_sta_dns;
+
+int64_t esp_timer_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000 + wm_host_time_offset_us;
+}
+
+uint32_t esp_random(void) {
+    return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+const char* esp_err_to_name(esp_err_t code) {
+    switch(code) {
+        case ESP_OK: return "ESP_OK";
+        case ESP_FAIL: return "ESP_FAIL";
+        case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+        default: return "UNKNOWN ERROR";
+    }
+}
+
+void wm_host_log(esp_log_level_t level, const char* tag, const char* fmt, ...) {
+    static int max_level = -1;
+    if(max_level < 0) {
+        const char* env = getenv("WM_HOST_LOG");
+        max_level = env ? atoi(env) : ESP_LOG_WARN;
+    }
+    if(level > max_level) return;
+
+    static const char letters[] = "NEWIDV";
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "%c (%s) ", letters[level], tag);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+esp_err_t tcpip_adapter_get_ip_info(tcpip_adapter_if_t tcpip_if, tcpip_adapter_ip_info_t* ip_info) {
+    if(tcpip_if >= TCPIP_ADAPTER_IF_MAX) return ESP_ERR_INVALID_ARG;
+    ip_info->ip.addr = tcpip_if == TCPIP_ADAPTER_IF_AP ? wm_host_ap_addr
+        : tcpip_if == TCPIP_ADAPTER_IF_STA ? wm_host_sta_addr : 0;
+    ip_info->netmask.addr = ip_info->ip.addr ? 0x00FFFFFF : 0;
+    ip_info->gw.addr = 0;
+    return ESP_OK;
+}
+
+esp_err_t tcpip_adapter_get_dns_info(tcpip_adapter_if_t tcpip_if, tcpip_adapter_dns_type_t type,
+        tcpip_adapter_dns_info_t* dns) {
+    if(tcpip_if >= TCPIP_ADAPTER_IF_MAX || type >= TCPIP_ADAPTER_DNS_MAX) return ESP_ERR_INVALID_ARG;
+    dns->ip.type = 0;
+    dns->ip.u_addr.ip4.addr = tcpip_if == TCPIP_ADAPTER_IF_STA && type == TCPIP_ADAPTER_DNS_MAIN
+        ? wm_host_sta_dns : 0;
+    return ESP_OK;
+}
+
+char* ip4addr_ntoa(const ip4_addr_t* addr) {
+    static char buf[16];
+    const uint8_t* b = (const uint8_t*)&addr->addr;
+    snprintf(buf, sizeof(buf), "%u.%u.%u.%u", b[0], b[1], b[2], b[3]);
+    return buf;
+}
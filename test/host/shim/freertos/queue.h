@@ -0,0 +1,5 @@
+#pragma once
+
+// Queues are not used, the header only has to exist
+
+#include "FreeRTOS.h"
@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+
+struct host_semaphore {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned count;
+};
+
+struct host_event_group {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    EventBits_t bits;
+};
+
+typedef struct {
+    TaskFunction_t fn;
+    void* arg;
+} host_task_t;
+
+// Where vTaskDelete(NULL) returns to. pthread_exit() trips ASan on some toolchains
+static __thread jmp_buf _task_exit;
+
+static pthread_mutex_t _critical = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+/*
+ * Absolute CLOCK_MONOTONIC deadline 'ticks' ms from now
+ */
+static void deadline(struct timespec* ts, TickType_t ticks) {
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += ticks / 1000;
+    ts->tv_nsec += (ticks % 1000) * 1000000L;
+    if(ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static void cond_init(pthread_cond_t* cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+void portENTER_CRITICAL(portMUX_TYPE* mux) {
+    pthread_mutex_lock(&_critical);
+}
+
+void portEXIT_CRITICAL(portMUX_TYPE* mux) {
+    pthread_mutex_unlock(&_critical);
+}
+
+static void* task_entry(void* arg) {
+    host_task_t task = *(host_task_t*)arg;
+    free(arg);
+    if(setjmp(_task_exit) == 0) task.fn(task.arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char* name, uint32_t stack_depth, void* arg,
+        UBaseType_t priority, TaskHandle_t* handle) {
+    host_task_t* task = malloc(sizeof(host_task_t));
+    if(task == NULL) return pdFAIL;
+    task->fn = fn;
+    task->arg = arg;
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, task_entry, task) != 0) {
+        free(task);
+        return pdFAIL;
+    }
+    pthread_detach(thread);
+    if(handle) *handle = (TaskHandle_t)thread;
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    if(task == NULL) longjmp(_task_exit, 1);
+}
+
+void vTaskDelay(TickType_t ticks) {
+    usleep(ticks * 1000UL);
+}
+
+TickType_t xTaskGetTickCount(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+    // Unknown on the host
+    return 0;
+}
+
+static SemaphoreHandle_t semaphore_create(unsigned count) {
+    SemaphoreHandle_t sem = calloc(1, sizeof(struct host_semaphore));
+    if(sem == NULL) return NULL;
+    pthread_mutex_init(&sem->lock, NULL);
+    cond_init(&sem->cond);
+    sem->count = count;
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return semaphore_create(1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+    return semaphore_create(0);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) {
+    struct timespec ts;
+    deadline(&ts, ticks);
+    pthread_mutex_lock(&sem->lock);
+    while(sem->count == 0) {
+        if(ticks == portMAX_DELAY) {
+            pthread_cond_wait(&sem->cond, &sem->lock);
+        } else if(pthread_cond_timedwait(&sem->cond, &sem->lock, &ts) == ETIMEDOUT) {
+            break;
+        }
+    }
+    BaseType_t taken = sem->count > 0;
+    if(taken) sem->count--;
+    pthread_mutex_unlock(&sem->lock);
+    return taken ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+    pthread_mutex_lock(&sem->lock);
+    BaseType_t given = sem->count == 0;
+    sem->count = 1;
+    pthread_cond_signal(&sem->cond);
+    pthread_mutex_unlock(&sem->lock);
+    return given ? pdTRUE : pdFALSE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem) {
+    pthread_cond_destroy(&sem->cond);
+    pthread_mutex_destroy(&sem->lock);
+    free(sem);
+}
+
+EventGroupHandle_t xEventGroupCreate(void) {
+    EventGroupHandle_t group = calloc(1, sizeof(struct host_event_group));
+    if(group == NULL) return NULL;
+    pthread_mutex_init(&group->lock, NULL);
+    cond_init(&group->cond);
+    return group;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group) {
+    pthread_cond_destroy(&group->cond);
+    pthread_mutex_destroy(&group->lock);
+    free(group);
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group) {
+    pthread_mutex_lock(&group->lock);
+    EventBits_t bits = group->bits;
+    pthread_mutex_unlock(&group->lock);
+    return bits;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits) {
+    pthread_mutex_lock(&group->lock);
+    group->bits |= bits;
+    bits = group->bits;
+    pthread_cond_broadcast(&group->cond);
+    pthread_mutex_unlock(&group->lock);
+    return bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits) {
+    pthread_mutex_lock(&group->lock);
+    EventBits_t previous = group->bits;
+    group->bits &= ~bits;
+    pthread_mutex_unlock(&group->lock);
+    return previous;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear,
+        BaseType_t wait_all, TickType_t ticks) {
+    struct timespec ts;
+    deadline(&ts, ticks);
+    pthread_mutex_lock(&group->lock);
+    for(;;) {
+        EventBits_t set = group->bits & bits;
+        if(wait_all ? set == bits : set != 0) {
+            EventBits_t result = group->bits;
+            if(clear) group->bits &= ~bits;
+            pthread_mutex_unlock(&group->lock);
+            return result;
+        }
+        if(ticks == portMAX_DELAY) {
+            pthread_cond_wait(&group->cond, &group->lock);
+        } else if(pthread_cond_timedwait(&group->cond, &group->lock, &ts) == ETIMEDOUT) {
+            break;
+        }
+    }
+    EventBits_t result = group->bits;
+    pthread_mutex_unlock(&group->lock);
+    return result;
+}
@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "esp_system.h"
+#include "wm_host.h"
+
+/*
+ * Heap accounting through the linker: programs linked with
+ * -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free get their
+ * allocations counted here. Allocations made inside libc aren't seen.
+ */
+
+// About what an ESP32 has left for applications with WiFi up
+size_t wm_host_heap_size = 160 * 1024;
+
+static size_t _used;
+static size_t _peak;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void __real_free(void* ptr);
+
+static void heap_add(void* ptr) {
+    if(ptr == NULL) return;
+    size_t used = __atomic_add_fetch(&_used, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&_peak, __ATOMIC_RELAXED);
+    while(used > peak && !__atomic_compare_exchange_n(&_peak, &peak, used, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void heap_sub(void* ptr) {
+    if(ptr == NULL) return;
+    __atomic_sub_fetch(&_used, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+}
+
+void* __wrap_malloc(size_t size) {
+    void* ptr = __real_malloc(size);
+    heap_add(ptr);
+    return ptr;
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    void* ptr = __real_calloc(count, size);
+    heap_add(ptr);
+    return ptr;
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    heap_sub(ptr);
+    void* new_ptr = __real_realloc(ptr, size);
+    // On failure the old block is still there
+    heap_add(new_ptr != NULL || size == 0 ? new_ptr : ptr);
+    return new_ptr;
+}
+
+void __wrap_free(void* ptr) {
+    heap_sub(ptr);
+    __real_free(ptr);
+}
+
+size_t wm_host_heap_used(void) {
+    return __atomic_load_n(&_used, __ATOMIC_RELAXED);
+}
+
+size_t wm_host_heap_peak(void) {
+    return __atomic_load_n(&_peak, __ATOMIC_RELAXED);
+}
+
+void wm_host_heap_reset_peak(void) {
+    __atomic_store_n(&_peak, wm_host_heap_used(), __ATOMIC_RELAXED);
+}
+
+uint32_t esp_get_free_heap_size(void) {
+    size_t used = wm_host_heap_used();
+    return used < wm_host_heap_size ? wm_host_heap_size - used : 0;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void) {
+    size_t peak = wm_host_heap_peak();
+    return peak < wm_host_heap_size ? wm_host_heap_size - peak : 0;
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+// Nothing used from lwIP error codes, the header only has to exist
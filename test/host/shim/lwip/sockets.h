@@ -0,0 +1,16 @@
+#pragma once
+
+/*
+ * lwIP sockets are BSD sockets. lwIP's sockaddr_in has a sin_len field Linux
+ * doesn't have: it lands in sin_zero, which Linux ignores.
+ */
+
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define sin_len sin_zero[0]
@@ -0,0 +1,52 @@
+#pragma once
+
+/*
+ * Host build configuration: Kconfig defaults of the options the host targets
+ * use. Override any of them with -D on the compiler command line.
+ */
+
+#ifndef CONFIG_WM_AP_DNS_URL
+#define CONFIG_WM_AP_DNS_URL "http://esp32.config"
+#endif
+#ifndef CONFIG_WM_DNS_NODATA_IPV6_HTTPS
+#define CONFIG_WM_DNS_NODATA_IPV6_HTTPS 1
+#endif
+#ifndef CONFIG_WM_DNS_NODATA_UNKNOWN
+#define CONFIG_WM_DNS_NODATA_UNKNOWN 1
+#endif
+#ifndef CONFIG_WM_DNS_NEGATIVE_TTL
+#define CONFIG_WM_DNS_NEGATIVE_TTL 10
+#endif
+#if !defined(CONFIG_WM_DNS_UNSUPPORTED_OPCODE_NOTIMP) && !defined(CONFIG_WM_DNS_UNSUPPORTED_OPCODE_REFUSED)
+#define CONFIG_WM_DNS_UNSUPPORTED_OPCODE_NOTIMP 1
+#endif
+#ifndef CONFIG_WM_DEFAULT_HOSTNAME
+#define CONFIG_WM_DEFAULT_HOSTNAME "Esp32"
+#endif
+#ifndef CONFIG_WM_STORAGE_MAX_NETWORKS
+#define CONFIG_WM_STORAGE_MAX_NETWORKS 5
+#endif
+#ifndef CONFIG_WM_DNS_RATE_LIMIT
+#define CONFIG_WM_DNS_RATE_LIMIT 1
+#endif
+#ifndef CONFIG_WM_DNS_RATE_LIMIT_QPS
+#define CONFIG_WM_DNS_RATE_LIMIT_QPS 20
+#endif
+#ifndef CONFIG_WM_DNS_RATE_LIMIT_BURST
+#define CONFIG_WM_DNS_RATE_LIMIT_BURST 40
+#endif
+#ifndef CONFIG_WM_DNS_CACHE_SIZE
+#define CONFIG_WM_DNS_CACHE_SIZE 8
+#endif
+#ifndef CONFIG_WM_SCAN_CACHE_TTL_MS
+#define CONFIG_WM_SCAN_CACHE_TTL_MS 10000
+#endif
+#ifndef CONFIG_WM_SCAN_CACHE_PERIOD_MS
+#define CONFIG_WM_SCAN_CACHE_PERIOD_MS 30000
+#endif
+#ifndef CONFIG_WM_BACKOFF_BASE_MS
+#define CONFIG_WM_BACKOFF_BASE_MS 2000
+#endif
+#ifndef CONFIG_WM_BACKOFF_MAX_MS
+#define CONFIG_WM_BACKOFF_MAX_MS 300000
+#endif
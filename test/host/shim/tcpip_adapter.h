@@ -0,0 +1,64 @@
+#pragma once
+
+/*
+ * tcpip_adapter as in ESP-IDF 4.2: a compatibility layer over esp_netif,
+ * whose addresses are esp_ip4_addr_t and not lwIP's ip4_addr_t.
+ */
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+typedef struct { uint32_t addr; } esp_ip4_addr_t;
+typedef struct { uint32_t addr[4]; uint8_t zone; } esp_ip6_addr_t;
+typedef struct {
+    union {
+        esp_ip6_addr_t ip6;
+        esp_ip4_addr_t ip4;
+    } u_addr;
+    uint8_t type;
+} esp_ip_addr_t;
+
+typedef struct {
+    esp_ip4_addr_t ip;
+    esp_ip4_addr_t netmask;
+    esp_ip4_addr_t gw;
+} esp_netif_ip_info_t;
+
+typedef struct {
+    esp_ip_addr_t ip;
+} esp_netif_dns_info_t;
+
+typedef esp_netif_ip_info_t tcpip_adapter_ip_info_t;
+typedef esp_netif_dns_info_t tcpip_adapter_dns_info_t;
+
+typedef enum {
+    TCPIP_ADAPTER_IF_STA = 0,
+    TCPIP_ADAPTER_IF_AP,
+    TCPIP_ADAPTER_IF_ETH,
+    TCPIP_ADAPTER_IF_MAX
+} tcpip_adapter_if_t;
+
+typedef enum {
+    TCPIP_ADAPTER_DNS_MAIN = 0,
+    TCPIP_ADAPTER_DNS_BACKUP,
+    TCPIP_ADAPTER_DNS_FALLBACK,
+    TCPIP_ADAPTER_DNS_MAX
+} tcpip_adapter_dns_type_t;
+
+// lwIP's own address type, distinct from esp_ip4_addr_t
+typedef struct ip4_addr { uint32_t addr; } ip4_addr_t;
+
+void tcpip_adapter_init(void);
+esp_err_t tcpip_adapter_get_ip_info(tcpip_adapter_if_t tcpip_if, tcpip_adapter_ip_info_t* ip_info);
+esp_err_t tcpip_adapter_get_dns_info(tcpip_adapter_if_t tcpip_if, tcpip_adapter_dns_type_t type,
+        tcpip_adapter_dns_info_t* dns);
+esp_err_t tcpip_adapter_set_hostname(tcpip_adapter_if_t tcpip_if, const char* hostname);
+char* ip4addr_ntoa(const ip4_addr_t* addr);
+
+#define esp_ip4_addr1(ipaddr) (((const uint8_t*)(&(ipaddr)->addr))[0])
+#define esp_ip4_addr2(ipaddr) (((const uint8_t*)(&(ipaddr)->addr))[1])
+#define esp_ip4_addr3(ipaddr) (((const uint8_t*)(&(ipaddr)->addr))[2])
+#define esp_ip4_addr4(ipaddr) (((const uint8_t*)(&(ipaddr)->addr))[3])
+#define IPSTR "%d.%d.%d.%d"
+#define IP2STR(ipaddr) esp_ip4_addr1(ipaddr), esp_ip4_addr2(ipaddr), esp_ip4_addr3(ipaddr), esp_ip4_addr4(ipaddr)
@@ -0,0 +1,34 @@
+#pragma once
+
+/*
+ * Knobs of the host shims, for tests and benchmarks
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Added to esp_timer_get_time(), to make time pass without waiting
+extern volatile int64_t wm_host_time_offset_us;
+
+// Network order addresses returned by tcpip_adapter_get_ip_info() and
+// tcpip_adapter_get_dns_info(). 0 means "no address".
+extern volatile uint32_t wm_host_ap_addr;
+extern volatile uint32_t wm_host_sta_addr;
+extern volatile uint32_t wm_host_sta_dns;
+
+// Port the stand-in esp_http_server listens on (127.0.0.1) instead of
+// config.server_port, if not 0
+extern volatile uint16_t wm_host_http_port;
+
+/*
+ * Heap accounting, only in programs linked with wm_host_heap (malloc and
+ * friends wrapped at link time). esp_get_free_heap_size() and
+ * esp_get_minimum_free_heap_size() report against a heap of
+ * wm_host_heap_size bytes.
+ */
+extern size_t wm_host_heap_size;
+size_t wm_host_heap_used(void);
+size_t wm_host_heap_peak(void);
+// Restart peak tracking from the current usage
+void wm_host_heap_reset_peak(void);
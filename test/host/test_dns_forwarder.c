@@ -0,0 +1,240 @@
+/*
+ * Captive DNS forwarder against a stand-in upstream resolver (dns_resolver.c).
+ *
+ * Runs the real DNS task on the host shims, on DNS_PORT (the captive side)
+ * and WM_DNS_UPSTREAM_PORT (the resolver) set by the build. Time is moved
+ * forward through wm_host_time_offset_us to expire cache entries.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "wm_dns.h"
+#include "wm_host.h"
+#include "dns_resolver.h"
+
+#define RESOLVER_ADDR "127.0.0.1"
+#define SPOOF_ADDR "127.0.0.2"
+#define AP_ADDR "192.168.4.1"
+#define RECV_TIMEOUT_MS 500
+// Long enough for a datagram to cross the loopback and the DNS task
+#define SETTLE_MS 100
+
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while(0)
+
+typedef struct {
+    int len;
+    uint16_t id;
+    uint8_t rcode;
+    uint16_t ancount;
+    uint32_t addr;      // First A record, network order
+    uint32_t ttl;
+} reply_t;
+
+static int failures;
+static volatile bool sta_connected;
+
+bool wm_sta_connected() {
+    return sta_connected;
+}
+
+static int client_socket() {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct timeval timeout = {.tv_sec = 0, .tv_usec = RECV_TIMEOUT_MS * 1000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return sock;
+}
+
+static void send_query(int sock, uint16_t id, const char* name) {
+    char msg[DNS_PACKET_LEN];
+    int len = dns_build_query(msg, id, name, QTYPE_A);
+
+    struct sockaddr_in to = {.sin_family = AF_INET, .sin_port = htons(DNS_PORT)};
+    inet_aton("127.0.0.1", &to.sin_addr);
+    sendto(sock, msg, len, 0, (struct sockaddr*)&to, sizeof(to));
+}
+
+/*
+ * Wait for a reply and pick out the fields the tests look at. len is -1 on
+ * timeout
+ */
+static reply_t recv_reply(int sock) {
+    reply_t reply = {.len = -1};
+    char msg[DNS_PACKET_LEN];
+    int len = recv(sock, msg, sizeof(msg), 0);
+    if(len < (int)sizeof(DnsHeader)) return reply;
+
+    DnsHeader* hdr = (DnsHeader*)msg;
+    reply.len = len;
+    reply.id = my_ntohs(&hdr->id);
+    reply.rcode = hdr->rcode & 0x0F;
+    reply.ancount = my_ntohs(&hdr->ancount);
+
+    char* end = msg + len;
+    char* p = wm_dns_skip_label(msg + sizeof(DnsHeader), end);
+    if(p == NULL) return reply;
+    p += sizeof(DnsQuestionFooter);
+    for(int i = 0; i < reply.ancount; i++) {
+        p = wm_dns_skip_label(p, end);
+        if(p == NULL || p + sizeof(DnsResourceFooter) > end) break;
+        DnsResourceFooter* rf = (DnsResourceFooter*)p;
+        p += sizeof(DnsResourceFooter);
+        if(my_ntohs(&rf->type) == QTYPE_A && my_ntohs(&rf->rdlength) == 4 && p + 4 <= end) {
+            memcpy(&reply.addr, p, 4);
+            reply.ttl = my_ntohl(&rf->ttl);
+            break;
+        }
+        p += my_ntohs(&rf->rdlength);
+    }
+    return reply;
+}
+
+static reply_t query(int sock, uint16_t id, const char* name) {
+    send_query(sock, id, name);
+    return recv_reply(sock);
+}
+
+static void advance_s(int seconds) {
+    wm_host_time_offset_us += seconds * 1000000LL;
+}
+
+static wm_dns_stats_t stats() {
+    wm_dns_stats_t stats;
+    wm_dns_get_stats(&stats);
+    return stats;
+}
+
+static void wait_queries(dns_resolver_t* resolver, unsigned count) {
+    for(int i = 0; i < RECV_TIMEOUT_MS && dns_resolver_queries(resolver) < count; i++) usleep(1000);
+}
+
+int main() {
+    dns_resolver_t* resolver = dns_resolver_start(RESOLVER_ADDR, WM_DNS_UPSTREAM_PORT);
+    if(resolver == NULL) {
+        perror("resolver");
+        return 1;
+    }
+    dns_resolver_add(resolver, "example.com", "93.184.216.34", 120);
+    dns_resolver_add(resolver, "long.example", "10.0.0.2", 86400);
+    dns_resolver_add(resolver, "merge.example", "10.0.0.3", 60);
+    dns_resolver_add(resolver, "spoof.example", "10.0.0.4", 60);
+    wm_host_sta_dns = inet_addr(RESOLVER_ADDR);
+    sta_connected = true;
+
+    wm_dns_captive_start(NULL);
+    int sock = client_socket();
+    uint32_t ap_addr = inet_addr(AP_ADDR);
+
+    // The portal host is answered locally, which also waits for the task to come up
+    reply_t reply = {.len = -1};
+    for(int i = 0; i < 10 && reply.len < 0; i++) reply = query(sock, 1, "esp32.config");
+    CHECK(reply.len > 0 && reply.id == 1 && reply.addr == ap_addr);
+    CHECK(dns_resolver_queries(resolver) == 0);
+
+    // Forwarded, and answered with the client's own ID
+    reply = query(sock, 0x1234, "example.com");
+    CHECK(reply.id == 0x1234 && reply.rcode == RCODE_NOERROR);
+    CHECK(reply.addr == inet_addr("93.184.216.34") && reply.ttl == 120);
+    CHECK(dns_resolver_queries(resolver) == 1);
+    CHECK(stats().forwarded == 1);
+
+    // Cache hit
+    reply = query(sock, 0x2345, "example.com");
+    CHECK(reply.id == 0x2345 && reply.addr == inet_addr("93.184.216.34"));
+    CHECK(dns_resolver_queries(resolver) == 1);
+    CHECK(stats().forward_cache_hits == 1);
+
+    // TTLs count down while cached
+    advance_s(30);
+    reply = query(sock, 0x3456, "example.com");
+    CHECK(reply.ttl == 90);
+    CHECK(dns_resolver_queries(resolver) == 1);
+
+    // Expired: asked upstream again
+    advance_s(91);
+    reply = query(sock, 0x4567, "example.com");
+    CHECK(reply.id == 0x4567 && reply.ttl == 120);
+    CHECK(dns_resolver_queries(resolver) == 2);
+
+    // Entries don't outlive WM_DNS_FORWARDER_MAX_TTL, whatever their TTL
+    reply = query(sock, 1, "long.example");
+    CHECK(reply.addr == inet_addr("10.0.0.2"));
+    reply = query(sock, 2, "long.example");
+    CHECK(dns_resolver_queries(resolver) == 3);
+    advance_s(WM_DNS_FORWARDER_MAX_TTL + 1);
+    reply = query(sock, 3, "long.example");
+    CHECK(reply.addr == inet_addr("10.0.0.2"));
+    CHECK(dns_resolver_queries(resolver) == 4);
+
+    // NXDOMAIN is passed on and cached
+    reply = query(sock, 4, "missing.example");
+    CHECK(reply.id == 4 && reply.rcode == RCODE_NXDOMAIN && reply.ancount == 0);
+    reply = query(sock, 5, "missing.example");
+    CHECK(reply.rcode == RCODE_NXDOMAIN);
+    CHECK(dns_resolver_queries(resolver) == 5);
+
+    // Two clients asking the same question share one upstream query
+    int other = client_socket();
+    dns_resolver_hold(resolver, true);
+    send_query(sock, 0x1111, "merge.example");
+    wait_queries(resolver, 6);
+    send_query(other, 0x2222, "merge.example");
+    usleep(SETTLE_MS * 1000);
+    CHECK(stats().forward_merged == 1);
+    dns_resolver_hold(resolver, false);
+    reply = recv_reply(sock);
+    CHECK(reply.id == 0x1111 && reply.addr == inet_addr("10.0.0.3"));
+    reply = recv_reply(other);
+    CHECK(reply.id == 0x2222 && reply.addr == inet_addr("10.0.0.3"));
+    CHECK(dns_resolver_queries(resolver) == 6);
+    close(other);
+
+    // An answer with the right ID and port from another address is ignored
+    dns_resolver_hold(resolver, true);
+    send_query(sock, 0x3333, "spoof.example");
+    wait_queries(resolver, 7);
+    uint16_t upstream_id;
+    struct sockaddr_in forwarder;
+    dns_resolver_last_query(resolver, &upstream_id, &forwarder);
+
+    dns_resolver_t* spoofer = dns_resolver_start(SPOOF_ADDR, WM_DNS_UPSTREAM_PORT);
+    CHECK(spoofer != NULL);
+    if(spoofer != NULL) {
+        dns_resolver_add(spoofer, "spoof.example", "6.6.6.6", 60);
+        dns_resolver_send_answer(spoofer, upstream_id, "spoof.example", &forwarder);
+    }
+    reply = recv_reply(sock);
+    CHECK(reply.len < 0);
+    dns_resolver_hold(resolver, false);
+    reply = recv_reply(sock);
+    CHECK(reply.id == 0x3333 && reply.addr == inet_addr("10.0.0.4"));
+    if(spoofer != NULL) dns_resolver_stop(spoofer);
+
+    // No upstream resolver: captive answer
+    wm_host_sta_dns = 0;
+    reply = query(sock, 6, "nodns.example");
+    CHECK(reply.id == 6 && reply.addr == ap_addr);
+    wm_host_sta_dns = inet_addr(RESOLVER_ADDR);
+
+    // Not connected: captive answer
+    sta_connected = false;
+    unsigned queries = dns_resolver_queries(resolver);
+    reply = query(sock, 7, "example.com");
+    CHECK(reply.id == 7 && reply.addr == ap_addr);
+    CHECK(dns_resolver_queries(resolver) == queries);
+
+    CHECK(wm_dns_captive_stop() == ESP_OK);
+    close(sock);
+    dns_resolver_stop(resolver);
+
+    if(failures) fprintf(stderr, "%d checks failed\n", failures);
+    else printf("dns forwarder: all checks passed\n");
+    return failures != 0;
+}
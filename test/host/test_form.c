@@ -0,0 +1,59 @@
+/*
+ * Credentials form parser: field length limits.
+ *
+ * SSIDs and passwords are kept like wifi_config_t keeps them, so a 32 byte
+ * SSID and a 64 hex digit PSK fill their fields without a NUL.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "wm_form.h"
+
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while(0)
+
+static int failures;
+
+static esp_err_t parse(wm_form_type_t type, const char* body, wm_network_info_t* network) {
+    wm_form_parser_t parser;
+    memset(network, 0, sizeof(*network));
+    wm_form_init(&parser, type, network);
+    esp_err_t err = wm_form_feed(&parser, body, strlen(body));
+    if(err != ESP_OK) return err;
+    return wm_form_finish(&parser);
+}
+
+int main() {
+    const char ssid32[] = "ssid-of-exactly-thirty-two-bytes";
+    const char psk64[] = "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef";
+    char body[256];
+    wm_network_info_t network;
+
+    snprintf(body, sizeof(body), "ssid=%s&password=%s", ssid32, psk64);
+    CHECK(parse(WM_FORM_URLENCODED, body, &network) == ESP_OK);
+    CHECK(memcmp(network.ssid, ssid32, 32) == 0);
+    CHECK(memcmp(network.password, psk64, 64) == 0);
+
+    snprintf(body, sizeof(body), "{\"ssid\":\"%s\",\"password\":\"%s\"}", ssid32, psk64);
+    CHECK(parse(WM_FORM_JSON, body, &network) == ESP_OK);
+    CHECK(memcmp(network.ssid, ssid32, 32) == 0);
+    CHECK(memcmp(network.password, psk64, 64) == 0);
+
+    // Shorter values stay NUL terminated
+    CHECK(parse(WM_FORM_URLENCODED, "ssid=home&password=secret%20pw", &network) == ESP_OK);
+    CHECK(strcmp(network.ssid, "home") == 0 && strcmp(network.password, "secret pw") == 0);
+
+    // One byte more doesn't fit
+    snprintf(body, sizeof(body), "ssid=%sx&password=%s", ssid32, psk64);
+    CHECK(parse(WM_FORM_URLENCODED, body, &network) == ESP_ERR_INVALID_SIZE);
+    snprintf(body, sizeof(body), "{\"ssid\":\"%s\",\"password\":\"%s0\"}", ssid32, psk64);
+    CHECK(parse(WM_FORM_JSON, body, &network) == ESP_ERR_INVALID_SIZE);
+
+    if(failures) fprintf(stderr, "%d checks failed\n", failures);
+    else printf("form: all checks passed\n");
+    return failures != 0;
+}
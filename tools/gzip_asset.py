@@ -0,0 +1,117 @@
+#!/usr/bin/env python
+# Minify and compress a web asset for embedding. mtime is fixed so builds are
+# reproducible.
+#
+# The minifier only strips comments and whitespace, it never renames or
+# reorders anything. It knows about JS/CSS strings but not about regex
+# literals: a regex containing quotes, '//' or '/*' must be built with
+# new RegExp() instead.
+import gzip
+import os
+import re
+import sys
+
+# Whitespace next to these can go without changing meaning. + and - are
+# handled apart so 'a - -b' or 'i++ +j' never merge.
+JS_PUNCT = '{}()[];,:?=<>!&|*%'
+SIGNS = '+-'
+CSS_PUNCT = '{};:,>'
+# A newline after/before these can't end a statement, so ASI doesn't apply
+JS_JOIN_AFTER = '{([,;:?=&|'
+JS_JOIN_BEFORE = '})]:?.,&|='
+
+
+def tokens(code, line_comments):
+    """Split code into ('str', text), ('ws', text) and ('code', text) tokens,
+    dropping comments."""
+    i, n = 0, len(code)
+    while i < n:
+        c = code[i]
+        if c in '\'"`':
+            j = i + 1
+            while j < n and code[j] != c:
+                j += 2 if code[j] == '\\' else 1
+            yield 'str', code[i:j + 1]
+            i = j + 1
+        elif code.startswith('/*', i):
+            end = code.find('*/', i + 2)
+            i = n if end < 0 else end + 2
+            yield 'ws', ' '
+        elif line_comments and code.startswith('//', i):
+            end = code.find('\n', i)
+            i = n if end < 0 else end
+        elif c.isspace():
+            j = i
+            while j < n and code[j].isspace():
+                j += 1
+            yield 'ws', code[i:j]
+            i = j
+        else:
+            j = i
+            while j < n and not code[j].isspace() and code[j] not in '\'"`' \
+                    and not code.startswith('/*', j) \
+                    and not (line_comments and code.startswith('//', j)):
+                j += 1
+            yield 'code', code[i:j]
+            i = j
+
+
+def minify_code(code, punct, js):
+    out = []
+    pending = None      # Whitespace waiting for the next token
+    for kind, text in tokens(code, js):
+        if kind == 'ws':
+            if pending is None or '\n' in text:
+                pending = '\n' if js and '\n' in text else ' '
+            continue
+        if pending is not None and out:
+            prev, next = out[-1][-1], text[0]
+            if prev in punct or next in punct or \
+                    js and (prev in SIGNS) != (next in SIGNS):
+                # Statements may end at a newline: only join when they can't
+                if pending != '\n' or prev in JS_JOIN_AFTER or next in JS_JOIN_BEFORE:
+                    pending = ''
+            out.append(pending)
+        pending = None
+        out.append(text)
+    return ''.join(out)
+
+
+def minify_markup(markup):
+    markup = re.sub(r'>\s+<', '><', markup)
+    return re.sub(r'\s+', ' ', markup)
+
+
+def minify_html(html):
+    html = re.sub(r'<!--.*?-->', '', html, flags=re.S)
+    out = []
+    pos = 0
+    # Script and style bodies get their own minifier, the markup around them
+    # loses whitespace between tags and runs of whitespace elsewhere
+    for m in re.finditer(r'(<(script|style)\b[^>]*>)(.*?)(</\2\s*>)', html, flags=re.S | re.I):
+        markup = minify_markup(html[pos:m.start()]).rstrip()
+        out.append(markup.lstrip() if pos else markup)
+        js = m.group(2).lower() == 'script'
+        body = minify_code(m.group(3), JS_PUNCT if js else CSS_PUNCT, js)
+        out.append(m.group(1) + body.strip() + m.group(4))
+        pos = m.end()
+    out.append(minify_markup(html[pos:]).lstrip())
+    return ''.join(out).strip()
+
+
+def minify(path, data):
+    ext = os.path.splitext(path)[1].lower()
+    if ext in ('.html', '.htm'):
+        return minify_html(data.decode('utf-8')).encode('utf-8')
+    if ext == '.css':
+        return minify_code(data.decode('utf-8'), CSS_PUNCT, False).strip().encode('utf-8')
+    if ext == '.js':
+        return minify_code(data.decode('utf-8'), JS_PUNCT, True).strip().encode('utf-8')
+    return data
+
+
+with open(sys.argv[1], 'rb') as src:
+    data = minify(sys.argv[1], src.read())
+with open(sys.argv[2], 'wb') as dst:
+    with gzip.GzipFile(filename='', mode='wb', compresslevel=9, fileobj=dst, mtime=0) as gz:
+        gz.write(data)
@@ -1,4 +1,5 @@
 #include "wifi_manager.h"
+#include <esp_attr.h>
 
 static const char *TAG = "WiFiManager";
 
@@ -6,6 +7,74 @@ wm_config_t* _wm_config = NULL;
 wm_network_info_t wm_network_info_default = {.times_used = 0};
 static EventGroupHandle_t _wm_event_group;
 
+// Provisioning portal state
+static bool _wm_portal_running = false;
+static wm_network_info_t _wm_provision_network;
+static wm_provision_status_t _wm_provision;
+static uint8_t _wm_provision_retries;
+static esp_timer_handle_t _wm_teardown_timer = NULL;
+static bool _wm_teardown_running = false;
+
+// Boot connection to the last good network, no scan done yet
+static bool _wm_fast_connecting = false;
+#ifdef CONFIG_WM_OPTIMISTIC_TIMEOUT
+static esp_timer_handle_t _wm_optimistic_timer = NULL;
+#endif
+// SSID of the network that last got an IP, as stored
+static char _wm_last_ssid[33];
+// Fast reconnect counts not flushed to NVS yet. RTC memory survives restarts
+// but not power loss, when the magic won't match
+#define WM_STATS_MAGIC 0x574d5354
+static RTC_NOINIT_ATTR struct {
+    uint32_t magic;
+    wm_stats_t stats;
+} _wm_stats_pending;
+#if WM_SCAN_LEARNED_CHANNELS > 0
+// Times stored networks got an IP on each channel. NVS gets a copy only
+// when that changes the learned channels, see wm_learn_channel()
+static uint8_t _wm_channels[WM_SCAN_CHANNELS];
+#endif
+
+// Reconnect rounds: rescan and try every candidate, back off when all fail
+static esp_timer_handle_t _wm_reconnect_timer = NULL;
+static uint8_t _wm_reconnect_round = 0;
+// When the first round failed, 0 while connected
+static int64_t _wm_reconnect_since = 0;
+
+#ifdef CONFIG_WM_PORTAL_PROBE
+// Background search for stored networks while the portal is up
+static esp_timer_handle_t _wm_probe_timer = NULL;
+static bool _wm_probe_running = false;
+// Connecting to a network the probe found, until GOT_IP or DISCONNECTED
+static bool _wm_probe_connecting = false;
+#endif
+
+/*
+ * Background tasks don't touch _wm_available: they post what they found and
+ * the event loop, which owns it, takes it from there
+ */
+ESP_EVENT_DEFINE_BASE(WM_EVENT);
+enum {
+    WM_EVENT_DISCOVERY_DONE,
+    WM_EVENT_PROBE_FOUND,
+    WM_EVENT_ROAM_FOUND,
+};
+typedef struct {
+    uint8_t count;
+    // Candidate to connect to
+    uint8_t index;
+    wm_candidate_t networks[WM_STORAGE_MAX_NETWORKS];
+} wm_event_candidates_t;
+
+#ifdef CONFIG_WM_ROAMING
+static esp_timer_handle_t _wm_roam_timer = NULL;
+static bool _wm_roam_running = false;
+// Disconnected on purpose, to connect to _wm_available.networks[_wm_available.index]
+static bool _wm_roaming = false;
+// Minimum dwell: no roaming scan before this time
+static int64_t _wm_roam_not_before = 0;
+#endif
+
 bool wm_sta_connected() {
     return xEventGroupGetBits(_wm_event_group) & WM_STA_CONNECTED_BIT;
 }
@@ -17,6 +86,411 @@ static inline bool wm_available_should_reconnect() {
     return _wm_available.retries < WM_CONNECTION_MAX_RETRIES;
 }
 
+static inline bool wm_provision_active() {
+    return _wm_provision.state == WM_PROVISION_ASSOCIATING || _wm_provision.state == WM_PROVISION_DHCP;
+}
+
+static void wm_provision_set_state(wm_provision_state_t state, uint8_t reason) {
+    _wm_provision.state = state;
+    _wm_provision.reason = reason;
+    wm_webserver_notify_status();
+}
+
+static void _wm_teardown_task(void* arg) {
+    wm_stop_basic_server();
+    _wm_teardown_running = false;
+    vTaskDelete(NULL);
+}
+
+/*
+ * Stop the portal from the event loop or a timer callback. Stopping the web
+ * server and waiting for the DNS task blocks, so it runs in its own task.
+ */
+static void wm_stop_basic_server_async() {
+    if(_wm_teardown_running) return;
+    _wm_teardown_running = true;
+    if(xTaskCreate(_wm_teardown_task, "wm_teardown", WM_DISCOVERY_TASK_STACK_SIZE, NULL, 5, NULL) != pdPASS) {
+        _wm_teardown_running = false;
+        ESP_LOGW(TAG, "Couldn't start teardown task, stopping portal inline");
+        wm_stop_basic_server();
+    }
+}
+
+static void _wm_teardown_timer_cb(void* arg) {
+    wm_stop_basic_server_async();
+}
+
+/*
+ * Exponential backoff with "equal jitter": a random delay between half and
+ * all of WM_BACKOFF_BASE_MS * 2^round, capped to WM_BACKOFF_MAX_MS
+ */
+static uint32_t wm_reconnect_delay_ms(uint8_t round) {
+    uint32_t delay = WM_BACKOFF_MAX_MS;
+    if(round < 16 && ((uint32_t)WM_BACKOFF_BASE_MS << round) < WM_BACKOFF_MAX_MS) {
+        delay = (uint32_t)WM_BACKOFF_BASE_MS << round;
+    }
+    return delay / 2 + esp_random() % (delay / 2 + 1);
+}
+
+static bool wm_reconnect_give_up() {
+    // Nothing to reconnect to. Asked every time: the boot fast connect doesn't
+    // read the whole storage, and the portal or the application may change it
+    size_t stored_count;
+    if(wm_storage_count(&stored_count) == ESP_OK && stored_count == 0) return true;
+#if defined(CONFIG_WM_PORTAL_IMMEDIATE)
+    return true;
+#elif defined(CONFIG_WM_PORTAL_AFTER_TIMEOUT)
+    return esp_timer_get_time() - _wm_reconnect_since >= WM_PORTAL_TIMEOUT_S * 1000000LL;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Every candidate failed (or none was found): start the portal or schedule
+ * the next round, as the portal policy says
+ */
+static esp_err_t wm_reconnect_schedule() {
+    if(_wm_reconnect_since == 0) _wm_reconnect_since = esp_timer_get_time();
+
+    if(wm_reconnect_give_up()) return wm_setup_basic_server(_wm_config);
+
+    uint32_t delay_ms = wm_reconnect_delay_ms(_wm_reconnect_round);
+    if(_wm_reconnect_round < UINT8_MAX) _wm_reconnect_round++;
+    ESP_LOGW(TAG, "No stored network reachable, rescanning in %u ms (round %d)",
+        delay_ms, _wm_reconnect_round);
+    return esp_timer_start_once(_wm_reconnect_timer, delay_ms * 1000ULL);
+}
+
+static void wm_reconnect_reset() {
+    esp_timer_stop(_wm_reconnect_timer);
+    _wm_reconnect_round = 0;
+    _wm_reconnect_since = 0;
+}
+
+/*
+ * Remember the AP we are associated to, for the next fast reconnect
+ */
+static void wm_network_update_ap(wm_network_info_t* network) {
+    wifi_ap_record_t ap_info;
+    if(esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) return;
+    memcpy(network->bssid, ap_info.bssid, sizeof(network->bssid));
+    network->channel = ap_info.primary;
+    network->authmode = ap_info.authmode;
+}
+
+/*
+ * Match scan records against stored networks, see wm_available_connections()
+ */
+static void wm_match_candidates(wm_network_info_t* stored_networks, size_t stored_count,
+        wifi_ap_record_t* ap_records, uint16_t ap_count, wm_candidate_t* found_networks, uint8_t* count) {
+    *count = 0;
+    for(int stored = 0; stored < stored_count; stored++) {
+        // Strongest BSSID of the SSID
+        wifi_ap_record_t* best = NULL;
+        for(int ap = 0; ap < ap_count; ap++) {
+            if(strncmp(stored_networks[stored].ssid, (char*)(ap_records[ap].ssid), sizeof(stored_networks[stored].ssid)) == 0
+                    && (best == NULL || ap_records[ap].rssi > best->rssi)) {
+                best = &ap_records[ap];
+            }
+        }
+        if(best == NULL) continue;
+
+        wm_candidate_t candidate = {
+            .network = stored_networks[stored],
+            .channel = best->primary,
+            .rssi = best->rssi,
+            .authmode = best->authmode
+        };
+        memcpy(candidate.bssid, best->bssid, sizeof(candidate.bssid));
+        candidate.score = wm_candidate_score(&candidate);
+
+        // Insertion sort, best score first
+        int i;
+        for(i = *count; i > 0 && found_networks[i-1].score < candidate.score; i--) {
+            found_networks[i] = found_networks[i-1];
+        }
+        found_networks[i] = candidate;
+        (*count)++;
+    }
+}
+
+/*
+ * Find candidates, the event loop connects to the best one or schedules
+ * another round if there is none. Scanning blocks, so it runs in its own
+ * task instead of the event loop.
+ */
+static void _wm_discovery_task(void* arg) {
+    wm_event_candidates_t found = {.index = 0};
+    esp_err_t err = wm_available_connections(found.networks, &found.count);
+    if(err != ESP_OK) {
+        ESP_LOGW(TAG, "Discovery failed (%s)", esp_err_to_name(err));
+        found.count = 0;
+    }
+
+    if(esp_event_post(WM_EVENT, WM_EVENT_DISCOVERY_DONE, &found, sizeof(found), portMAX_DELAY) != ESP_OK) {
+        // Don't stop reconnecting, try another round later
+        esp_timer_start_once(_wm_reconnect_timer, WM_BACKOFF_BASE_MS * 1000ULL);
+    }
+    vTaskDelete(NULL);
+}
+
+static void wm_start_discovery() {
+    if(xTaskCreate(_wm_discovery_task, "wm_discovery", WM_DISCOVERY_TASK_STACK_SIZE, NULL, 5, NULL) != pdPASS) {
+        wm_reconnect_schedule();
+    }
+}
+
+static void _wm_reconnect_timer_cb(void* arg) {
+    // Provisioning took over
+    if(_wm_portal_running) return;
+    wm_start_discovery();
+}
+
+#ifdef CONFIG_WM_SCAN_DIRECTED
+/*
+ * One directed scan per stored network. Records of hidden APs are given the
+ * SSID they answered for.
+ */
+static esp_err_t wm_scan_stored(wm_network_info_t* stored_networks, size_t stored_count, uint8_t channel,
+        wifi_ap_record_t* ap_records, uint16_t* ap_count) {
+    uint16_t total = 0;
+    for(int stored = 0; stored < stored_count && total < *ap_count; stored++) {
+        uint16_t count = *ap_count - total;
+        char ssid[33] = {0};
+        memcpy(ssid, stored_networks[stored].ssid, sizeof(stored_networks[stored].ssid));
+        esp_err_t err = wm_scan_directed(ssid, channel, &ap_records[total], &count,
+            WM_SCAN_TIMEOUT_MS / portTICK_PERIOD_MS);
+        if(err != ESP_OK) {
+            ESP_LOGW(TAG, "Directed scan for '%s' failed (%s)", ssid, esp_err_to_name(err));
+            continue;
+        }
+
+        for(int ap = total; ap < total + count; ap++) {
+            if(ap_records[ap].ssid[0] == '\0') {
+                memcpy(ap_records[ap].ssid, ssid, sizeof(ap_records[ap].ssid));
+            }
+        }
+        total += count;
+    }
+    *ap_count = total;
+    return ESP_OK;
+}
+#endif
+
+#ifdef CONFIG_WM_OPTIMISTIC_CONNECT
+/*
+ * Count a fast reconnect attempt in RTC memory, moving the counts to NVS every
+ * WM_STATS_FLUSH_EVERY attempts. The previous boot's success, if any, was
+ * counted by then.
+ */
+static void wm_stats_count_attempt() {
+    if(_wm_stats_pending.magic != WM_STATS_MAGIC) {
+        memset(&_wm_stats_pending, 0, sizeof(_wm_stats_pending));
+        _wm_stats_pending.magic = WM_STATS_MAGIC;
+    }
+    if(_wm_stats_pending.stats.fast_attempts >= WM_STATS_FLUSH_EVERY
+            && wm_storage_counter_add(WM_STORAGE_FAST_TRIES_KEY, _wm_stats_pending.stats.fast_attempts) == ESP_OK) {
+        _wm_stats_pending.stats.fast_attempts = 0;
+        if(wm_storage_counter_add(WM_STORAGE_FAST_OK_KEY, _wm_stats_pending.stats.fast_successes) == ESP_OK)
+            _wm_stats_pending.stats.fast_successes = 0;
+    }
+    _wm_stats_pending.stats.fast_attempts++;
+}
+#endif
+
+#if WM_SCAN_LEARNED_CHANNELS > 0
+/*
+ * Most used channels first, at most WM_SCAN_LEARNED_CHANNELS. Returns
+ * how many there are.
+ */
+static uint8_t wm_learned_channels(uint8_t* channels) {
+    uint8_t count = 0;
+    for(int ch = 1; ch <= WM_SCAN_CHANNELS; ch++) {
+        uint8_t times = _wm_channels[ch - 1];
+        if(times == 0) continue;
+
+        int i;
+        for(i = count; i > 0 && _wm_channels[channels[i-1] - 1] < times; i--) {
+            if(i < WM_SCAN_LEARNED_CHANNELS) channels[i] = channels[i-1];
+        }
+        if(i < WM_SCAN_LEARNED_CHANNELS) {
+            channels[i] = ch;
+            if(count < WM_SCAN_LEARNED_CHANNELS) count++;
+        }
+    }
+    return count;
+}
+
+static void wm_learn_channel() {
+    wifi_ap_record_t ap_info;
+    if(esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) return;
+    if(ap_info.primary < 1 || ap_info.primary > WM_SCAN_CHANNELS) return;
+
+    uint8_t before[WM_SCAN_LEARNED_CHANNELS] = {0}, after[WM_SCAN_LEARNED_CHANNELS] = {0};
+    uint8_t before_count = wm_learned_channels(before);
+    bool learned = memchr(before, ap_info.primary, before_count) != NULL;
+
+    uint8_t* count = &_wm_channels[ap_info.primary - 1];
+    if(*count == UINT8_MAX) {
+        // Halve everything so old habits fade out
+        for(int i = 0; i < WM_SCAN_CHANNELS; i++) _wm_channels[i] /= 2;
+    }
+    (*count)++;
+
+    // Another hit on a learned channel that leaves the order as it was isn't
+    // worth a flash write: the stored counts lag behind until the order moves
+    wm_learned_channels(after);
+    if(!learned || memcmp(before, after, sizeof(before)) != 0)
+        wm_storage_set_channels(_wm_channels);
+}
+#endif
+
+/*
+ * Scan for stored networks on a single channel, or on all of them if 0
+ */
+static esp_err_t wm_scan_for_stored(wm_network_info_t* stored_networks, size_t stored_count, uint8_t channel,
+        wifi_ap_record_t* ap_records, uint16_t* ap_count) {
+#ifdef CONFIG_WM_SCAN_DIRECTED
+    // One sweep per SSID: past a few networks a single sweep of everything is faster
+    if(channel == 0 && stored_count > WM_SCAN_DIRECTED_MAX_NETWORKS)
+        return wm_scan_cache_wait(ap_records, ap_count, WM_SCAN_TIMEOUT_MS / portTICK_PERIOD_MS);
+    // Only our networks: they can't be crowded out of the results
+    return wm_scan_stored(stored_networks, stored_count, channel, ap_records, ap_count);
+#else
+    // Fresh results: cached ones may predate the failures that led here
+    if(channel == 0) return wm_scan_cache_wait(ap_records, ap_count, WM_SCAN_TIMEOUT_MS / portTICK_PERIOD_MS);
+    return wm_scan_directed(NULL, channel, ap_records, ap_count, WM_SCAN_TIMEOUT_MS / portTICK_PERIOD_MS);
+#endif
+}
+
+#ifdef CONFIG_WM_PORTAL_PROBE
+/*
+ * Look for stored networks on the AP channel only, so the AP doesn't leave
+ * it for long, and connect to the best one found. The portal is stopped
+ * once it gets an IP.
+ */
+static void _wm_probe_task(void* arg) {
+    uint8_t channel;
+    wifi_second_chan_t second;
+    size_t stored_count = WM_STORAGE_MAX_NETWORKS;
+    wm_network_info_t stored_networks[stored_count];
+    uint16_t ap_count = WM_SCAN_MAX_NETWORKS;
+    wifi_ap_record_t ap_records[WM_SCAN_MAX_NETWORKS];
+
+    if(esp_wifi_get_channel(&channel, &second) == ESP_OK
+            && wm_storage_read(stored_networks, &stored_count) == ESP_OK && stored_count > 0
+            && wm_scan_for_stored(stored_networks, stored_count, channel, ap_records, &ap_count) == ESP_OK) {
+        wm_event_candidates_t found = {.index = 0};
+        wm_match_candidates(stored_networks, stored_count, ap_records, ap_count, found.networks, &found.count);
+        if(found.count > 0) {
+            esp_event_post(WM_EVENT, WM_EVENT_PROBE_FOUND, &found, sizeof(found), portMAX_DELAY);
+        }
+    }
+    _wm_probe_running = false;
+    vTaskDelete(NULL);
+}
+
+static void _wm_probe_timer_cb(void* arg) {
+    if(_wm_probe_running || _wm_probe_connecting || !_wm_portal_running) return;
+    if(wm_provision_active() || wm_sta_connected()) return;
+
+    _wm_probe_running = true;
+    if(xTaskCreate(_wm_probe_task, "wm_probe", WM_DISCOVERY_TASK_STACK_SIZE, NULL, 5, NULL) != pdPASS) {
+        _wm_probe_running = false;
+    }
+}
+#endif
+
+#ifdef CONFIG_WM_ROAMING
+/*
+ * Look for a stored network AP at least WM_ROAM_HYSTERESIS_DB stronger than
+ * the current one, best score first, and move to it
+ */
+static void _wm_roam_task(void* arg) {
+    wifi_ap_record_t current;
+    size_t stored_count = WM_STORAGE_MAX_NETWORKS;
+    wm_network_info_t stored_networks[stored_count];
+    uint16_t ap_count = WM_SCAN_MAX_NETWORKS;
+    wifi_ap_record_t ap_records[WM_SCAN_MAX_NETWORKS];
+
+    if(esp_wifi_sta_get_ap_info(&current) == ESP_OK
+            && wm_storage_read(stored_networks, &stored_count) == ESP_OK && stored_count > 0
+            && wm_scan_for_stored(stored_networks, stored_count, 0, ap_records, &ap_count) == ESP_OK) {
+        wm_event_candidates_t found;
+        wm_match_candidates(stored_networks, stored_count, ap_records, ap_count, found.networks, &found.count);
+
+        for(int i = 0; i < found.count; i++) {
+            if(memcmp(found.networks[i].bssid, current.bssid, sizeof(current.bssid)) == 0) continue;
+            if(found.networks[i].rssi < current.rssi + WM_ROAM_HYSTERESIS_DB) continue;
+
+            ESP_LOGI(TAG, "Roaming to '%.32s' ["MACSTR"] (rssi: %d -> %d)", found.networks[i].network.ssid,
+                MAC2STR(found.networks[i].bssid), current.rssi, found.networks[i].rssi);
+            found.index = i;
+            esp_event_post(WM_EVENT, WM_EVENT_ROAM_FOUND, &found, sizeof(found), portMAX_DELAY);
+            break;
+        }
+    }
+    _wm_roam_not_before = esp_timer_get_time() + WM_ROAM_MIN_DWELL_S * 1000000LL;
+    _wm_roam_running = false;
+    vTaskDelete(NULL);
+}
+
+static void _wm_roam_timer_cb(void* arg) {
+    if(_wm_roam_running || _wm_portal_running || !wm_sta_connected()) return;
+    if(esp_timer_get_time() < _wm_roam_not_before) return;
+
+    wifi_ap_record_t ap_info;
+    if(esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK || ap_info.rssi >= WM_ROAM_RSSI_THRESHOLD) return;
+
+    _wm_roam_running = true;
+    if(xTaskCreate(_wm_roam_task, "wm_roam", WM_DISCOVERY_TASK_STACK_SIZE, NULL, 5, NULL) != pdPASS) {
+        _wm_roam_running = false;
+    }
+}
+#endif
+
+#ifdef CONFIG_WM_OPTIMISTIC_CONNECT
+/*
+ * Stored network to try before any scan: the one that last got an IP or,
+ * if unknown, the most used one with a cached AP
+ */
+static bool wm_fast_candidate(wm_candidate_t* candidate) {
+    size_t stored_count = WM_STORAGE_MAX_NETWORKS;
+    wm_network_info_t stored_networks[stored_count];
+    if(wm_storage_read(stored_networks, &stored_count) != ESP_OK) return false;
+
+    wm_network_info_t* best = NULL;
+    for(int i = 0; i < stored_count && _wm_last_ssid[0] != '\0'; i++) {
+        if(strncmp(stored_networks[i].ssid, _wm_last_ssid, sizeof(stored_networks[i].ssid)) == 0) {
+            best = &stored_networks[i];
+            break;
+        }
+    }
+    for(int i = 0; i < stored_count && best == NULL; i++) {
+        if(stored_networks[i].channel == 0) continue;
+        if(best == NULL || stored_networks[i].times_used > best->times_used) best = &stored_networks[i];
+    }
+    if(best == NULL) return false;
+
+    memset(candidate, 0, sizeof(*candidate));
+    candidate->network = *best;
+    memcpy(candidate->bssid, best->bssid, sizeof(candidate->bssid));
+    candidate->channel = best->channel;
+    candidate->authmode = best->authmode;
+    return true;
+}
+#endif
+
+#ifdef CONFIG_WM_OPTIMISTIC_TIMEOUT
+static void _wm_optimistic_timer_cb(void* arg) {
+    if(!_wm_fast_connecting) return;
+    ESP_LOGW(TAG, "Fast reconnect timed out");
+    // Handled as a failed attempt on WIFI_EVENT_STA_DISCONNECTED
+    esp_wifi_disconnect();
+}
+#endif
+
 static void _event_handler(void* arg, esp_event_base_t event_base, 
                                 int32_t event_id, void* event_data)
 {
@@ -33,25 +507,82 @@ static void _event_handler(void* arg, esp_event_base_t event_base,
                 wm_sta_started = false;
                 break;
 
+            case WIFI_EVENT_SCAN_DONE:
+                wm_scan_cache_done((wifi_event_sta_scan_done_t*)event_data);
+                break;
+
+            case WIFI_EVENT_STA_CONNECTED:
+                if(wm_provision_active()) wm_provision_set_state(WM_PROVISION_DHCP, 0);
+                break;
+
             case WIFI_EVENT_STA_DISCONNECTED:
+                xEventGroupClearBits(_wm_event_group, WM_STA_CONNECTED_BIT);
+#ifdef CONFIG_WM_PORTAL_PROBE
+                _wm_probe_connecting = false;
+#endif
+#ifdef CONFIG_WM_ROAMING
+                esp_timer_stop(_wm_roam_timer);
+                if(_wm_roaming) {
+                    _wm_roaming = false;
+                    wm_connect_to_candidate(&_wm_available.networks[_wm_available.index]);
+                    break;
+                }
+#endif
+                if(wm_provision_active()) {
+                    wifi_event_sta_disconnected_t* event = (wifi_event_sta_disconnected_t*)event_data;
+                    if(_wm_provision_retries < WM_CONNECTION_MAX_RETRIES) {
+                        _wm_provision_retries++;
+                        wm_provision_set_state(WM_PROVISION_ASSOCIATING, event->reason);
+                        esp_wifi_connect();
+                    } else {
+                        ESP_LOGW(TAG, "Couldn't connect to '%s' (reason %d)", _wm_provision.ssid, event->reason);
+                        wm_provision_set_state(WM_PROVISION_FAILED, event->reason);
+                        wm_scan_cache_start_periodic();
+                    }
+                    break;
+                }
+                // The portal is already up, nothing else to fall back to
+                if(_wm_portal_running) break;
+
+                if(_wm_fast_connecting) {
+                    // Last network not there anymore, look for the best one
+                    _wm_fast_connecting = false;
+#ifdef CONFIG_WM_OPTIMISTIC_TIMEOUT
+                    esp_timer_stop(_wm_optimistic_timer);
+#endif
+                    ESP_LOGW(TAG, "Fast reconnect to '%.32s' failed, scanning...",
+                        _wm_available.networks[_wm_available.index].network.ssid);
+                    wm_start_discovery();
+                    break;
+                }
+
                 if(wm_available_valid() && wm_available_should_reconnect()) {
-                    _wm_available.retries++;
-                    ESP_LOGW(TAG, "Couldn't connect to '%s'. Retrying... (%d)",
-                        _wm_available.networks[_wm_available.index].ssid,
-                        _wm_available.retries);
-                    esp_wifi_connect();
+                    wm_candidate_t* candidate = &_wm_available.networks[_wm_available.index];
+                    uint8_t retries = _wm_available.retries + 1;
+                    ESP_LOGW(TAG, "Couldn't connect to '%.32s'. Retrying... (%d)",
+                        candidate->network.ssid, retries);
+                    if(retries == WM_CONNECTION_MAX_RETRIES && candidate->channel != 0) {
+                        // Last try: the pinned AP may be gone or refusing us, any AP of the SSID will do
+                        wm_connect_to(&candidate->network);
+                    } else {
+                        esp_wifi_connect();
+                    }
+                    // wm_connect_to() starts a new count
+                    _wm_available.retries = retries;
                 } else {
                     _wm_available.index++;
                     if(wm_available_valid()) {
-                        wm_connect_to(&_wm_available.networks[_wm_available.index]);
+                        wm_connect_to_candidate(&_wm_available.networks[_wm_available.index]);
                     } else {
-                        free(_wm_available.networks);
-                        wm_setup_basic_server(_wm_config);
+                        wm_reconnect_schedule();
                     }
                 }
                 break;
             
             // AP connections
+            case WIFI_EVENT_AP_START:
+                wm_dns_captive_update_addr();
+                break;
             case WIFI_EVENT_AP_STACONNECTED: {
                 wifi_event_ap_staconnected_t* event = (wifi_event_ap_staconnected_t*)event_data;
                 ESP_LOGI(TAG, "Device ("MACSTR") joined to AP [AID=%d]",
@@ -69,22 +600,113 @@ static void _event_handler(void* arg, esp_event_base_t event_base,
         switch(event_id) {
             case IP_EVENT_STA_GOT_IP:;
                 xEventGroupSetBits(_wm_event_group, WM_STA_CONNECTED_BIT);
+#ifdef CONFIG_WM_PORTAL_PROBE
+                _wm_probe_connecting = false;
+#endif
 
                 ip_event_got_ip_t* event = (ip_event_got_ip_t*)event_data;
-                ESP_LOGI(TAG, "Connected! [%s]", ip4addr_ntoa(&event->ip_info.ip));
+                ESP_LOGI(TAG, "Connected! [" IPSTR "]", IP2STR(&event->ip_info.ip));
+                wm_reconnect_reset();
+#ifdef CONFIG_WM_ROAMING
+                _wm_roam_not_before = esp_timer_get_time() + WM_ROAM_MIN_DWELL_S * 1000000LL;
+                esp_timer_stop(_wm_roam_timer);
+                esp_timer_start_periodic(_wm_roam_timer, WM_ROAM_CHECK_PERIOD_MS * 1000ULL);
+#endif
+
+                // Remember it as the network to try first on next boot
+                wifi_config_t sta_config;
+                if(esp_wifi_get_config(ESP_IF_WIFI_STA, &sta_config) == ESP_OK
+                        && strncmp(_wm_last_ssid, (char*)sta_config.sta.ssid, 32) != 0) {
+                    memcpy(_wm_last_ssid, sta_config.sta.ssid, 32);
+                    _wm_last_ssid[32] = '\0';
+                    wm_storage_set_last(_wm_last_ssid);
+                }
+#if WM_SCAN_LEARNED_CHANNELS > 0
+                wm_learn_channel();
+#endif
                 
-                if(wm_available_valid()) {
+                if(_wm_fast_connecting) {
+                    _wm_fast_connecting = false;
+#ifdef CONFIG_WM_OPTIMISTIC_TIMEOUT
+                    esp_timer_stop(_wm_optimistic_timer);
+#endif
+                    _wm_stats_pending.stats.fast_successes++;
+                    ESP_LOGI(TAG, "Fast reconnect succeeded");
+                }
+
+                if(wm_provision_active()) {
+                    // Credentials proved valid, keep them
+                    _wm_provision_network.times_used++;
+                    wm_network_update_ap(&_wm_provision_network);
+                    wm_storage_save(&_wm_provision_network);
+
+                    _wm_provision.ip = event->ip_info.ip;
+                    wm_provision_set_state(WM_PROVISION_CONNECTED, 0);
+                    // Give the portal page some time to show the result before the AP goes away
+                    esp_timer_start_once(_wm_teardown_timer, WM_PROVISION_TEARDOWN_DELAY_MS * 1000ULL);
+                } else if(wm_available_valid()) {
                     // Connected, reset retry count
                     _wm_available.retries = 0;
                     // Update times used to improve this network internal score
-                    _wm_available.networks[_wm_available.index].times_used++;
-                    wm_storage_save(&_wm_available.networks[_wm_available.index]);
+                    _wm_available.networks[_wm_available.index].network.times_used++;
+                    wm_network_update_ap(&_wm_available.networks[_wm_available.index].network);
+                    wm_storage_save(&_wm_available.networks[_wm_available.index].network);
+                    // Found in the background, the portal isn't needed anymore
+                    if(_wm_portal_running) wm_stop_basic_server_async();
                 }
                 break;
             case IP_EVENT_STA_LOST_IP:;
                 xEventGroupClearBits(_wm_event_group, WM_STA_CONNECTED_BIT);
                 break;
         }
+    } else if(event_base == WM_EVENT) {
+        switch(event_id) {
+            case WM_EVENT_DISCOVERY_DONE: {
+                wm_event_candidates_t* event = (wm_event_candidates_t*)event_data;
+                // Provisioning took over while scanning
+                if(_wm_portal_running) break;
+
+                memcpy(_wm_available.networks, event->networks, event->count * sizeof(wm_candidate_t));
+                _wm_available.count = event->count;
+                _wm_available.index = event->index;
+                if(wm_available_valid()) {
+                    wm_connect_to_candidate(&_wm_available.networks[_wm_available.index]);
+                } else {
+                    wm_reconnect_schedule();
+                }
+                break;
+            }
+#ifdef CONFIG_WM_PORTAL_PROBE
+            case WM_EVENT_PROBE_FOUND: {
+                wm_event_candidates_t* event = (wm_event_candidates_t*)event_data;
+                // Credentials may have been submitted while scanning
+                if(!_wm_portal_running || wm_provision_active() || wm_sta_connected()) break;
+
+                ESP_LOGI(TAG, "Stored network '%.32s' is back", event->networks[0].network.ssid);
+                memcpy(_wm_available.networks, event->networks, event->count * sizeof(wm_candidate_t));
+                _wm_available.count = event->count;
+                _wm_available.index = event->index;
+                _wm_probe_connecting = true;
+                wm_connect_to_candidate(&_wm_available.networks[_wm_available.index]);
+                break;
+            }
+#endif
+#ifdef CONFIG_WM_ROAMING
+            case WM_EVENT_ROAM_FOUND: {
+                wm_event_candidates_t* event = (wm_event_candidates_t*)event_data;
+                // Connection lost or portal started while scanning
+                if(!wm_sta_connected() || _wm_portal_running) break;
+
+                memcpy(_wm_available.networks, event->networks, event->count * sizeof(wm_candidate_t));
+                _wm_available.count = event->count;
+                _wm_available.index = event->index;
+                // Connects on WIFI_EVENT_STA_DISCONNECTED
+                _wm_roaming = true;
+                if(esp_wifi_disconnect() != ESP_OK) _wm_roaming = false;
+                break;
+            }
+#endif
+        }
     }
 }
 
@@ -125,6 +747,8 @@ esp_err_t wm_init(wm_config_t* wm_config) {
     if(err != ESP_OK) return err;
     err = esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &_event_handler, NULL);
     if(err != ESP_OK) return err;
+    err = esp_event_handler_register(WM_EVENT, ESP_EVENT_ANY_ID, &_event_handler, NULL);
+    if(err != ESP_OK) return err;
 
     // Init TCP/IP layer & WiFi
     tcpip_adapter_init();
@@ -132,27 +756,126 @@ esp_err_t wm_init(wm_config_t* wm_config) {
     wifi_init_config_t wifi_init_config = WIFI_INIT_CONFIG_DEFAULT();
     err = esp_wifi_init(&wifi_init_config);
     if(err != ESP_OK) return err;
+
+    err = wm_scan_cache_init();
+    if(err != ESP_OK) return err;
+
+    esp_timer_create_args_t teardown_timer_args = {
+        .callback = &_wm_teardown_timer_cb,
+        .name = "wm_teardown"
+    };
+    err = esp_timer_create(&teardown_timer_args, &_wm_teardown_timer);
+    if(err != ESP_OK) return err;
+
+    esp_timer_create_args_t reconnect_timer_args = {
+        .callback = &_wm_reconnect_timer_cb,
+        .name = "wm_reconnect"
+    };
+    err = esp_timer_create(&reconnect_timer_args, &_wm_reconnect_timer);
+    if(err != ESP_OK) return err;
+
+#ifdef CONFIG_WM_PORTAL_PROBE
+    esp_timer_create_args_t probe_timer_args = {
+        .callback = &_wm_probe_timer_cb,
+        .name = "wm_probe"
+    };
+    err = esp_timer_create(&probe_timer_args, &_wm_probe_timer);
+    if(err != ESP_OK) return err;
+#endif
+
+#ifdef CONFIG_WM_ROAMING
+    esp_timer_create_args_t roam_timer_args = {
+        .callback = &_wm_roam_timer_cb,
+        .name = "wm_roam"
+    };
+    err = esp_timer_create(&roam_timer_args, &_wm_roam_timer);
+    if(err != ESP_OK) return err;
+#endif
     
     // Check if we can connect to any known AP
     memset(&_wm_available, 0, sizeof(_wm_available));
-    _wm_available.networks = (wm_network_info_t*)malloc(WM_STORAGE_MAX_NETWORKS*sizeof(wm_network_info_t));
+    _wm_available.networks = (wm_candidate_t*)malloc(WM_STORAGE_MAX_NETWORKS*sizeof(wm_candidate_t));
+
+    wm_storage_get_last(_wm_last_ssid, sizeof(_wm_last_ssid));
+#if WM_SCAN_LEARNED_CHANNELS > 0
+    wm_storage_get_channels(_wm_channels);
+#endif
+
+#ifdef CONFIG_WM_OPTIMISTIC_CONNECT
+    // Try the network we last got an IP from before spending time on a full scan
+    if(wm_fast_candidate(&_wm_available.networks[0])) {
+#ifdef CONFIG_WM_OPTIMISTIC_TIMEOUT
+        esp_timer_create_args_t optimistic_timer_args = {
+            .callback = &_wm_optimistic_timer_cb,
+            .name = "wm_optimistic"
+        };
+        err = esp_timer_create(&optimistic_timer_args, &_wm_optimistic_timer);
+        if(err != ESP_OK) return err;
+#endif
+
+        _wm_available.count = 1;
+        _wm_fast_connecting = true;
+        wm_stats_count_attempt();
+        ESP_LOGI(TAG, "Fast reconnect to '%.32s' (channel %d)",
+            _wm_available.networks[0].network.ssid, _wm_available.networks[0].channel);
+
+#ifdef CONFIG_WM_OPTIMISTIC_TIMEOUT
+        // Without it the attempt lasts until the driver reports a failure
+        err = esp_timer_start_once(_wm_optimistic_timer, WM_OPTIMISTIC_TIMEOUT_MS * 1000ULL);
+        if(err != ESP_OK) return err;
+#endif
+        return wm_connect_to_candidate(&_wm_available.networks[0]);
+    }
+#endif
+
     err = wm_available_connections(_wm_available.networks, &_wm_available.count);
     if(err != ESP_OK) return err;
 
     for(int i = 0; i < _wm_available.count; i++)
-        ESP_LOGI(TAG, "Network found: %s (score: %d)",
-            _wm_available.networks[i].ssid,
-            _wm_available.networks[i].times_used);
+        ESP_LOGI(TAG, "Network found: %.32s ["MACSTR"] (rssi: %d, used: %d, score: %d)",
+            _wm_available.networks[i].network.ssid,
+            MAC2STR(_wm_available.networks[i].bssid),
+            _wm_available.networks[i].rssi,
+            _wm_available.networks[i].network.times_used,
+            _wm_available.networks[i].score);
 
     if(_wm_available.count <= 0) {
-        err = wm_setup_basic_server(_wm_config);
+        err = wm_reconnect_schedule();
     } else {
-        err = wm_connect_to(&_wm_available.networks[_wm_available.index]);
+        err = wm_connect_to_candidate(&_wm_available.networks[_wm_available.index]);
     }
     return err;
 }
 
-esp_err_t wm_available_connections(wm_network_info_t* found_networks, uint8_t* count) {
+esp_err_t wm_get_stats(wm_stats_t* stats) {
+    esp_err_t err = wm_storage_counter_get(WM_STORAGE_FAST_TRIES_KEY, &stats->fast_attempts);
+    if(err != ESP_OK) return err;
+    err = wm_storage_counter_get(WM_STORAGE_FAST_OK_KEY, &stats->fast_successes);
+    if(err != ESP_OK) return err;
+
+    if(_wm_stats_pending.magic == WM_STATS_MAGIC) {
+        stats->fast_attempts += _wm_stats_pending.stats.fast_attempts;
+        stats->fast_successes += _wm_stats_pending.stats.fast_successes;
+    }
+    return ESP_OK;
+}
+
+int16_t wm_candidate_score(const wm_candidate_t* candidate) {
+    int16_t score = MAX(WM_SCORE_RSSI_FLOOR, MIN(WM_SCORE_RSSI_CEIL, candidate->rssi)) - WM_SCORE_RSSI_FLOOR;
+    score += MIN(candidate->network.times_used, WM_SCORE_MAX_USES) * WM_SCORE_PER_USE;
+
+    if(candidate->authmode == WIFI_AUTH_WEP) {
+        score += WM_SCORE_AUTH_WEP;
+    } else if(candidate->authmode > WIFI_AUTH_WPA2_ENTERPRISE) {
+        // WPA3 modes, when the IDF knows about them, come after WPA2
+        score += WM_SCORE_AUTH_WPA3;
+    } else if(candidate->authmode != WIFI_AUTH_OPEN) {
+        score += WM_SCORE_AUTH_WPA;
+    }
+    return score;
+}
+
+esp_err_t wm_available_connections(wm_candidate_t* found_networks, uint8_t* count) {
     esp_err_t err;
     *count = 0;
 
@@ -188,38 +911,39 @@ esp_err_t wm_available_connections(wm_network_info_t* found_networks, uint8_t* c
     if(err != ESP_OK) return err;
 
     // Get available Access Points
-    uint16_t ap_count = WM_SCAN_MAX_NETWORKS;
-    wifi_ap_record_t ap_records[ap_count];
-    err = wm_scan_networks(ap_records, &ap_count);
+    uint16_t ap_count;
+    wifi_ap_record_t ap_records[WM_SCAN_MAX_NETWORKS];
+
+#if WM_SCAN_LEARNED_CHANNELS > 0
+    // Channels our networks are usually on first, stop at the first match
+    uint8_t channels[WM_SCAN_LEARNED_CHANNELS];
+    uint8_t channels_count = wm_learned_channels(channels);
+    for(int i = 0; i < channels_count; i++) {
+        ap_count = WM_SCAN_MAX_NETWORKS;
+        if(wm_scan_for_stored(stored_networks, stored_count, channels[i], ap_records, &ap_count) != ESP_OK) continue;
+
+        wm_match_candidates(stored_networks, stored_count, ap_records, ap_count, found_networks, count);
+        if(*count > 0) {
+            ESP_LOGI(TAG, "Stored network found on learned channel %d", channels[i]);
+            return ESP_OK;
+        }
+    }
+#endif
+
+    // Full sweep
+    ap_count = WM_SCAN_MAX_NETWORKS;
+    err = wm_scan_for_stored(stored_networks, stored_count, 0, ap_records, &ap_count);
     if(err != ESP_OK) return err;
     // No AP available
     if(ap_count == 0) return ESP_OK;
 
-    for(int stored = 0; stored < stored_count; stored++) {
-        for(int ap = 0; ap < ap_count; ap++) {
-            if(strcmp(stored_networks[stored].ssid, (char*)(ap_records[ap].ssid)) == 0) {
-                found_networks[(*count)++] = stored_networks[stored];
-                break;
-            }
-        }
-    }
+    wm_match_candidates(stored_networks, stored_count, ap_records, ap_count, found_networks, count);
     return ESP_OK;
 }
 
 esp_err_t wm_scan_networks(wifi_ap_record_t* ap_records, uint16_t* ap_num) {
-    esp_err_t err;
-    
-    wifi_scan_config_t scan_config = {
-        .ssid = 0,
-        .bssid = 0,
-        .channel = 0,
-        .show_hidden = true
-    };
-    err = esp_wifi_scan_start(&scan_config, true);
-    if(err != ESP_OK) return err;
-
-    err = esp_wifi_scan_get_ap_records(ap_num, ap_records);
-    return err;
+    // Go through the scan cache so it never overlaps with a background scan
+    return wm_scan_cache_wait(ap_records, ap_num, WM_SCAN_TIMEOUT_MS / portTICK_PERIOD_MS);
 }
 
 esp_err_t wm_setup_basic_server(wm_config_t* wm_config) {
@@ -231,11 +955,57 @@ esp_err_t wm_setup_basic_server(wm_config_t* wm_config) {
 
     wm_dns_captive_start(wm_config);
 
-    wm_start_webserver(); return ESP_OK;
+    wm_start_webserver();
+    // Keep scan results fresh for the provisioning page
+    wm_scan_cache_start_periodic();
+    _wm_portal_running = true;
+#ifdef CONFIG_WM_PORTAL_PROBE
+    if(_wm_probe_timer) esp_timer_start_periodic(_wm_probe_timer, WM_PORTAL_PROBE_PERIOD_MS * 1000ULL);
+#endif
+    return ESP_OK;
     //err = wm_start_webserver();
     //return err;
 }
 
+esp_err_t wm_stop_basic_server() {
+    if(!_wm_portal_running) return ESP_OK;
+    ESP_LOGI(TAG, "Stopping basic configuration server");
+
+#ifdef CONFIG_WM_PORTAL_PROBE
+    if(_wm_probe_timer) esp_timer_stop(_wm_probe_timer);
+#endif
+    wm_scan_cache_stop_periodic();
+    wm_stop_webserver();
+    wm_dns_captive_stop();
+    _wm_portal_running = false;
+
+    // Keep STA (and its connection) only
+    return esp_wifi_set_mode(WIFI_MODE_STA);
+}
+
+esp_err_t wm_provision_connect(wm_network_info_t* network_info) {
+    if(!_wm_portal_running || wm_provision_active()) return ESP_ERR_INVALID_STATE;
+
+    _wm_provision_network = *network_info;
+    _wm_provision_retries = 0;
+    memset(&_wm_provision, 0, sizeof(_wm_provision));
+    memcpy(_wm_provision.ssid, network_info->ssid, strnlen(network_info->ssid, sizeof(network_info->ssid)));
+    wm_provision_set_state(WM_PROVISION_ASSOCIATING, 0);
+
+    // Background scans would get in the way of the connection
+    wm_scan_cache_stop_periodic();
+    esp_err_t err = wm_connect_to(&_wm_provision_network);
+    if(err != ESP_OK) {
+        wm_provision_set_state(WM_PROVISION_FAILED, 0);
+        wm_scan_cache_start_periodic();
+    }
+    return err;
+}
+
+void wm_provision_get_status(wm_provision_status_t* status) {
+    *status = _wm_provision;
+}
+
 esp_err_t wm_start_ap(wm_config_t* wm_config) {
     esp_err_t err; 
 
@@ -259,6 +1029,11 @@ esp_err_t wm_start_ap(wm_config_t* wm_config) {
         : WIFI_AUTH_OPEN;
 
     wifi_config.ap.max_connection = 4;
+#if WM_SCAN_LEARNED_CHANNELS > 0
+    // Where stored networks usually are: reconnecting to them won't move the AP
+    uint8_t channels[WM_SCAN_LEARNED_CHANNELS];
+    if(wm_learned_channels(channels) > 0) wifi_config.ap.channel = channels[0];
+#endif
 
     err = esp_wifi_set_mode(WIFI_MODE_AP);
     if(err != ESP_OK) return err;
@@ -268,18 +1043,30 @@ esp_err_t wm_start_ap(wm_config_t* wm_config) {
     return err;
 }
 
-esp_err_t wm_connect_to(wm_network_info_t* network_info) {
+/*
+ * Connect to the given network, to a specific BSSID (and channel, if not 0)
+ * when 'bssid' isn't NULL
+ */
+static esp_err_t wm_connect(wm_network_info_t* network_info, const uint8_t* bssid, uint8_t channel) {
     esp_err_t err;
     _wm_available.retries = 0;
 
     wifi_config_t wifi_config = {};
     //memset(&wifi_config, 0, sizeof(wifi_config));
-    strcpy((char *)(wifi_config.sta.ssid), network_info->ssid);
-    strcpy((char *)(wifi_config.sta.password), network_info->password);
-
-    ESP_LOGI(TAG, "Connecting to '%s'", wifi_config.sta.ssid);
+    // Same sizes, and neither needs a NUL when full
+    memcpy(wifi_config.sta.ssid, network_info->ssid, sizeof(wifi_config.sta.ssid));
+    memcpy(wifi_config.sta.password, network_info->password, sizeof(wifi_config.sta.password));
+    if(bssid) {
+        wifi_config.sta.bssid_set = true;
+        memcpy(wifi_config.sta.bssid, bssid, sizeof(wifi_config.sta.bssid));
+        wifi_config.sta.channel = channel;
+        ESP_LOGI(TAG, "Connecting to '%.32s' ["MACSTR"]", wifi_config.sta.ssid, MAC2STR(bssid));
+    } else {
+        ESP_LOGI(TAG, "Connecting to '%.32s'", wifi_config.sta.ssid);
+    }
 
-    err = esp_wifi_set_mode(WIFI_MODE_STA);
+    // Keep the provisioning AP up while connecting
+    err = esp_wifi_set_mode(_wm_portal_running ? WIFI_MODE_APSTA : WIFI_MODE_STA);
     if(err != ESP_OK) return err;
     err = esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
     if(err != ESP_OK) return err;
@@ -288,4 +1075,14 @@ esp_err_t wm_connect_to(wm_network_info_t* network_info) {
 
     if(wm_sta_started) err = esp_wifi_connect();
     return err;
+}
+
+esp_err_t wm_connect_to(wm_network_info_t* network_info) {
+    return wm_connect(network_info, NULL, 0);
+}
+
+esp_err_t wm_connect_to_candidate(wm_candidate_t* candidate) {
+    // AP unknown, let the driver find the SSID
+    if(candidate->channel == 0) return wm_connect(&candidate->network, NULL, 0);
+    return wm_connect(&candidate->network, candidate->bssid, candidate->channel);
 }
\ No newline at end of file
@@ -7,13 +7,16 @@
 #include <esp_wifi.h>
 #include <esp_event.h>
 #include <nvs_flash.h>
+#include "tcpip_adapter.h"
 
 #include "sdkconfig.h"
 #include <esp_log.h>
+#include <esp_timer.h>
 
 #include "wm_storage.h"
 #include "wm_dns.h"
 #include "wm_webserver.h"
+#include "wm_scan.h"
 
 
 
@@ -22,6 +25,42 @@
 #define WM_DEFAULT_AP_PASSWORD  "WM_pa55w0rd"
 #define WM_CONNECTION_MAX_RETRIES 2
 #define WM_SCAN_MAX_NETWORKS 20
+#define WM_DISCOVERY_TASK_STACK_SIZE 4096
+
+#ifdef CONFIG_WM_OPTIMISTIC_TIMEOUT
+#define WM_OPTIMISTIC_TIMEOUT_MS CONFIG_WM_OPTIMISTIC_TIMEOUT_MS
+#endif
+
+// Delay between reconnect rounds, see wm_reconnect_delay_ms()
+#define WM_BACKOFF_BASE_MS CONFIG_WM_BACKOFF_BASE_MS
+#define WM_BACKOFF_MAX_MS CONFIG_WM_BACKOFF_MAX_MS
+#ifdef CONFIG_WM_PORTAL_AFTER_TIMEOUT
+#define WM_PORTAL_TIMEOUT_S CONFIG_WM_PORTAL_TIMEOUT_S
+#endif
+#ifdef CONFIG_WM_PORTAL_PROBE
+#define WM_PORTAL_PROBE_PERIOD_MS CONFIG_WM_PORTAL_PROBE_PERIOD_MS
+#endif
+#ifdef CONFIG_WM_ROAMING
+#define WM_ROAM_CHECK_PERIOD_MS CONFIG_WM_ROAM_CHECK_PERIOD_MS
+#define WM_ROAM_RSSI_THRESHOLD  CONFIG_WM_ROAM_RSSI_THRESHOLD
+#define WM_ROAM_HYSTERESIS_DB   CONFIG_WM_ROAM_HYSTERESIS_DB
+#define WM_ROAM_MIN_DWELL_S     CONFIG_WM_ROAM_MIN_DWELL_S
+#endif
+
+// Time the portal stays up after provisioned credentials got an IP
+#define WM_PROVISION_TEARDOWN_DELAY_MS 5000
+
+// Fast reconnect attempts counted in RTC memory before the counters go to NVS
+#define WM_STATS_FLUSH_EVERY 16
+
+// Candidate score weights. RSSI counts 1 point per dB above WM_SCORE_RSSI_FLOOR
+#define WM_SCORE_RSSI_FLOOR     -90
+#define WM_SCORE_RSSI_CEIL      -30
+#define WM_SCORE_PER_USE        2
+#define WM_SCORE_MAX_USES       10
+#define WM_SCORE_AUTH_WEP       2
+#define WM_SCORE_AUTH_WPA       5
+#define WM_SCORE_AUTH_WPA3      8
 
 #define WM_STA_CONNECTED_BIT BIT0
 //#define WM_AP_STARTED_BIT    BIT1
@@ -60,15 +99,38 @@ typedef struct wm_config_t {
 wm_config_t* _wm_config;
 
 
+/*
+ * Stored network. New fields go at the end: blobs saved by older versions are
+ * shorter and read back with the missing fields zeroed.
+ */
 typedef struct wm_network_info_t {
+    // Like wifi_config_t: NUL terminated unless they take the whole array,
+    // e.g. a 32 byte SSID or a 64 hex digit PSK
     char ssid[32];
     char password[64];
     uint16_t times_used;
+    // AP of the last successful connection, valid if channel isn't 0
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t authmode;
 } wm_network_info_t;
 extern wm_network_info_t wm_network_info_default;
 
+/*
+ * Stored network found nearby, with its strongest BSSID
+ */
+typedef struct wm_candidate_t {
+    wm_network_info_t network;
+    uint8_t bssid[6];
+    uint8_t channel;
+    int8_t rssi;
+    wifi_auth_mode_t authmode;
+    // See wm_candidate_score(), candidates are tried highest first
+    int16_t score;
+} wm_candidate_t;
+
 struct {
-    wm_network_info_t* networks;
+    wm_candidate_t* networks;
     uint8_t count;
     uint8_t index;
     uint8_t retries;
@@ -77,6 +139,34 @@ struct {
 uint8_t wm_sta_started;
 
 
+typedef struct wm_stats_t {
+    // Boots that tried the last good network (its cached AP if known) first
+    uint32_t fast_attempts;
+    // ...and got an IP without scanning
+    uint32_t fast_successes;
+} wm_stats_t;
+
+
+typedef enum {
+    WM_PROVISION_IDLE = 0,
+    // Scanning for and associating to the network
+    WM_PROVISION_ASSOCIATING,
+    // Associated, waiting for DHCP
+    WM_PROVISION_DHCP,
+    WM_PROVISION_CONNECTED,
+    WM_PROVISION_FAILED
+} wm_provision_state_t;
+
+typedef struct wm_provision_status_t {
+    wm_provision_state_t state;
+    char ssid[33];
+    // wifi_err_reason_t of the last disconnection, 0 if none
+    uint8_t reason;
+    // Valid once connected. esp_netif's type, what IP events carry since IDF 4.1
+    esp_ip4_addr_t ip;
+} wm_provision_status_t;
+
+
 bool wm_sta_connected();
 
 /*
@@ -85,14 +175,29 @@ bool wm_sta_connected();
 esp_err_t wm_init(wm_config_t* wm_config);
 
 /*
- * Find networks nearby whose credentials are stored.
- * @param found_networks    wm_network_info_t array of available connections
+ * Get connection counters. Fast reconnect ones are kept across boots: in NVS,
+ * plus up to WM_STATS_FLUSH_EVERY attempts in RTC memory that a power loss
+ * forgets.
+ */
+esp_err_t wm_get_stats(wm_stats_t* stats);
+
+/*
+ * Find networks nearby whose credentials are stored, best candidate first.
+ * Scans, so it blocks: don't call it from the event loop task.
+ * @param found_networks    wm_candidate_t array of available connections
  * @param count             Won't be greater than min(WM_STORAGE_MAX_NETWORKS, WM_SCAN_MAX_NETWORKS)
  */
-esp_err_t wm_available_connections(wm_network_info_t* found_networks, uint8_t* count);
+esp_err_t wm_available_connections(wm_candidate_t* found_networks, uint8_t* count);
+
+/*
+ * Score a candidate from its signal strength, how often it was used and its
+ * security. Higher is better.
+ */
+int16_t wm_candidate_score(const wm_candidate_t* candidate);
 
 /*
  * Blocking scan of nearby networks. WiFi must be already started in STA or STA-SoftAP mode.
+ * If a background scan is already running, waits for its results instead of starting another one.
  */
 esp_err_t wm_scan_networks(wifi_ap_record_t* ap_records, uint16_t* ap_num);
 
@@ -104,6 +209,26 @@ esp_err_t wm_scan_networks(wifi_ap_record_t* ap_records, uint16_t* ap_num);
  */
 esp_err_t wm_setup_basic_server(wm_config_t* wm_config);
 
+/*
+ * Stop the basic configuration server and the AP. STA connection is kept.
+ * Blocks up to WM_DNS_STOP_TIMEOUT_MS: not to be called from the event loop
+ * or esp_timer callbacks.
+ */
+esp_err_t wm_stop_basic_server();
+
+/*
+ * Connect to a network submitted through the portal while it stays up (APSTA).
+ * Progress can be followed with wm_provision_get_status(). Once an IP is
+ * obtained, the network is stored and the portal is stopped after
+ * WM_PROVISION_TEARDOWN_DELAY_MS.
+ * 
+ * Returns ESP_ERR_INVALID_STATE if the portal isn't running or another
+ * attempt is in progress.
+ */
+esp_err_t wm_provision_connect(wm_network_info_t* network_info);
+
+void wm_provision_get_status(wm_provision_status_t* status);
+
 /*
  * Create and Access Point with the given configuration
  */
@@ -113,3 +238,10 @@ esp_err_t wm_start_ap(wm_config_t* wm_config);
  * Connect to the given network
  */
 esp_err_t wm_connect_to(wm_network_info_t* network_info);
+
+/*
+ * Connect to the given candidate, straight to its BSSID and channel. The last
+ * retry after a disconnection drops the BSSID and lets the driver pick any AP
+ * of the SSID.
+ */
+esp_err_t wm_connect_to_candidate(wm_candidate_t* candidate);
@@ -25,250 +25,453 @@ the internal webserver.
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "freertos/event_groups.h"
+#include "esp_timer.h"
 #include "lwip/sockets.h"
 #include "lwip/err.h"
 #include "tcpip_adapter.h"
 #include "string.h"
+#include <sys/param.h>
+#include <ctype.h>
+#include "esp_system.h"
 
-static int _sock;
+static int _sock = -1;
+static EventGroupHandle_t _wm_dns_event_group = NULL;
+static wm_dns_stats_t _wm_dns_stats;
+//SoftAP IPv4 address in network order, refreshed by wm_dns_captive_update_addr()
+static volatile uint32_t _wm_dns_ap_addr;
+//Bumped whenever cached replies become stale
+static volatile uint32_t _wm_dns_cache_generation;
 
 
 
-typedef struct __attribute__ ((packed)) {
-	uint16_t id;
-	uint8_t flags;
-	uint8_t rcode;
-	uint16_t qdcount;
-	uint16_t ancount;
-	uint16_t nscount;
-	uint16_t arcount;
-} DnsHeader;
+#ifdef CONFIG_WM_DNS_RATE_LIMIT
+//Token bucket per client address. Tokens are kept in thousandths so slow refill
+//rates don't get lost to rounding.
+typedef struct {
+	uint32_t addr;
+	uint32_t tokens;
+	int64_t last_seen;
+} DnsRateBucket;
 
+static DnsRateBucket _buckets[WM_DNS_RATE_LIMIT_CLIENTS];
 
-typedef struct __attribute__ ((packed)) {
-	uint8_t len;
-	uint8_t data;
-} DnsLabel;
-
-
-typedef struct __attribute__ ((packed)) {
-	//before: label
-	uint16_t type;
-	uint16_t class;
-} DnsQuestionFooter;
-
+//Takes a token from the client bucket. Returns false if the client is over its rate
+static bool  rateLimitAllow(uint32_t addr) {
+	int i;
+	int64_t now=esp_timer_get_time();
+	DnsRateBucket *bucket=&_buckets[0];
+	for (i=0; i<WM_DNS_RATE_LIMIT_CLIENTS; i++) {
+		if (_buckets[i].addr==addr && _buckets[i].last_seen!=0) {
+			bucket=&_buckets[i];
+			break;
+		}
+		//Unknown client: it takes over the least recently seen bucket
+		if (_buckets[i].last_seen<bucket->last_seen) bucket=&_buckets[i];
+	}
+	if (bucket->addr!=addr || bucket->last_seen==0) {
+		bucket->addr=addr;
+		bucket->tokens=WM_DNS_RATE_LIMIT_BURST*1000;
+	} else {
+		uint64_t refill=(uint64_t)(now-bucket->last_seen)*WM_DNS_RATE_LIMIT_QPS/1000;
+		bucket->tokens=MIN(bucket->tokens+refill, WM_DNS_RATE_LIMIT_BURST*1000);
+	}
+	bucket->last_seen=now;
 
-typedef struct __attribute__ ((packed)) {
-	//before: label
-	uint16_t type;
-	uint16_t class;
-	uint32_t ttl;
-	uint16_t rdlength;
-	//after: rdata
-} DnsResourceFooter;
+	if (bucket->tokens<1000) return false;
+	bucket->tokens-=1000;
+	return true;
+}
+#endif
+
+#if WM_DNS_CACHE_SIZE > 0 || defined(CONFIG_WM_DNS_FORWARDER)
+//FNV-1a
+static uint32_t  hashQuestion(char *question, int qlen) {
+	uint32_t hash=2166136261u;
+	while (qlen--) {
+		hash^=(uint8_t)*question++;
+		hash*=16777619u;
+	}
+	return hash;
+}
 
-typedef struct __attribute__ ((packed)) {
-	uint16_t prio;
-	uint16_t weight;
-} DnsUriHdr;
+//Returns the length of the question section of a message with exactly one question, or 0
+static int  singleQuestionLen(char *msg, int msg_len) {
+	DnsHeader *hdr=(DnsHeader*)msg;
+	if (msg_len<sizeof(DnsHeader) || msg_len>DNS_PACKET_LEN) return 0;
+	if (my_ntohs(&hdr->qdcount)!=1) return 0;
+	char *p=wm_dns_skip_label(msg+sizeof(DnsHeader), msg+msg_len);
+	if (p==NULL || p+sizeof(DnsQuestionFooter)>msg+msg_len) return 0;
+	return p+sizeof(DnsQuestionFooter)-(msg+sizeof(DnsHeader));
+}
 
+//Finds the question section of a cacheable query: a standard query with exactly one question.
+//Returns its length, or 0 if the query can't be served from the cache
+static int  cacheableQuestion(char *msg, unsigned short msg_len) {
+	DnsHeader *hdr=(DnsHeader*)msg;
+	if (msg_len<sizeof(DnsHeader)) return 0;
+	if ((hdr->flags&(FLAG_QR|FLAG_TC)) || OPCODE(hdr->flags)!=OPCODE_QUERY) return 0;
+	if (hdr->ancount || hdr->nscount) return 0;
+	return singleQuestionLen(msg, msg_len);
+}
+#endif
+
+#if WM_DNS_CACHE_SIZE > 0
+//Ready-made replies to single-question queries, keyed by the raw question section
+typedef struct {
+	uint32_t hash;
+	uint32_t generation;
+	uint32_t last_used;
+	uint16_t qlen;
+	uint16_t len;
+	char data[WM_DNS_CACHE_ENTRY_LEN];
+} DnsCacheEntry;
+
+static DnsCacheEntry _cache[WM_DNS_CACHE_SIZE];
+static uint32_t _cache_clock;
+
+static DnsCacheEntry*  cacheLookup(char *msg, int qlen, uint32_t hash) {
+	int i;
+	for (i=0; i<WM_DNS_CACHE_SIZE; i++) {
+		DnsCacheEntry *entry=&_cache[i];
+		if (entry->len==0 || entry->hash!=hash || entry->qlen!=qlen) continue;
+		if (entry->generation!=_wm_dns_cache_generation) continue;
+		if (memcmp(entry->data+sizeof(DnsHeader), msg+sizeof(DnsHeader), qlen)!=0) continue;
+		entry->last_used=++_cache_clock;
+		return entry;
+	}
+	return NULL;
+}
 
-#define FLAG_QR (1<<7)
-#define FLAG_AA (1<<2)
-#define FLAG_TC (1<<1)
-#define FLAG_RD (1<<0)
+static void  cacheStore(char *reply, int reply_len, int qlen, uint32_t hash, uint32_t generation) {
+	int i;
+	if (reply_len>WM_DNS_CACHE_ENTRY_LEN) return;
+	DnsCacheEntry *entry=&_cache[0];
+	for (i=1; i<WM_DNS_CACHE_SIZE; i++) {
+		if (_cache[i].last_used<entry->last_used) entry=&_cache[i];
+	}
+	memcpy(entry->data, reply, reply_len);
+	entry->hash=hash;
+	entry->generation=generation;
+	entry->last_used=++_cache_clock;
+	entry->qlen=qlen;
+	entry->len=reply_len;
+}
+#endif
+
+#ifdef CONFIG_WM_DNS_FORWARDER
+//Forwarding mode: while the STA interface is connected, queries for anything but
+//the portal host are relayed to the upstream resolver and their answers cached.
+
+static int _upstream_sock = -1;
+//Portal host in label form
+static char _portal_qname[DNS_NAME_MAX_LEN+1];
+static int _portal_qname_len;
+
+typedef struct {
+	struct sockaddr_in addr;
+	uint16_t id;				//Client transaction ID, network order
+	uint8_t rd;					//Client RD flag
+} DnsWaiter;
+
+//A query sent upstream, with every client waiting for its answer
+typedef struct {
+	int64_t sent_at;			//0 if the slot is free
+	struct in_addr upstream;	//Resolver the query was sent to
+	uint16_t upstream_id;
+	uint16_t qlen;
+	uint8_t nwaiters;
+	DnsWaiter waiters[WM_DNS_FORWARDER_WAITERS];
+	char question[DNS_NAME_MAX_LEN+1+sizeof(DnsQuestionFooter)];
+} DnsPendingQuery;
+
+static DnsPendingQuery _pending[WM_DNS_FORWARDER_PENDING];
+
+typedef struct {
+	uint32_t hash;
+	uint32_t last_used;
+	int64_t stored_at;
+	int64_t expires_at;			//0 if the entry is free
+	uint16_t qlen;
+	uint16_t len;
+	char data[WM_DNS_FORWARDER_ENTRY_LEN];
+} DnsForwardEntry;
+
+static DnsForwardEntry _fwd_cache[WM_DNS_FORWARDER_CACHE_SIZE];
+static uint32_t _fwd_cache_clock;
+
+//Converts the host of WM_DNS_HOST_URL to label form
+static void  portalQnameInit() {
+	const char *host=WM_DNS_HOST_URL;
+	const char *scheme=strstr(host, "://");
+	if (scheme!=NULL) host=scheme+3;
+
+	char *len=_portal_qname;	//ptr to len byte
+	char *p=_portal_qname+1;	//ptr to next label byte to be written
+	while (*host && *host!='/' && *host!=':' && (p-_portal_qname)<DNS_NAME_MAX_LEN) {
+		if (*host=='.') {
+			*len=(p-len)-1;
+			len=p++;
+			host++;
+		} else {
+			*p++=tolower((unsigned char)*host++);
+		}
+	}
+	*len=(p-len)-1;
+	if (*len!=0) *p++=0;		//terminate unless the host ended with a dot
+	_portal_qname_len=p-_portal_qname;
+}
 
-#define QTYPE_A  1
-#define QTYPE_NS 2
-#define QTYPE_CNAME 5
-#define QTYPE_SOA 6
-#define QTYPE_WKS 11
-#define QTYPE_PTR 12
-#define QTYPE_HINFO 13
-#define QTYPE_MINFO 14
-#define QTYPE_MX 15
-#define QTYPE_TXT 16
-#define QTYPE_URI 256
+static bool  isPortalQuestion(char *msg, int qlen) {
+	int i;
+	char *qname=msg+sizeof(DnsHeader);
+	if (qlen-(int)sizeof(DnsQuestionFooter)!=_portal_qname_len) return false;
+	for (i=0; i<_portal_qname_len; i++) {
+		if (tolower((unsigned char)qname[i])!=_portal_qname[i]) return false;
+	}
+	return true;
+}
 
-#define QCLASS_IN 1
-#define QCLASS_ANY 255
-#define QCLASS_URI 256
+static bool  upstreamAddr(struct sockaddr_in *addr) {
+	memset(addr, 0, sizeof(struct sockaddr_in));
+	addr->sin_family=AF_INET;
+	addr->sin_port=htons(WM_DNS_UPSTREAM_PORT);
+	addr->sin_len=sizeof(struct sockaddr_in);
+	if (strlen(WM_DNS_FORWARDER_UPSTREAM)>0) return inet_aton(WM_DNS_FORWARDER_UPSTREAM, &addr->sin_addr);
+
+	//Resolver given by the STA side DHCP server
+	tcpip_adapter_dns_info_t dns;
+	if (tcpip_adapter_get_dns_info(TCPIP_ADAPTER_IF_STA, TCPIP_ADAPTER_DNS_MAIN, &dns)!=ESP_OK) return false;
+	addr->sin_addr.s_addr=dns.ip.u_addr.ip4.addr;
+	return addr->sin_addr.s_addr!=0;
+}
 
+//Walks every record after the question, subtracting elapsed seconds from its TTL.
+//Returns the smallest TTL left, WM_DNS_NEGATIVE_TTL if there are no records, or -1 if malformed
+static int32_t  adjustTtls(char *msg, int len, int qlen, uint32_t elapsed) {
+	DnsHeader *hdr=(DnsHeader*)msg;
+	char *end=msg+len;
+	char *p=msg+sizeof(DnsHeader)+qlen;
+	int count=my_ntohs(&hdr->ancount)+my_ntohs(&hdr->nscount)+my_ntohs(&hdr->arcount);
+	uint32_t min_ttl=WM_DNS_NEGATIVE_TTL;
+	bool found=false;
+
+	while (count--) {
+		p=wm_dns_skip_label(p, end);
+		if (p==NULL || p+sizeof(DnsResourceFooter)>end) return -1;
+		DnsResourceFooter *rf=(DnsResourceFooter*)p;
+		p+=sizeof(DnsResourceFooter)+my_ntohs(&rf->rdlength);
+		if (p>end) return -1;
+		if (my_ntohs(&rf->type)==QTYPE_OPT) continue;	//OPT TTL field holds flags
+
+		uint32_t ttl=my_ntohl(&rf->ttl);
+		ttl=ttl>elapsed ? ttl-elapsed : 0;
+		if (elapsed) setn32(&rf->ttl, ttl);
+		if (!found || ttl<min_ttl) min_ttl=ttl;
+		found=true;
+	}
+	return MIN(min_ttl, WM_DNS_FORWARDER_MAX_TTL);
+}
 
-//Function to put unaligned 16-bit network values
-static void  setn16(void *pp, int16_t n) {
-	char *p=pp;
-	*p++=(n>>8);
-	*p++=(n&0xff);
+static DnsForwardEntry*  fwdCacheLookup(char *msg, int qlen, uint32_t hash, int64_t now) {
+	int i;
+	for (i=0; i<WM_DNS_FORWARDER_CACHE_SIZE; i++) {
+		DnsForwardEntry *entry=&_fwd_cache[i];
+		if (entry->expires_at<=now || entry->hash!=hash || entry->qlen!=qlen) continue;
+		if (memcmp(entry->data+sizeof(DnsHeader), msg+sizeof(DnsHeader), qlen)!=0) continue;
+		entry->last_used=++_fwd_cache_clock;
+		return entry;
+	}
+	return NULL;
 }
 
-//Function to put unaligned 32-bit network values
-static void  setn32(void *pp, int32_t n) {
-	char *p=pp;
-	*p++=(n>>24)&0xff;
-	*p++=(n>>16)&0xff;
-	*p++=(n>>8)&0xff;
-	*p++=(n&0xff);
+static void  fwdCacheStore(char *reply, int reply_len, int qlen, int64_t now) {
+	int i;
+	if (reply_len>WM_DNS_FORWARDER_ENTRY_LEN) return;
+	int32_t ttl=adjustTtls(reply, reply_len, qlen, 0);
+	if (ttl<=0) return;
+
+	//Take a free or expired entry, or evict the least recently used one
+	DnsForwardEntry *entry=&_fwd_cache[0];
+	for (i=0; i<WM_DNS_FORWARDER_CACHE_SIZE; i++) {
+		if (_fwd_cache[i].expires_at<=now) {
+			entry=&_fwd_cache[i];
+			break;
+		}
+		if (_fwd_cache[i].last_used<entry->last_used) entry=&_fwd_cache[i];
+	}
+	memcpy(entry->data, reply, reply_len);
+	entry->hash=hashQuestion(reply+sizeof(DnsHeader), qlen);
+	entry->last_used=++_fwd_cache_clock;
+	entry->stored_at=now;
+	entry->expires_at=now+(int64_t)ttl*1000000;
+	entry->qlen=qlen;
+	entry->len=reply_len;
 }
 
-static uint16_t  my_ntohs(uint16_t *in) {
-	char *p=(char*)in;
-	return ((p[0]<<8)&0xff00)|(p[1]&0xff);
+static void  sendToClient(char *msg, int len, uint16_t id, uint8_t rd, struct sockaddr_in *addr) {
+	DnsHeader *hdr=(DnsHeader*)msg;
+	hdr->id=id;
+	hdr->flags=(hdr->flags&~FLAG_RD)|rd;
+	sendto(_sock, (uint8_t*)msg, len, 0, (struct sockaddr*)addr, sizeof(struct sockaddr_in));
 }
 
-//Parses a label into a C-string containing a dotted 
-//Returns pointer to start of next fields in packet
-static char*  labelToStr(char *packet, char *labelPtr, int packetSz, char *res, int resMaxLen) {
-	int i, j, k;
-	char *endPtr=NULL;
-	i=0;
+//Answers the query from the cache, joins an identical query already in flight or
+//sends it upstream. Queries that can't be queued right now are dropped, clients will retry.
+//Returns false, leaving msg untouched, if there is no upstream resolver to ask
+static bool  forwardQuery(struct sockaddr_in *remote_addr, char *msg, int qlen) {
+	int i;
+	DnsHeader *hdr=(DnsHeader*)msg;
+	uint16_t id=hdr->id;
+	uint8_t rd=hdr->flags&FLAG_RD;
+	int64_t now=esp_timer_get_time();
+
+	DnsForwardEntry *entry=fwdCacheLookup(msg, qlen, hashQuestion(msg+sizeof(DnsHeader), qlen), now);
+	if (entry!=NULL) {
+		memcpy(msg, entry->data, entry->len);
+		adjustTtls(msg, entry->len, qlen, (now-entry->stored_at)/1000000);
+		_wm_dns_stats.forward_cache_hits++;
+		sendToClient(msg, entry->len, id, rd, remote_addr);
+		return true;
+	}
+
+	DnsPendingQuery *pending=NULL;
+	DnsPendingQuery *free_slot=NULL;
+	for (i=0; i<WM_DNS_FORWARDER_PENDING; i++) {
+		if (_pending[i].sent_at==0) {
+			if (free_slot==NULL) free_slot=&_pending[i];
+		} else if (_pending[i].qlen==qlen && memcmp(_pending[i].question, msg+sizeof(DnsHeader), qlen)==0) {
+			pending=&_pending[i];
+			break;
+		}
+	}
+	if (pending!=NULL) {
+		//Same question already asked upstream, wait for that answer
+		for (i=0; i<pending->nwaiters; i++) {
+			DnsWaiter *w=&pending->waiters[i];
+			if (w->id==id && w->addr.sin_addr.s_addr==remote_addr->sin_addr.s_addr
+					&& w->addr.sin_port==remote_addr->sin_port) return true;	//Retransmission
+		}
+		if (pending->nwaiters==WM_DNS_FORWARDER_WAITERS) return true;
+		pending->waiters[pending->nwaiters++]=(DnsWaiter){*remote_addr, id, rd};
+		_wm_dns_stats.forward_merged++;
+		return true;
+	}
+
+	//E.g. connected, but DHCP gave no resolver
+	struct sockaddr_in upstream;
+	if (_upstream_sock==-1 || !upstreamAddr(&upstream)) return false;
+	if (free_slot==NULL) return true;
+
+	pending=free_slot;
 	do {
-		if ((*labelPtr&0xC0)==0) {
-			j=*labelPtr++; //skip past length
-			//Add separator period if there already is data in res
-			if (i<resMaxLen && i!=0) res[i++]='.';
-			//Copy label to res
-			for (k=0; k<j; k++) {
-				if ((labelPtr-packet)>packetSz) return NULL;
-				if (i<resMaxLen) res[i++]=*labelPtr++;
-			}
-		} else if ((*labelPtr&0xC0)==0xC0) {
-			//Compressed label pointer
-			endPtr=labelPtr+2;
-			int offset=my_ntohs(((uint16_t *)labelPtr))&0x3FFF;
-			//Check if offset points to somewhere outside of the packet
-			if (offset>packetSz) return NULL;
-			labelPtr=&packet[offset];
+		pending->upstream_id=esp_random()&0xFFFF;
+		for (i=0; i<WM_DNS_FORWARDER_PENDING; i++) {
+			if (&_pending[i]!=pending && _pending[i].sent_at!=0 && _pending[i].upstream_id==pending->upstream_id) break;
 		}
-		//check for out-of-bound-ness
-		if ((labelPtr-packet)>packetSz) return NULL;
-	} while (*labelPtr!=0);
-	res[i]=0; //zero-terminate
-	if (endPtr==NULL) endPtr=labelPtr+1;
-	return endPtr;
+	} while (i<WM_DNS_FORWARDER_PENDING);
+	pending->upstream=upstream.sin_addr;
+	pending->qlen=qlen;
+	memcpy(pending->question, msg+sizeof(DnsHeader), qlen);
+	pending->waiters[0]=(DnsWaiter){*remote_addr, id, rd};
+	pending->nwaiters=1;
+	pending->sent_at=now;
+
+	//Only header and question go upstream, so the answer fits in DNS_PACKET_LEN
+	hdr->id=pending->upstream_id;
+	hdr->arcount=0;
+	sendto(_upstream_sock, (uint8_t*)msg, sizeof(DnsHeader)+qlen, 0, (struct sockaddr*)&upstream, sizeof(upstream));
+	_wm_dns_stats.forwarded++;
+	return true;
 }
 
-//Converts a dotted hostname to the weird label form dns uses.
-static char  *strToLabel(char *str, char *label, int maxLen) {
-	char *len=label; //ptr to len byte
-	char *p=label+1; //ptr to next label byte to be written
-	while (1) {
-		if (*str=='.' || *str==0) {
-			*len=((p-len)-1);	//write len of label bit
-			len=p;				//pos of len for next part
-			p++;				//data ptr is one past len
-			if (*str==0) break;	//done
-			str++;
-		} else {
-			*p++=*str++;	//copy byte
-            //if ((p-label)>maxLen) return NULL;	//check out of bounds
+//Receive an upstream answer and hand it to every client waiting for it
+static void  wm_dns_forward_handle(struct sockaddr_in *remote_addr, char *msg, unsigned short msg_len) {
+	int i;
+	DnsHeader *hdr=(DnsHeader*)msg;
+	if (remote_addr->sin_port!=htons(WM_DNS_UPSTREAM_PORT)) return;
+	if (msg_len<sizeof(DnsHeader) || !(hdr->flags&FLAG_QR)) return;
+
+	DnsPendingQuery *pending=NULL;
+	for (i=0; i<WM_DNS_FORWARDER_PENDING; i++) {
+		//Only the resolver that was asked can answer
+		if (_pending[i].sent_at!=0 && _pending[i].upstream_id==hdr->id
+				&& _pending[i].upstream.s_addr==remote_addr->sin_addr.s_addr) {
+			pending=&_pending[i];
+			break;
 		}
 	}
-	*len=0;
-	return p; //ptr to first free byte in resp
-}
+	if (pending==NULL) return;
+	int qlen=singleQuestionLen(msg, msg_len);
+	if (qlen!=pending->qlen || memcmp(pending->question, msg+sizeof(DnsHeader), qlen)!=0) return;
 
-//Receive a DNS packet and maybe send a response back
-static void  wm_dns_captive_handle(struct sockaddr_in *remote_addr, char *msg, unsigned short msg_len) {
+	uint8_t rcode=hdr->rcode&0x0F;
+	if (!(hdr->flags&FLAG_TC) && (rcode==RCODE_NOERROR || rcode==RCODE_NXDOMAIN)) {
+		fwdCacheStore(msg, msg_len, qlen, esp_timer_get_time());
+	}
+	for (i=0; i<pending->nwaiters; i++) {
+		DnsWaiter *w=&pending->waiters[i];
+		sendToClient(msg, msg_len, w->id, w->rd, &w->addr);
+	}
+	pending->sent_at=0;
+}
 
-	char buff[DNS_PACKET_LEN];
-	char reply[DNS_PACKET_LEN];
+//Forget queries that upstream never answered
+static void  expirePending() {
 	int i;
-	char *rend=&reply[msg_len];
-	char *p=msg;
-	DnsHeader *hdr=(DnsHeader*)p;
-	DnsHeader *rhdr=(DnsHeader*)&reply[0];
-	p+=sizeof(DnsHeader);
-    
-	//Some sanity checks:
-	if (msg_len>DNS_PACKET_LEN) return; 								//Packet is longer than DNS implementation allows
-	if (msg_len<sizeof(DnsHeader)) return; 						//Packet is too short
-	if (hdr->ancount || hdr->nscount || hdr->arcount) return;	//this is a reply, don't know what to do with it
-	if (hdr->flags&FLAG_TC) return;								//truncated, can't use this
-	//Reply is basically the request plus the needed data
-	memcpy(reply, msg, msg_len);
-	rhdr->flags|=FLAG_QR;
-
-	for (i=0; i<my_ntohs(&hdr->qdcount); i++) 
-	{
-		//Grab the labels in the q string
-		p=labelToStr(msg, p, msg_len, buff, sizeof(buff));
-		if (p==NULL) return;
-		DnsQuestionFooter *qf=(DnsQuestionFooter*)p;
-		p+=sizeof(DnsQuestionFooter);
-		
-		ESP_LOGI(TAG, "[Request] Q (type 0x%X class 0x%X) for %s\n", my_ntohs(&qf->type), my_ntohs(&qf->class), buff);
-		
-
-		if (my_ntohs(&qf->type)==QTYPE_A) {
-			//They want to know the IPv4 address of something.
-			//Build the response.
-			
-			rend=strToLabel(buff, rend, sizeof(reply)-(rend-reply)); //Add the label
-			if (rend==NULL) return;
-			DnsResourceFooter *rf=(DnsResourceFooter *)rend;
-			rend+=sizeof(DnsResourceFooter);
-			setn16(&rf->type, QTYPE_A);
-			setn16(&rf->class, QCLASS_IN);
-			setn32(&rf->ttl, 0);
-			setn16(&rf->rdlength, 4); //IPv4 addr is 4 bytes;
-			//Grab the current IP of the softap interface
-
-			
-			tcpip_adapter_ip_info_t info;
-			//tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_ETH, &info);
-			tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_AP, &info);
-			//struct ip_info info;
-			//wifi_get_ip_info(SOFTAP_IF, &info);
-			*rend++=ip4_addr1(&info.ip);
-			*rend++=ip4_addr2(&info.ip);
-			*rend++=ip4_addr3(&info.ip);
-			*rend++=ip4_addr4(&info.ip);
-			setn16(&rhdr->ancount, my_ntohs(&rhdr->ancount)+1);
-			//printf("IP Address:  %s\n", ip4addr_ntoa(&info.ip));
-            //printf("Added A rec to resp. Resp len is %d\n", (rend-reply));
-
-		} else if (my_ntohs(&qf->type)==QTYPE_NS) {
-			//Give ns server. Basically can be whatever we want because it'll get resolved to our IP later anyway.
-			rend=strToLabel(buff, rend, sizeof(reply)-(rend-reply)); //Add the label
-			DnsResourceFooter *rf=(DnsResourceFooter *)rend;
-			rend+=sizeof(DnsResourceFooter);
-			setn16(&rf->type, QTYPE_NS);
-			setn16(&rf->class, QCLASS_IN);
-			setn16(&rf->ttl, 0);
-			setn16(&rf->rdlength, 4);
-			*rend++=2;
-			*rend++='n';
-			*rend++='s';
-			*rend++=0;
-			setn16(&rhdr->ancount, my_ntohs(&rhdr->ancount)+1);
-            //printf("Added NS rec to resp. Resp len is %d\n", (rend-reply));
-		} else if (my_ntohs(&qf->type)==QTYPE_URI) {
-			//Give uri to us
-			rend=strToLabel(buff, rend, sizeof(reply)-(rend-reply)); //Add the label
-			DnsResourceFooter *rf=(DnsResourceFooter *)rend;
-			rend+=sizeof(DnsResourceFooter);
-			DnsUriHdr *uh=(DnsUriHdr *)rend;
-			rend+=sizeof(DnsUriHdr);
-			setn16(&rf->type, QTYPE_URI);
-			setn16(&rf->class, QCLASS_URI);
-			setn16(&rf->ttl, 0);
-			setn16(&rf->rdlength, 4+16);
-			setn16(&uh->prio, 10);
-			setn16(&uh->weight, 1);
-			memcpy(rend, "http://esp.nonet", 16);
-			rend+=16;
-			setn16(&rhdr->ancount, my_ntohs(&rhdr->ancount)+1);
-            //printf("Added NS rec to resp. Resp len is %d\n", (rend-reply));
+	int64_t now=esp_timer_get_time();
+	for (i=0; i<WM_DNS_FORWARDER_PENDING; i++) {
+		if (_pending[i].sent_at!=0 && now-_pending[i].sent_at>WM_DNS_FORWARDER_TIMEOUT_MS*1000LL) {
+			_pending[i].sent_at=0;
 		}
-	}	
-	//Send the response
-	sendto(_sock, (uint8_t*)reply, rend-reply, 0, (struct sockaddr*)remote_addr, sizeof(struct sockaddr_in));
+	}
+}
+#endif
 
+//Receive a DNS packet and maybe send a response back
+static void  wm_dns_captive_handle(struct sockaddr_in *remote_addr, char *msg, unsigned short msg_len) {
+	_wm_dns_stats.queries++;
+#ifdef CONFIG_WM_DNS_RATE_LIMIT
+	if (!rateLimitAllow(remote_addr->sin_addr.s_addr)) {
+		_wm_dns_stats.dropped++;
+		return;
+	}
+#endif
+#if WM_DNS_CACHE_SIZE > 0 || defined(CONFIG_WM_DNS_FORWARDER)
+	int qlen=cacheableQuestion(msg, msg_len);
+#endif
+#ifdef CONFIG_WM_DNS_FORWARDER
+	//Without an upstream resolver, fall back to the captive answer
+	if (qlen>0 && wm_sta_connected() && !isPortalQuestion(msg, qlen) && forwardQuery(remote_addr, msg, qlen)) return;
+#endif
+#if WM_DNS_CACHE_SIZE > 0
+	uint32_t hash=0;
+	uint32_t generation=_wm_dns_cache_generation;
+	if (qlen>0) {
+		hash=hashQuestion(msg+sizeof(DnsHeader), qlen);
+		DnsCacheEntry *entry=cacheLookup(msg, qlen, hash);
+		if (entry!=NULL) {
+			//Same question, so only the ID and the client's RD bit differ
+			DnsHeader *rhdr=(DnsHeader*)entry->data;
+			rhdr->id=((DnsHeader*)msg)->id;
+			rhdr->flags=(rhdr->flags&~FLAG_RD)|(((DnsHeader*)msg)->flags&FLAG_RD);
+			_wm_dns_stats.cache_hits++;
+			sendto(_sock, (uint8_t*)entry->data, entry->len, 0, (struct sockaddr*)remote_addr, sizeof(struct sockaddr_in));
+			return;
+		}
+		_wm_dns_stats.cache_misses++;
+	}
+#endif
+	int reply_len=wm_dns_captive_reply(msg, msg_len, _wm_dns_ap_addr);
+	if (reply_len==0) return;
+#if WM_DNS_CACHE_SIZE > 0
+	if (qlen>0) cacheStore(msg, reply_len, qlen, hash, generation);
+#endif
+	sendto(_sock, (uint8_t*)msg, reply_len, 0, (struct sockaddr*)remote_addr, sizeof(struct sockaddr_in));
 }
 
 static void _wm_dns_captive_task(void *pvParameters) {
-	uint32_t ret;
+	int ret;
 
 	struct sockaddr_in server_addr;
 	memset(&server_addr, 0, sizeof(server_addr));
@@ -277,7 +480,7 @@ static void _wm_dns_captive_task(void *pvParameters) {
 	server_addr.sin_port = htons(DNS_PORT);
 	server_addr.sin_len = sizeof(server_addr);
 
-	wm_dns_running = true;
+	wm_dns_captive_update_addr();
 	
 	do {
 		_sock = socket(AF_INET, SOCK_DGRAM, 0);
@@ -286,7 +489,7 @@ static void _wm_dns_captive_task(void *pvParameters) {
 			vTaskDelay(1000/portTICK_RATE_MS);
 		}
 	} while(_sock == -1 && wm_dns_running);
-	if(!wm_dns_running) { vTaskDelete(NULL); return; }
+	if(!wm_dns_running) goto stopped;
 	
 	do {
 		ret = bind(_sock, (struct sockaddr *)&server_addr, sizeof(server_addr));
@@ -295,29 +498,126 @@ static void _wm_dns_captive_task(void *pvParameters) {
 			vTaskDelay(1000/portTICK_RATE_MS);
 		}
 	} while (ret != 0 && wm_dns_running);
+	// Non-blocking, so every queued datagram can be drained after each wakeup
+	fcntl(_sock, F_SETFL, fcntl(_sock, F_GETFL, 0) | O_NONBLOCK);
+
+#ifdef CONFIG_WM_DNS_FORWARDER
+	portalQnameInit();
+	memset(_pending, 0, sizeof(_pending));
+	_upstream_sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if(_upstream_sock == -1) {
+		ESP_LOGE(TAG, WM_DNS_CAPTIVE_TASK_NAME" failed to create upstream sock, forwarding disabled");
+	} else {
+		fcntl(_upstream_sock, F_SETFL, fcntl(_upstream_sock, F_GETFL, 0) | O_NONBLOCK);
+	}
+#endif
 
     ESP_LOGI(TAG, "Captive DNS initialized");
 
 	struct sockaddr_in from;
 	socklen_t fromlen;
 	char msg[DNS_PACKET_LEN];
+	fd_set readfds;
+	struct timeval timeout;
+	
+	int maxfd;
 	
 	while(wm_dns_running) {
-		memset(&from, 0, sizeof(from));
-		fromlen = sizeof(struct sockaddr_in);
-		ret = recvfrom(_sock, (uint8_t *)msg, DNS_PACKET_LEN, 0, (struct sockaddr*)&from, &fromlen);
-		if(ret > 0) wm_dns_captive_handle(&from, msg, ret);
+		FD_ZERO(&readfds);
+		FD_SET(_sock, &readfds);
+		maxfd = _sock;
+#ifdef CONFIG_WM_DNS_FORWARDER
+		if(_upstream_sock != -1) {
+			FD_SET(_upstream_sock, &readfds);
+			maxfd = MAX(maxfd, _upstream_sock);
+		}
+#endif
+		// wm_dns_captive_stop() wakes us up, the timeout is just a safety net
+		timeout.tv_sec = WM_DNS_SELECT_TIMEOUT_MS / 1000;
+		timeout.tv_usec = (WM_DNS_SELECT_TIMEOUT_MS % 1000) * 1000;
+		ret = select(maxfd + 1, &readfds, NULL, NULL, &timeout);
+#ifdef CONFIG_WM_DNS_FORWARDER
+		expirePending();
+#endif
+		if(ret <= 0) continue;
+
+		while(wm_dns_running && FD_ISSET(_sock, &readfds)) {
+			fromlen = sizeof(struct sockaddr_in);
+			ret = recvfrom(_sock, (uint8_t *)msg, DNS_PACKET_LEN, 0, (struct sockaddr*)&from, &fromlen);
+			if(ret < 0) break;	// Queue drained (EWOULDBLOCK) or socket error
+			if(ret > 0) wm_dns_captive_handle(&from, msg, ret);
+		}
+#ifdef CONFIG_WM_DNS_FORWARDER
+		while(wm_dns_running && _upstream_sock != -1 && FD_ISSET(_upstream_sock, &readfds)) {
+			fromlen = sizeof(struct sockaddr_in);
+			ret = recvfrom(_upstream_sock, (uint8_t *)msg, DNS_PACKET_LEN, 0, (struct sockaddr*)&from, &fromlen);
+			if(ret < 0) break;
+			if(ret > 0) wm_dns_forward_handle(&from, msg, ret);
+		}
+#endif
 	}
 	
-	close(_sock);
-	ESP_LOGI(TAG, "Captive DNS stopped");
+stopped:
+	if(_sock != -1) close(_sock);
+	_sock = -1;
+#ifdef CONFIG_WM_DNS_FORWARDER
+	if(_upstream_sock != -1) close(_upstream_sock);
+	_upstream_sock = -1;
+#endif
+	xEventGroupSetBits(_wm_dns_event_group, WM_DNS_STOPPED_BIT);
 	vTaskDelete(NULL);
 }
 
+void wm_dns_get_stats(wm_dns_stats_t* stats) {
+	*stats = _wm_dns_stats;
+}
+
+void wm_dns_captive_update_addr() {
+	tcpip_adapter_ip_info_t info;
+	if(tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_AP, &info) != ESP_OK) return;
+	if(info.ip.addr == _wm_dns_ap_addr) return;
+	_wm_dns_ap_addr = info.ip.addr;
+	// Cached replies carry the old address
+	_wm_dns_cache_generation++;
+}
+
 void wm_dns_captive_start(wm_config_t* wm_config) {
+	if(wm_dns_running) return;
+	if(_wm_dns_event_group == NULL) _wm_dns_event_group = xEventGroupCreate();
+	xEventGroupClearBits(_wm_dns_event_group, WM_DNS_STOPPED_BIT);
+
+	wm_dns_running = true;
 	xTaskCreate(_wm_dns_captive_task, (const char *)WM_DNS_CAPTIVE_TASK_NAME, 10000, NULL, 3, NULL);
 }
 
-void wm_dns_captive_stop() {
+// Send an empty datagram to the DNS socket so select() returns right away
+static void _wm_dns_captive_wakeup() {
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if(sock == -1) return;
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(DNS_PORT);
+	addr.sin_len = sizeof(addr);
+	sendto(sock, NULL, 0, 0, (struct sockaddr*)&addr, sizeof(addr));
+	close(sock);
+}
+
+esp_err_t wm_dns_captive_stop() {
+	if(!wm_dns_running) return ESP_OK;
+	int64_t stop_start = esp_timer_get_time();
+
 	wm_dns_running = false;
-}
\ No newline at end of file
+	_wm_dns_captive_wakeup();
+
+	EventBits_t bits = xEventGroupWaitBits(_wm_dns_event_group, WM_DNS_STOPPED_BIT,
+		pdFALSE, pdTRUE, WM_DNS_STOP_TIMEOUT_MS / portTICK_PERIOD_MS);
+	if(!(bits & WM_DNS_STOPPED_BIT)) {
+		ESP_LOGW(TAG, "Captive DNS didn't stop in %d ms", WM_DNS_STOP_TIMEOUT_MS);
+		return ESP_ERR_TIMEOUT;
+	}
+	ESP_LOGI(TAG, "Captive DNS stopped in %d us", (int)(esp_timer_get_time() - stop_start));
+	return ESP_OK;
+}
@@ -5,19 +5,87 @@
 #include "sdkconfig.h"
 
 #include "wifi_manager.h"
+#include "wm_dns_msg.h"
 
 #define WM_DNS_HOST_URL CONFIG_WM_AP_DNS_URL
 
 #define WM_DNS_CAPTIVE_TASK_NAME "wm_dns_captive_task"
 
-#define DNS_PACKET_LEN 512
+#ifndef DNS_PORT
 #define DNS_PORT 53
+#endif
+
+// Upper bound for select() sleeps, in case a stop wakeup datagram is lost
+#define WM_DNS_SELECT_TIMEOUT_MS 1000
+// How long wm_dns_captive_stop() waits for the DNS task to exit
+#define WM_DNS_STOP_TIMEOUT_MS 2000
+
+#define WM_DNS_STOPPED_BIT BIT0
+
+#define WM_DNS_RATE_LIMIT_QPS CONFIG_WM_DNS_RATE_LIMIT_QPS
+#define WM_DNS_RATE_LIMIT_BURST CONFIG_WM_DNS_RATE_LIMIT_BURST
+// Clients tracked by the rate limiter. SoftAP allows 4 stations, leave some slack
+#define WM_DNS_RATE_LIMIT_CLIENTS 8
+
+#define WM_DNS_CACHE_SIZE CONFIG_WM_DNS_CACHE_SIZE
+// Replies longer than this are not cached
+#define WM_DNS_CACHE_ENTRY_LEN 128
+
+#ifdef CONFIG_WM_DNS_FORWARDER
+// Empty: use the resolver given by the STA network DHCP server
+#define WM_DNS_FORWARDER_UPSTREAM CONFIG_WM_DNS_FORWARDER_UPSTREAM
+#define WM_DNS_FORWARDER_CACHE_SIZE CONFIG_WM_DNS_FORWARDER_CACHE_SIZE
+#define WM_DNS_FORWARDER_MAX_TTL CONFIG_WM_DNS_FORWARDER_MAX_TTL
+#endif
+// Port upstream resolvers listen on. Host tests override it, see test/host
+#ifndef WM_DNS_UPSTREAM_PORT
+#define WM_DNS_UPSTREAM_PORT DNS_PORT
+#endif
+// Upstream answers longer than this are not cached
+#define WM_DNS_FORWARDER_ENTRY_LEN 256
+// Distinct queries waiting for an upstream answer
+#define WM_DNS_FORWARDER_PENDING 6
+// Clients that can wait for the same upstream answer
+#define WM_DNS_FORWARDER_WAITERS 4
+#define WM_DNS_FORWARDER_TIMEOUT_MS 3000
 
 
 typedef struct wm_config_t wm_config_t;
 
+typedef struct wm_dns_stats_t {
+    // Datagrams received
+    uint32_t queries;
+    // Queries dropped because their client was over its rate limit
+    uint32_t dropped;
+    // Queries answered from the reply cache
+    uint32_t cache_hits;
+    // Cacheable queries that had to be built
+    uint32_t cache_misses;
+    // Queries sent to the upstream resolver
+    uint32_t forwarded;
+    // Queries that joined an identical one already sent upstream
+    uint32_t forward_merged;
+    // Queries answered from the forwarder cache
+    uint32_t forward_cache_hits;
+} wm_dns_stats_t;
+
 
 bool wm_dns_running;
 
 void wm_dns_captive_start(wm_config_t* wm_config);
-void wm_dns_captive_stop();
+/*
+ * Stop the captive DNS and wait for its task to exit.
+ * Returns ESP_ERR_TIMEOUT if the task didn't stop in WM_DNS_STOP_TIMEOUT_MS.
+ */
+esp_err_t wm_dns_captive_stop();
+
+/*
+ * Get captive DNS counters since boot
+ */
+void wm_dns_get_stats(wm_dns_stats_t* stats);
+
+/*
+ * Refresh the SoftAP address given in captive DNS answers. Called on AP start;
+ * call it again after changing the AP interface IP.
+ */
+void wm_dns_captive_update_addr();
@@ -0,0 +1,200 @@
+#include "wm_dns_msg.h"
+
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain 
+ * this notice you can do whatever you want with this stuff. If we meet some day, 
+ * and you think this stuff is worth it, you can buy me a beer in return. 
+ *
+ * modified for ESP32 by Cornelis 
+ * 
+ * ----------------------------------------------------------------------------
+ */
+
+
+#include <string.h>
+
+
+//Compression pointers are never followed, so malicious pointer loops can't keep us here
+char*  wm_dns_skip_label(char *labelPtr, char *end) {
+	char *start=labelPtr;
+	while (labelPtr<end) {
+		uint8_t len=(uint8_t)*labelPtr;
+		if ((len&0xC0)==0xC0) {
+			//Compressed label pointer always terminates the name
+			return (labelPtr+2<=end) ? labelPtr+2 : NULL;
+		}
+		if (len&0xC0) return NULL;						//Reserved label types
+		if (len==0) return labelPtr+1;
+		labelPtr+=len+1;
+		if (labelPtr-start>DNS_NAME_MAX_LEN) return NULL;	//Names are 255 bytes at most
+	}
+	return NULL;
+}
+
+//Appends a resource record after rend. Its name is a compression pointer back to the
+//question name at qname, so the name itself is never copied.
+//Returns pointer to the first free byte after the record, or NULL if it doesn't fit
+static char*  putRecord(char *packet, char *rend, char *qname, uint16_t type, uint16_t class, uint32_t ttl, const char *rdata, uint16_t rdlength) {
+	if ((rend-packet)+2+sizeof(DnsResourceFooter)+rdlength > DNS_PACKET_LEN) return NULL;
+	setn16(rend, 0xC000|(qname-packet));
+	rend+=2;
+	DnsResourceFooter *rf=(DnsResourceFooter *)rend;
+	rend+=sizeof(DnsResourceFooter);
+	setn16(&rf->type, type);
+	setn16(&rf->class, class);
+	setn32(&rf->ttl, ttl);
+	setn16(&rf->rdlength, rdlength);
+	memcpy(rend, rdata, rdlength);
+	return rend+rdlength;
+}
+
+//NS answer. Basically can be whatever we want because it'll get resolved to our IP later anyway.
+static const char ns_rdata[]={2, 'n', 's', 0};
+//URI answer: priority 10, weight 1, target
+static const char uri_rdata[]="\x00\x0a\x00\x01" "http://esp.nonet";
+//SOA sent in the authority section of NODATA answers. Its MINIMUM field is the
+//negative caching TTL, so clients don't retry these types straight away.
+static const char soa_rdata[]={
+	2, 'n', 's', 0,									//MNAME
+	2, 'n', 's', 0,									//RNAME
+	0, 0, 0, 1,										//SERIAL
+	0, 0, 0x0e, 0x10,								//REFRESH (3600)
+	0, 0, 0x02, 0x58,								//RETRY (600)
+	0, 0x01, 0x51, 0x80,							//EXPIRE (86400)
+	(WM_DNS_NEGATIVE_TTL>>24)&0xff, (WM_DNS_NEGATIVE_TTL>>16)&0xff,
+	(WM_DNS_NEGATIVE_TTL>>8)&0xff, WM_DNS_NEGATIVE_TTL&0xff,	//MINIMUM
+};
+
+typedef enum {
+	ANSWER_AP_ADDR,		//A record with the SoftAP address
+	ANSWER_RDATA,		//Record with fixed rdata
+	ANSWER_NODATA,		//No records, SOA in the authority section
+	ANSWER_EMPTY,		//No records at all
+} DnsAnswerKind;
+
+typedef struct {
+	uint16_t type;
+	DnsAnswerKind kind;
+	uint16_t class;
+	const char *rdata;
+	uint16_t rdlength;
+} DnsQtypeEntry;
+
+#ifdef CONFIG_WM_DNS_NODATA_IPV6_HTTPS
+#define ANSWER_IPV6_HTTPS ANSWER_NODATA
+#else
+#define ANSWER_IPV6_HTTPS ANSWER_EMPTY
+#endif
+
+//How each QTYPE is answered. Types not listed get qtype_default.
+static const DnsQtypeEntry qtype_table[]={
+	{QTYPE_A, ANSWER_AP_ADDR, QCLASS_IN, NULL, 4},
+	{QTYPE_NS, ANSWER_RDATA, QCLASS_IN, ns_rdata, sizeof(ns_rdata)},
+	{QTYPE_URI, ANSWER_RDATA, QCLASS_URI, uri_rdata, sizeof(uri_rdata)-1},
+	//Listed either way, so they don't fall back to qtype_default
+	{QTYPE_AAAA, ANSWER_IPV6_HTTPS},
+	{QTYPE_HTTPS, ANSWER_IPV6_HTTPS},
+	{QTYPE_SVCB, ANSWER_IPV6_HTTPS},
+};
+
+#ifdef CONFIG_WM_DNS_NODATA_UNKNOWN
+static const DnsQtypeEntry qtype_default={0, ANSWER_NODATA};
+#else
+static const DnsQtypeEntry qtype_default={0, ANSWER_EMPTY};
+#endif
+
+static const DnsQtypeEntry*  findQtype(uint16_t type) {
+	int i;
+	for (i=0; i<sizeof(qtype_table)/sizeof(qtype_table[0]); i++) {
+		if (qtype_table[i].type==type) return &qtype_table[i];
+	}
+	return &qtype_default;
+}
+
+//Turns the DNS request in msg into its reply.
+//The reply is built in place: the header is patched, anything after the question
+//section is dropped and the records are appended right after the questions.
+int  wm_dns_captive_reply(char *msg, unsigned short msg_len, uint32_t ap_addr) {
+	int i;
+	char *end=&msg[msg_len];
+	char *p=msg;
+	char *rend;
+	char *nodata_qname=NULL;
+	DnsHeader *hdr=(DnsHeader*)p;
+	uint16_t qdcount, ancount=0, nscount=0;
+	p+=sizeof(DnsHeader);
+
+	//Some sanity checks:
+	if (msg_len>DNS_PACKET_LEN) return 0; 						//Packet is longer than DNS implementation allows
+	if (msg_len<sizeof(DnsHeader)) return 0; 						//Packet is too short
+	if (hdr->flags&FLAG_QR) return 0;								//this is a reply, don't know what to do with it
+	if (OPCODE(hdr->flags)!=OPCODE_QUERY) {
+		//Only standard queries are served, answer anything else with just a header
+		hdr->flags|=FLAG_QR;
+		hdr->rcode=WM_DNS_UNSUPPORTED_OPCODE_RCODE;
+		hdr->qdcount=hdr->ancount=hdr->nscount=hdr->arcount=0;
+		return sizeof(DnsHeader);
+	}
+	if (hdr->ancount || hdr->nscount) return 0;					//queries don't carry answers
+	if (hdr->flags&FLAG_TC) return 0;								//truncated, can't use this
+
+	//Find the end of the question section, answers go right after it.
+	//Additional records (e.g. EDNS options) are dropped from the reply.
+	qdcount=my_ntohs(&hdr->qdcount);
+	for (i=0; i<qdcount; i++) {
+		p=wm_dns_skip_label(p, end);
+		if (p==NULL || p+sizeof(DnsQuestionFooter)>end) return 0;
+		p+=sizeof(DnsQuestionFooter);
+	}
+	rend=p;
+
+	p=msg+sizeof(DnsHeader);
+	for (i=0; i<qdcount; i++) {
+		char *qname=p;
+		p=wm_dns_skip_label(p, end);
+		DnsQuestionFooter *qf=(DnsQuestionFooter*)p;
+		p+=sizeof(DnsQuestionFooter);
+
+		const DnsQtypeEntry *entry=findQtype(my_ntohs(&qf->type));
+		char *next;
+		switch (entry->kind) {
+			case ANSWER_AP_ADDR:
+				//They want to know the IPv4 address of something: the SoftAP one
+				next=putRecord(msg, rend, qname, entry->type, entry->class, 0, (char*)&ap_addr, 4);
+				break;
+			case ANSWER_RDATA:
+				next=putRecord(msg, rend, qname, entry->type, entry->class, 0, entry->rdata, entry->rdlength);
+				break;
+			case ANSWER_NODATA:
+				if (nodata_qname==NULL) nodata_qname=qname;
+				continue;
+			default:
+				continue;
+		}
+		if (next==NULL) {
+			//No room left in the packet for more answers
+			hdr->flags|=FLAG_TC;
+			break;
+		}
+		rend=next;
+		ancount++;
+	}
+
+	//The authority section goes after every answer
+	if (nodata_qname!=NULL && !(hdr->flags&FLAG_TC)) {
+		char *next=putRecord(msg, rend, nodata_qname, QTYPE_SOA, QCLASS_IN, WM_DNS_NEGATIVE_TTL, soa_rdata, sizeof(soa_rdata));
+		if (next!=NULL) {
+			rend=next;
+			nscount++;
+		}
+	}
+
+	hdr->flags|=FLAG_QR|FLAG_AA;
+	hdr->rcode=RCODE_NOERROR;
+	setn16(&hdr->ancount, ancount);
+	setn16(&hdr->nscount, nscount);
+	hdr->arcount=0;
+	return rend-msg;
+}
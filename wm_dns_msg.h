@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdkconfig.h"
+
+/*
+ * DNS message parsing and captive reply building. Plain C without RTOS or
+ * socket dependencies, so it can also be built and measured on a host (see
+ * test/host).
+ */
+
+#define WM_DNS_NEGATIVE_TTL CONFIG_WM_DNS_NEGATIVE_TTL
+#ifdef CONFIG_WM_DNS_UNSUPPORTED_OPCODE_REFUSED
+#define WM_DNS_UNSUPPORTED_OPCODE_RCODE 5   // REFUSED
+#else
+#define WM_DNS_UNSUPPORTED_OPCODE_RCODE 4   // NOTIMP
+#endif
+
+#define DNS_PACKET_LEN 512
+#define DNS_NAME_MAX_LEN 255
+
+
+typedef struct __attribute__ ((packed)) {
+	uint16_t id;
+	uint8_t flags;
+	uint8_t rcode;
+	uint16_t qdcount;
+	uint16_t ancount;
+	uint16_t nscount;
+	uint16_t arcount;
+} DnsHeader;
+
+typedef struct __attribute__ ((packed)) {
+	//before: label
+	uint16_t type;
+	uint16_t class;
+} DnsQuestionFooter;
+
+typedef struct __attribute__ ((packed)) {
+	//before: label
+	uint16_t type;
+	uint16_t class;
+	uint32_t ttl;
+	uint16_t rdlength;
+	//after: rdata
+} DnsResourceFooter;
+
+
+#define FLAG_QR (1<<7)
+#define FLAG_AA (1<<2)
+#define FLAG_TC (1<<1)
+#define FLAG_RD (1<<0)
+
+#define OPCODE(flags) (((flags)>>3)&0x0F)
+#define OPCODE_QUERY 0
+
+#define RCODE_NOERROR 0
+#define RCODE_NXDOMAIN 3
+#define RCODE_NOTIMP 4
+#define RCODE_REFUSED 5
+
+#define QTYPE_A  1
+#define QTYPE_NS 2
+#define QTYPE_CNAME 5
+#define QTYPE_SOA 6
+#define QTYPE_WKS 11
+#define QTYPE_PTR 12
+#define QTYPE_HINFO 13
+#define QTYPE_MINFO 14
+#define QTYPE_MX 15
+#define QTYPE_TXT 16
+#define QTYPE_AAAA 28
+#define QTYPE_OPT 41
+#define QTYPE_SVCB 64
+#define QTYPE_HTTPS 65
+#define QTYPE_URI 256
+
+#define QCLASS_IN 1
+#define QCLASS_ANY 255
+#define QCLASS_URI 256
+
+
+//Function to put unaligned 16-bit network values
+static inline void  setn16(void *pp, int16_t n) {
+	char *p=pp;
+	*p++=(n>>8);
+	*p++=(n&0xff);
+}
+
+//Function to put unaligned 32-bit network values
+static inline void  setn32(void *pp, int32_t n) {
+	char *p=pp;
+	*p++=(n>>24)&0xff;
+	*p++=(n>>16)&0xff;
+	*p++=(n>>8)&0xff;
+	*p++=(n&0xff);
+}
+
+static inline uint16_t  my_ntohs(uint16_t *in) {
+	uint8_t *p=(uint8_t*)in;
+	return (p[0]<<8)|p[1];
+}
+
+static inline uint32_t  my_ntohl(uint32_t *in) {
+	uint8_t *p=(uint8_t*)in;
+	return ((uint32_t)p[0]<<24)|((uint32_t)p[1]<<16)|(p[2]<<8)|p[3];
+}
+
+/*
+ * Skip over a (possibly compressed) name without decoding it. Compression
+ * pointers are never followed.
+ *
+ * Returns a pointer to the fields after the name, or NULL if it is malformed
+ * or runs past 'end'.
+ */
+char* wm_dns_skip_label(char *labelPtr, char *end);
+
+/*
+ * Turn the DNS request in 'msg' into its captive reply, in place. A queries
+ * are answered with 'ap_addr' (IPv4, network order). 'msg' must be
+ * DNS_PACKET_LEN bytes long.
+ *
+ * Returns the reply length, or 0 if nothing should be sent back.
+ */
+int wm_dns_captive_reply(char *msg, unsigned short msg_len, uint32_t ap_addr);
@@ -0,0 +1,278 @@
+#include "wm_form.h"
+
+typedef enum {
+    JSON_OBJECT_START = 0,
+    JSON_KEY_START,
+    JSON_KEY,
+    JSON_COLON,
+    JSON_VALUE_START,
+    JSON_VALUE,
+    JSON_NEXT,
+    JSON_DONE
+} json_state_t;
+
+
+static int hex_value(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static inline bool is_json_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/*
+ * Key is complete, select where its value will be decoded
+ */
+static void begin_value(wm_form_parser_t* parser) {
+    parser->key[parser->key_len] = '\0';
+    parser->value = NULL;
+    parser->in_value = true;
+    if(parser->key_overflow) return;
+
+    if(strcmp(parser->key, "ssid") == 0) {
+        parser->value = parser->network->ssid;
+        parser->value_cap = sizeof(parser->network->ssid);
+        parser->fields |= WM_FORM_SSID_BIT;
+    } else if(strcmp(parser->key, "password") == 0) {
+        parser->value = parser->network->password;
+        parser->value_cap = sizeof(parser->network->password);
+        parser->fields |= WM_FORM_PASSWORD_BIT;
+    }
+    // Last occurrence of a repeated key wins
+    if(parser->value) memset(parser->value, 0, parser->value_cap);
+    parser->value_len = 0;
+}
+
+static void end_pair(wm_form_parser_t* parser) {
+    parser->in_value = false;
+    parser->value = NULL;
+    parser->key_len = 0;
+    parser->key_overflow = false;
+}
+
+/*
+ * Append a decoded byte to the current key or value
+ */
+static esp_err_t put_char(wm_form_parser_t* parser, char c) {
+    // Would silently truncate C strings
+    if(c == '\0') return ESP_ERR_INVALID_ARG;
+    if(!parser->in_value) {
+        if(parser->key_len < WM_FORM_KEY_MAX_LEN) parser->key[parser->key_len++] = c;
+        else parser->key_overflow = true;
+        return ESP_OK;
+    }
+    if(parser->value == NULL) return ESP_OK;
+    // Full length values are kept without a NUL, as in wifi_config_t
+    if(parser->value_len >= parser->value_cap) return ESP_ERR_INVALID_SIZE;
+    parser->value[parser->value_len++] = c;
+    return ESP_OK;
+}
+
+static esp_err_t put_utf8(wm_form_parser_t* parser, uint32_t cp) {
+    char buf[4];
+    size_t len;
+    if(cp < 0x80) {
+        buf[0] = cp;
+        len = 1;
+    } else if(cp < 0x800) {
+        buf[0] = 0xC0 | (cp >> 6);
+        buf[1] = 0x80 | (cp & 0x3F);
+        len = 2;
+    } else if(cp < 0x10000) {
+        buf[0] = 0xE0 | (cp >> 12);
+        buf[1] = 0x80 | ((cp >> 6) & 0x3F);
+        buf[2] = 0x80 | (cp & 0x3F);
+        len = 3;
+    } else {
+        buf[0] = 0xF0 | (cp >> 18);
+        buf[1] = 0x80 | ((cp >> 12) & 0x3F);
+        buf[2] = 0x80 | ((cp >> 6) & 0x3F);
+        buf[3] = 0x80 | (cp & 0x3F);
+        len = 4;
+    }
+    for(size_t i = 0; i < len; i++) {
+        esp_err_t err = put_char(parser, buf[i]);
+        if(err != ESP_OK) return err;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t form_feed_char(wm_form_parser_t* parser, char c) {
+    if(parser->esc_len > 0) {
+        int v = hex_value(c);
+        if(v < 0) return ESP_ERR_INVALID_ARG;
+        parser->esc_val = (parser->esc_val << 4) | v;
+        if(++parser->esc_len < 3) return ESP_OK;
+        parser->esc_len = 0;
+        return put_char(parser, parser->esc_val);
+    }
+
+    switch(c) {
+        case '%':
+            parser->esc_len = 1;
+            parser->esc_val = 0;
+            return ESP_OK;
+        case '+':
+            return put_char(parser, ' ');
+        case '&':
+            // Key without '=' has an empty value
+            if(!parser->in_value) begin_value(parser);
+            end_pair(parser);
+            return ESP_OK;
+        case '=':
+            if(!parser->in_value) {
+                begin_value(parser);
+                return ESP_OK;
+            }
+            return put_char(parser, c);
+        default:
+            return put_char(parser, c);
+    }
+}
+
+/*
+ * Character inside a JSON string, key or value
+ */
+static esp_err_t json_string_char(wm_form_parser_t* parser, char c) {
+    if(parser->esc_len == 0) {
+        // A high surrogate must be followed by its low pair
+        if(parser->surrogate && c != '\\') return ESP_ERR_INVALID_ARG;
+        if(c == '\\') {
+            parser->esc_len = 1;
+            return ESP_OK;
+        }
+        if(c == '"') {
+            if(parser->in_value) {
+                end_pair(parser);
+                parser->state = JSON_NEXT;
+            } else {
+                parser->state = JSON_COLON;
+            }
+            return ESP_OK;
+        }
+        if((uint8_t)c < 0x20) return ESP_ERR_INVALID_ARG;
+        return put_char(parser, c);
+    }
+
+    if(parser->esc_len == 1) {
+        if(parser->surrogate && c != 'u') return ESP_ERR_INVALID_ARG;
+        parser->esc_len = 0;
+        switch(c) {
+            case '"':  return put_char(parser, '"');
+            case '\\': return put_char(parser, '\\');
+            case '/':  return put_char(parser, '/');
+            case 'b':  return put_char(parser, '\b');
+            case 'f':  return put_char(parser, '\f');
+            case 'n':  return put_char(parser, '\n');
+            case 'r':  return put_char(parser, '\r');
+            case 't':  return put_char(parser, '\t');
+            case 'u':
+                parser->esc_len = 2;
+                parser->esc_val = 0;
+                return ESP_OK;
+            default:
+                return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    // \uXXXX
+    int v = hex_value(c);
+    if(v < 0) return ESP_ERR_INVALID_ARG;
+    parser->esc_val = (parser->esc_val << 4) | v;
+    if(++parser->esc_len < 6) return ESP_OK;
+    parser->esc_len = 0;
+
+    uint16_t unit = parser->esc_val;
+    if(parser->surrogate) {
+        if(unit < 0xDC00 || unit > 0xDFFF) return ESP_ERR_INVALID_ARG;
+        uint32_t cp = 0x10000 + (((uint32_t)parser->surrogate - 0xD800) << 10) + (unit - 0xDC00);
+        parser->surrogate = 0;
+        return put_utf8(parser, cp);
+    }
+    if(unit >= 0xD800 && unit <= 0xDBFF) {
+        parser->surrogate = unit;
+        return ESP_OK;
+    }
+    if(unit >= 0xDC00 && unit <= 0xDFFF) return ESP_ERR_INVALID_ARG;
+    return put_utf8(parser, unit);
+}
+
+static esp_err_t json_feed_char(wm_form_parser_t* parser, char c) {
+    switch(parser->state) {
+        case JSON_KEY:
+        case JSON_VALUE:
+            return json_string_char(parser, c);
+
+        default:
+            break;
+    }
+
+    if(is_json_space(c)) return ESP_OK;
+
+    switch(parser->state) {
+        case JSON_OBJECT_START:
+            if(c != '{') return ESP_ERR_INVALID_ARG;
+            parser->state = JSON_KEY_START;
+            return ESP_OK;
+
+        case JSON_KEY_START:
+            if(c == '}') {
+                parser->state = JSON_DONE;
+                return ESP_OK;
+            }
+            if(c != '"') return ESP_ERR_INVALID_ARG;
+            parser->state = JSON_KEY;
+            return ESP_OK;
+
+        case JSON_COLON:
+            if(c != ':') return ESP_ERR_INVALID_ARG;
+            begin_value(parser);
+            parser->state = JSON_VALUE_START;
+            return ESP_OK;
+
+        case JSON_VALUE_START:
+            // Only string values are expected
+            if(c != '"') return ESP_ERR_INVALID_ARG;
+            parser->state = JSON_VALUE;
+            return ESP_OK;
+
+        case JSON_NEXT:
+            if(c == ',') parser->state = JSON_KEY_START;
+            else if(c == '}') parser->state = JSON_DONE;
+            else return ESP_ERR_INVALID_ARG;
+            return ESP_OK;
+
+        default:
+            // Nothing but whitespace after the object
+            return ESP_ERR_INVALID_ARG;
+    }
+}
+
+void wm_form_init(wm_form_parser_t* parser, wm_form_type_t type, wm_network_info_t* network) {
+    memset(parser, 0, sizeof(*parser));
+    parser->type = type;
+    parser->network = network;
+    parser->state = JSON_OBJECT_START;
+}
+
+esp_err_t wm_form_feed(wm_form_parser_t* parser, const char* data, size_t len) {
+    esp_err_t err = ESP_OK;
+    for(size_t i = 0; i < len && err == ESP_OK; i++) {
+        err = parser->type == WM_FORM_JSON
+            ? json_feed_char(parser, data[i])
+            : form_feed_char(parser, data[i]);
+    }
+    return err;
+}
+
+esp_err_t wm_form_finish(wm_form_parser_t* parser) {
+    if(parser->type == WM_FORM_JSON) {
+        return parser->state == JSON_DONE ? ESP_OK : ESP_ERR_INVALID_ARG;
+    }
+    if(parser->esc_len > 0) return ESP_ERR_INVALID_ARG;
+    if(parser->in_value || parser->key_len > 0) form_feed_char(parser, '&');
+    return ESP_OK;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <esp_err.h>
+
+#include "sdkconfig.h"
+
+#include "wifi_manager.h"
+
+// Worst case body: every credential byte sent as a JSON "\u00XX" escape
+#define WM_FORM_MAX_BODY_LEN (32*6 + 64*6 + 64)
+// Longest key that is kept ("password")
+#define WM_FORM_KEY_MAX_LEN 8
+
+#define WM_FORM_SSID_BIT     BIT0
+#define WM_FORM_PASSWORD_BIT BIT1
+
+
+typedef struct wm_network_info_t wm_network_info_t;
+
+typedef enum {
+    // application/x-www-form-urlencoded
+    WM_FORM_URLENCODED = 0,
+    // application/json, flat object with string values
+    WM_FORM_JSON
+} wm_form_type_t;
+
+/*
+ * Incremental parser of the credentials form. Decodes straight into a
+ * wm_network_info_t, one byte at a time, so the body can be fed in chunks
+ * of any size as they are received.
+ */
+typedef struct wm_form_parser_t {
+    wm_form_type_t type;
+    wm_network_info_t* network;
+    uint8_t state;
+    // WM_FORM_*_BIT of the fields found so far
+    uint8_t fields;
+
+    char key[WM_FORM_KEY_MAX_LEN + 1];
+    uint8_t key_len;
+    bool key_overflow;
+    bool in_value;
+    // Destination of the value being decoded, NULL if it's ignored
+    char* value;
+    size_t value_len;
+    size_t value_cap;
+
+    // Escape sequence being decoded (%XX or \uXXXX)
+    uint8_t esc_len;
+    uint16_t esc_val;
+    // Pending high surrogate of a JSON \u escape pair
+    uint16_t surrogate;
+} wm_form_parser_t;
+
+
+void wm_form_init(wm_form_parser_t* parser, wm_form_type_t type, wm_network_info_t* network);
+
+/*
+ * Parse the next 'len' bytes of the body.
+ *
+ * @return
+ *          - ESP_OK if the data was consumed
+ *          - ESP_ERR_INVALID_SIZE if a field doesn't fit in wm_network_info_t
+ *          - ESP_ERR_INVALID_ARG if the body is malformed
+ */
+esp_err_t wm_form_feed(wm_form_parser_t* parser, const char* data, size_t len);
+
+/*
+ * Finish parsing once the whole body was fed. Found fields are reported in
+ * parser->fields.
+ *
+ * Returns ESP_ERR_INVALID_ARG if the body ended prematurely.
+ */
+esp_err_t wm_form_finish(wm_form_parser_t* parser);
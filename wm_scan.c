@@ -0,0 +1,193 @@
+#include "wm_scan.h"
+
+static const char* TAG = "WMScan";
+
+static wifi_ap_record_t _records[WM_SCAN_MAX_NETWORKS];
+static uint16_t _records_count = 0;
+// esp_timer time of the last successful scan, 0 if there was none
+static int64_t _updated_at = 0;
+static bool _scanning = false;
+// Directed scan in progress: results go to the caller, not to the cache
+static wifi_ap_record_t* _directed_records = NULL;
+static uint16_t _directed_count;
+
+static SemaphoreHandle_t _scan_mutex = NULL;
+static EventGroupHandle_t _scan_event_group = NULL;
+static esp_timer_handle_t _scan_timer = NULL;
+
+
+static void _wm_scan_timer_cb(void* arg) {
+    esp_err_t err = wm_scan_cache_refresh();
+    if(err != ESP_OK) ESP_LOGD(TAG, "Periodic scan not started (%s)", esp_err_to_name(err));
+}
+
+static void _wm_scan_copy(wifi_ap_record_t* ap_records, uint16_t* ap_num) {
+    xSemaphoreTake(_scan_mutex, portMAX_DELAY);
+    if(*ap_num > _records_count) *ap_num = _records_count;
+    memcpy(ap_records, _records, *ap_num * sizeof(wifi_ap_record_t));
+    xSemaphoreGive(_scan_mutex);
+}
+
+esp_err_t wm_scan_cache_init() {
+    if(_scan_mutex != NULL) return ESP_OK;
+
+    _scan_mutex = xSemaphoreCreateMutex();
+    _scan_event_group = xEventGroupCreate();
+    if(_scan_mutex == NULL || _scan_event_group == NULL) return ESP_ERR_NO_MEM;
+
+    esp_timer_create_args_t timer_args = {
+        .callback = &_wm_scan_timer_cb,
+        .name = "wm_scan"
+    };
+    return esp_timer_create(&timer_args, &_scan_timer);
+}
+
+esp_err_t wm_scan_cache_refresh() {
+    esp_err_t err = ESP_OK;
+
+    xSemaphoreTake(_scan_mutex, portMAX_DELAY);
+    if(!_scanning) {
+        wifi_scan_config_t scan_config = {
+            .ssid = 0,
+            .bssid = 0,
+            .channel = 0,
+            .show_hidden = true
+        };
+        err = esp_wifi_scan_start(&scan_config, false);
+        if(err == ESP_OK) {
+            _scanning = true;
+            xEventGroupClearBits(_scan_event_group, WM_SCAN_DONE_BIT);
+        }
+    }
+    xSemaphoreGive(_scan_mutex);
+    return err;
+}
+
+void wm_scan_cache_done(wifi_event_sta_scan_done_t* event) {
+    if(_scan_mutex == NULL) return;
+
+    bool updated = false;
+    xSemaphoreTake(_scan_mutex, portMAX_DELAY);
+    if(_scanning && _directed_records) {
+        uint16_t count = _directed_count;
+        if(event->status != 0 || esp_wifi_scan_get_ap_records(&count, _directed_records) != ESP_OK) count = 0;
+        _directed_count = count;
+        _directed_records = NULL;
+        _scanning = false;
+        xEventGroupSetBits(_scan_event_group, WM_SCAN_DONE_BIT);
+    } else if(_scanning) {
+        uint16_t count = WM_SCAN_MAX_NETWORKS;
+        if(event->status == 0 && esp_wifi_scan_get_ap_records(&count, _records) == ESP_OK) {
+            _records_count = count;
+            _updated_at = esp_timer_get_time();
+            updated = true;
+        }
+        _scanning = false;
+        xEventGroupSetBits(_scan_event_group, WM_SCAN_DONE_BIT);
+    }
+    xSemaphoreGive(_scan_mutex);
+
+    // Single producer: portal clients get the new results pushed
+    if(updated) wm_webserver_notify_scan();
+}
+
+esp_err_t wm_scan_cache_get(wifi_ap_record_t* ap_records, uint16_t* ap_num, TickType_t wait) {
+    if(_updated_at == 0 || esp_timer_get_time() - _updated_at > WM_SCAN_CACHE_TTL_MS * 1000LL) {
+        esp_err_t err = wm_scan_cache_refresh();
+        if(err != ESP_OK && _updated_at == 0) return err;
+    }
+    if(_updated_at == 0 && wait > 0) {
+        xEventGroupWaitBits(_scan_event_group, WM_SCAN_DONE_BIT, pdFALSE, pdTRUE, wait);
+    }
+
+    _wm_scan_copy(ap_records, ap_num);
+    return ESP_OK;
+}
+
+esp_err_t wm_scan_cache_wait(wifi_ap_record_t* ap_records, uint16_t* ap_num, TickType_t wait) {
+    esp_err_t err;
+    int64_t updated_at = _updated_at;
+    TickType_t started = xTaskGetTickCount();
+
+    /* Nothing is started while a directed scan runs, and its end doesn't
+     * update the cache: start ours once it is done. Same if ours failed. */
+    while(_updated_at == updated_at) {
+        err = wm_scan_cache_refresh();
+        if(err != ESP_OK) return err;
+
+        TickType_t elapsed = xTaskGetTickCount() - started;
+        if(elapsed >= wait) return ESP_ERR_TIMEOUT;
+        xEventGroupWaitBits(_scan_event_group, WM_SCAN_DONE_BIT, pdFALSE, pdTRUE, wait - elapsed);
+    }
+
+    _wm_scan_copy(ap_records, ap_num);
+    return ESP_OK;
+}
+
+esp_err_t wm_scan_cache_start_periodic() {
+    esp_err_t err;
+    esp_timer_stop(_scan_timer); // Not running is fine
+    err = esp_timer_start_periodic(_scan_timer, WM_SCAN_CACHE_PERIOD_MS * 1000ULL);
+    if(err != ESP_OK) return err;
+
+    _wm_scan_timer_cb(NULL);
+    return ESP_OK;
+}
+
+esp_err_t wm_scan_cache_stop_periodic() {
+    esp_err_t err = esp_timer_stop(_scan_timer);
+    if(err == ESP_ERR_INVALID_STATE) err = ESP_OK; // Not running
+    return err;
+}
+
+esp_err_t wm_scan_directed(const char* ssid, uint8_t channel, wifi_ap_record_t* ap_records, uint16_t* ap_num, TickType_t wait) {
+    esp_err_t err;
+
+    xSemaphoreTake(_scan_mutex, portMAX_DELAY);
+    if(_scanning) {
+        // Let the background scan finish first
+        xSemaphoreGive(_scan_mutex);
+        xEventGroupWaitBits(_scan_event_group, WM_SCAN_DONE_BIT, pdFALSE, pdTRUE, wait);
+        xSemaphoreTake(_scan_mutex, portMAX_DELAY);
+        if(_scanning) {
+            xSemaphoreGive(_scan_mutex);
+            return ESP_ERR_TIMEOUT;
+        }
+    }
+
+    wifi_scan_config_t scan_config = {
+        .ssid = (uint8_t*)ssid,
+        .bssid = 0,
+        .channel = channel,
+        .show_hidden = true,
+        .scan_type = WIFI_SCAN_TYPE_ACTIVE,
+        .scan_time.active = {
+            .min = WM_SCAN_DIRECTED_DWELL_MIN_MS,
+            .max = WM_SCAN_DIRECTED_DWELL_MAX_MS
+        }
+    };
+    err = esp_wifi_scan_start(&scan_config, false);
+    if(err == ESP_OK) {
+        _scanning = true;
+        _directed_records = ap_records;
+        _directed_count = *ap_num;
+        xEventGroupClearBits(_scan_event_group, WM_SCAN_DONE_BIT);
+    }
+    xSemaphoreGive(_scan_mutex);
+    if(err != ESP_OK) return err;
+
+    xEventGroupWaitBits(_scan_event_group, WM_SCAN_DONE_BIT, pdFALSE, pdTRUE, wait);
+
+    xSemaphoreTake(_scan_mutex, portMAX_DELAY);
+    if(_directed_records) {
+        // Timed out, results must not land in the caller's buffer anymore
+        _directed_records = NULL;
+        _scanning = false;
+        esp_wifi_scan_stop();
+        err = ESP_ERR_TIMEOUT;
+    } else {
+        *ap_num = _directed_count;
+    }
+    xSemaphoreGive(_scan_mutex);
+    return err;
+}
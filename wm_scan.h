@@ -0,0 +1,88 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include <esp_wifi.h>
+#include <esp_timer.h>
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+
+#include "wifi_manager.h"
+
+#define WM_SCAN_CACHE_TTL_MS CONFIG_WM_SCAN_CACHE_TTL_MS
+#define WM_SCAN_CACHE_PERIOD_MS CONFIG_WM_SCAN_CACHE_PERIOD_MS
+// Max time to wait for a scan to finish
+#define WM_SCAN_TIMEOUT_MS 10000
+#define WM_SCAN_LEARNED_CHANNELS CONFIG_WM_SCAN_LEARNED_CHANNELS
+// 2.4 GHz channels 1 to 14
+#define WM_SCAN_CHANNELS 14
+
+#ifdef CONFIG_WM_SCAN_DIRECTED
+#define WM_SCAN_DIRECTED_DWELL_MIN_MS CONFIG_WM_SCAN_DIRECTED_DWELL_MIN_MS
+#define WM_SCAN_DIRECTED_DWELL_MAX_MS CONFIG_WM_SCAN_DIRECTED_DWELL_MAX_MS
+#define WM_SCAN_DIRECTED_MAX_NETWORKS CONFIG_WM_SCAN_DIRECTED_MAX_NETWORKS
+#if WM_SCAN_DIRECTED_DWELL_MIN_MS > WM_SCAN_DIRECTED_DWELL_MAX_MS
+#error "CONFIG_WM_SCAN_DIRECTED_DWELL_MIN_MS must not be above CONFIG_WM_SCAN_DIRECTED_DWELL_MAX_MS"
+#endif
+#else
+#define WM_SCAN_DIRECTED_DWELL_MIN_MS 0
+#define WM_SCAN_DIRECTED_DWELL_MAX_MS 120
+#endif
+
+#define WM_SCAN_DONE_BIT BIT0
+
+
+/*
+ * Initialize the scan result cache. WiFi must be already initialized.
+ */
+esp_err_t wm_scan_cache_init();
+
+/*
+ * Start an asynchronous scan, unless one is already running. Results will be
+ * stored in the cache when WIFI_EVENT_SCAN_DONE is received.
+ */
+esp_err_t wm_scan_cache_refresh();
+
+/*
+ * Copy the cached scan results. No scan is performed in the caller's context.
+ * 
+ * If the results are older than WM_SCAN_CACHE_TTL_MS, a background refresh
+ * is started and the current results are returned anyway. If there are no
+ * results at all yet, waits up to 'wait' ticks for the first scan to finish.
+ * 
+ * @param ap_records    Array where records will be copied
+ * @param ap_num        In: ap_records size. Out: number of records copied
+ */
+esp_err_t wm_scan_cache_get(wifi_ap_record_t* ap_records, uint16_t* ap_num, TickType_t wait);
+
+/*
+ * Wait for the scan in progress (or a new one) to finish and copy its results.
+ * A directed scan in progress is waited for, then a new scan is started.
+ * ESP_ERR_TIMEOUT only once 'wait' ticks have gone by.
+ */
+esp_err_t wm_scan_cache_wait(wifi_ap_record_t* ap_records, uint16_t* ap_num, TickType_t wait);
+
+/*
+ * Refresh the cache every WM_SCAN_CACHE_PERIOD_MS, starting right now.
+ */
+esp_err_t wm_scan_cache_start_periodic();
+esp_err_t wm_scan_cache_stop_periodic();
+
+/*
+ * Active scan probing for a single SSID, hidden networks included, or for
+ * every network if 'ssid' is NULL. Results bypass the cache. Blocks until
+ * the scan is done: don't call it from the event loop task.
+ * 
+ * @param channel       Channel to scan, 0 for all of them
+ * @param ap_records    Array where records will be copied
+ * @param ap_num        In: ap_records size. Out: number of records copied
+ */
+esp_err_t wm_scan_directed(const char* ssid, uint8_t channel, wifi_ap_record_t* ap_records, uint16_t* ap_num, TickType_t wait);
+
+/*
+ * [INTERNAL FUNCTION]
+ * WIFI_EVENT_SCAN_DONE handler.
+ */
+void wm_scan_cache_done(wifi_event_sta_scan_done_t* event);
@@ -36,6 +36,8 @@ esp_err_t wm_storage_read(wm_network_info_t* networks, size_t* count) {
     for(uint8_t i = 0; i < max_networks; i++) {
         sprintf(network_key, WM_STORAGE_NETWORK_KEY, i);
         size = sizeof(wm_network_info_t);
+        // Older blobs are shorter, fields they don't have stay zeroed
+        memset(&(networks[i]), 0, sizeof(wm_network_info_t));
 
         err = nvs_get_blob(wm_storage, network_key, &(networks[i]), &size);
         if(err == ESP_OK) {
@@ -51,6 +53,40 @@ esp_err_t wm_storage_read(wm_network_info_t* networks, size_t* count) {
     return ESP_OK;
 }
 
+esp_err_t wm_storage_count(size_t* count) {
+    esp_err_t err;
+    *count = 0;
+
+    nvs_handle_t wm_storage;
+    err = nvs_open(WM_STORAGE_NAMESPACE, NVS_READONLY, &wm_storage);
+    if(err == ESP_ERR_NVS_NOT_FOUND) return ESP_OK; // Namespace not found, no stored networks
+    if (err != ESP_OK) return err; // Another NVS error
+
+    // Networks of another version don't count, wm_storage_read() erases them
+    uint32_t version;
+    err = nvs_get_u32(wm_storage, WM_STORAGE_VERSION_KEY, &version);
+    if(err != ESP_OK || version != _wm_config->version) {
+        nvs_close(wm_storage);
+        return err == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : err;
+    }
+
+    char network_key[11];
+    size_t size;
+    for(uint8_t i = 0; i < WM_STORAGE_MAX_NETWORKS; i++) {
+        sprintf(network_key, WM_STORAGE_NETWORK_KEY, i);
+        // Length only, the blob isn't copied
+        err = nvs_get_blob(wm_storage, network_key, NULL, &size);
+        if(err == ESP_ERR_NVS_NOT_FOUND) {
+            err = ESP_OK;
+            break;
+        }
+        if(err != ESP_OK) break;
+        (*count)++;
+    }
+    nvs_close(wm_storage);
+    return err;
+}
+
 esp_err_t wm_storage_save(wm_network_info_t* network) {
     esp_err_t err;
     int8_t index;
@@ -58,7 +94,7 @@ esp_err_t wm_storage_save(wm_network_info_t* network) {
     if(err != ESP_OK) return err;
 
     err = wm_storage_save_at(network, index);
-    ESP_LOGI(TAG, "Network '%s' (%s) saved at index %d", network->ssid, network->password, index);
+    ESP_LOGI(TAG, "Network '%.32s' (%.64s) saved at index %d", network->ssid, network->password, index);
     return err;
 }
 
@@ -96,11 +132,12 @@ esp_err_t wm_storage_find_writeable(char* ssid, int8_t* index) {
     int less_used = 0, less_used_times = -1;
     char network_key[11];
     wm_network_info_t network_info;
-    size_t size = sizeof(wm_network_info_t);
+    size_t size;
     
     for(uint8_t i = 0; i < WM_STORAGE_MAX_NETWORKS; i++) {
         // Get network info
         sprintf(network_key, WM_STORAGE_NETWORK_KEY, i);
+        size = sizeof(wm_network_info_t);
         err = nvs_get_blob(wm_storage, network_key, &network_info, &size);
         
         // Check if end of the list was reached
@@ -109,7 +146,7 @@ esp_err_t wm_storage_find_writeable(char* ssid, int8_t* index) {
             break;
         }
         // Check if we already have that SSID
-        if(strcmp(ssid, network_info.ssid) == 0) {
+        if(strncmp(ssid, network_info.ssid, sizeof(network_info.ssid)) == 0) {
             *index = i;
             break;
         }
@@ -177,15 +214,16 @@ esp_err_t wm_storage_delete(char* ssid) {
     // Find network
     char network_key[11];
     wm_network_info_t network_info;
-    size_t size = sizeof(wm_network_info_t);
+    size_t size;
     for(uint8_t i = 0; i < WM_STORAGE_MAX_NETWORKS; i++) {
         // Get network info
         sprintf(network_key, WM_STORAGE_NETWORK_KEY, i);
+        size = sizeof(wm_network_info_t);
         err = nvs_get_blob(wm_storage, network_key, &network_info, &size);
         if(err != ESP_OK) continue; // No network found with this key
 
         // Check if SSID matches
-        if(strcmp(ssid, network_info.ssid) == 0) {
+        if(strncmp(ssid, network_info.ssid, sizeof(network_info.ssid)) == 0) {
             err = nvs_erase_key(wm_storage, network_key);
             if(err != ESP_OK) goto close;
 
@@ -201,6 +239,94 @@ close:
     return err;
 }
 
+esp_err_t wm_storage_get_last(char* ssid, size_t len) {
+    ssid[0] = '\0';
+    esp_err_t err;
+    nvs_handle_t wm_storage;
+    err = nvs_open(WM_STORAGE_NAMESPACE, NVS_READONLY, &wm_storage);
+    if(err == ESP_ERR_NVS_NOT_FOUND) return ESP_OK;
+    if(err != ESP_OK) return err;
+
+    err = nvs_get_str(wm_storage, WM_STORAGE_LAST_KEY, ssid, &len);
+    if(err != ESP_OK) ssid[0] = '\0';
+    if(err == ESP_ERR_NVS_NOT_FOUND) err = ESP_OK;
+    nvs_close(wm_storage);
+    return err;
+}
+
+esp_err_t wm_storage_set_last(const char* ssid) {
+    esp_err_t err;
+    nvs_handle_t wm_storage;
+    err = nvs_open(WM_STORAGE_NAMESPACE, NVS_READWRITE, &wm_storage);
+    if(err != ESP_OK) return err;
+
+    err = nvs_set_str(wm_storage, WM_STORAGE_LAST_KEY, ssid);
+    if(err == ESP_OK) err = nvs_commit(wm_storage);
+    nvs_close(wm_storage);
+    return err;
+}
+
+esp_err_t wm_storage_get_channels(uint8_t* histogram) {
+    memset(histogram, 0, WM_SCAN_CHANNELS);
+    esp_err_t err;
+    nvs_handle_t wm_storage;
+    err = nvs_open(WM_STORAGE_NAMESPACE, NVS_READONLY, &wm_storage);
+    if(err == ESP_ERR_NVS_NOT_FOUND) return ESP_OK;
+    if(err != ESP_OK) return err;
+
+    size_t size = WM_SCAN_CHANNELS;
+    err = nvs_get_blob(wm_storage, WM_STORAGE_CHANNELS_KEY, histogram, &size);
+    if(err != ESP_OK) memset(histogram, 0, WM_SCAN_CHANNELS);
+    if(err == ESP_ERR_NVS_NOT_FOUND) err = ESP_OK;
+    nvs_close(wm_storage);
+    return err;
+}
+
+esp_err_t wm_storage_set_channels(const uint8_t* histogram) {
+    esp_err_t err;
+    nvs_handle_t wm_storage;
+    err = nvs_open(WM_STORAGE_NAMESPACE, NVS_READWRITE, &wm_storage);
+    if(err != ESP_OK) return err;
+
+    err = nvs_set_blob(wm_storage, WM_STORAGE_CHANNELS_KEY, histogram, WM_SCAN_CHANNELS);
+    if(err == ESP_OK) err = nvs_commit(wm_storage);
+    nvs_close(wm_storage);
+    return err;
+}
+
+esp_err_t wm_storage_counter_get(const char* key, uint32_t* value) {
+    *value = 0;
+    esp_err_t err;
+    nvs_handle_t wm_storage;
+    err = nvs_open(WM_STORAGE_NAMESPACE, NVS_READONLY, &wm_storage);
+    if(err == ESP_ERR_NVS_NOT_FOUND) return ESP_OK;
+    if(err != ESP_OK) return err;
+
+    err = nvs_get_u32(wm_storage, key, value);
+    if(err == ESP_ERR_NVS_NOT_FOUND) err = ESP_OK;
+    nvs_close(wm_storage);
+    return err;
+}
+
+esp_err_t wm_storage_counter_add(const char* key, uint32_t value) {
+    esp_err_t err;
+    nvs_handle_t wm_storage;
+    err = nvs_open(WM_STORAGE_NAMESPACE, NVS_READWRITE, &wm_storage);
+    if(err != ESP_OK) return err;
+
+    uint32_t stored = 0;
+    err = nvs_get_u32(wm_storage, key, &stored);
+    if(err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) goto close;
+
+    err = nvs_set_u32(wm_storage, key, stored + value);
+    if(err != ESP_OK) goto close;
+    err = nvs_commit(wm_storage);
+
+close:
+    nvs_close(wm_storage);
+    return err;
+}
+
 esp_err_t wm_storage_clear() {
     ESP_LOGW(TAG, "Erasing NVS storage for '"WM_STORAGE_NAMESPACE"' namespace!");
     esp_err_t err;
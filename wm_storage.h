@@ -11,6 +11,10 @@
 #define WM_STORAGE_NAMESPACE "wifimanager"
 #define WM_STORAGE_NETWORK_KEY "network%d"
 #define WM_STORAGE_VERSION_KEY "version"
+#define WM_STORAGE_FAST_TRIES_KEY "fast_tries"
+#define WM_STORAGE_FAST_OK_KEY "fast_ok"
+#define WM_STORAGE_LAST_KEY "last"
+#define WM_STORAGE_CHANNELS_KEY "channels"
 #define WM_STORAGE_MAX_NETWORKS CONFIG_WM_STORAGE_MAX_NETWORKS
 
 
@@ -26,6 +30,12 @@ typedef struct wm_network_info_t wm_network_info_t;
  */
 esp_err_t wm_storage_read(wm_network_info_t* networks, size_t* count);
 
+/*
+ * Number of networks wm_storage_read() would return, without reading them.
+ * Networks saved with another version aren't counted.
+ */
+esp_err_t wm_storage_count(size_t* count);
+
 
 /*
  * Save a network in the NVS storage. Index will be selected according to
@@ -72,6 +82,29 @@ esp_err_t wm_storage_save_at(wm_network_info_t* network, uint8_t index);
  */
 esp_err_t wm_storage_delete(char* ssid);
 
+/*
+ * Get the SSID of the network that last got an IP, empty if unknown.
+ */
+esp_err_t wm_storage_get_last(char* ssid, size_t len);
+esp_err_t wm_storage_set_last(const char* ssid);
+
+/*
+ * Get/set the histogram of channels where stored networks got an IP,
+ * WM_SCAN_CHANNELS entries. All zeros if none was stored.
+ */
+esp_err_t wm_storage_get_channels(uint8_t* histogram);
+esp_err_t wm_storage_set_channels(const uint8_t* histogram);
+
+/*
+ * Get a counter stored in the WiFiManager namespace. Missing counters are 0.
+ */
+esp_err_t wm_storage_counter_get(const char* key, uint32_t* value);
+
+/*
+ * Add to a counter stored in the WiFiManager namespace.
+ */
+esp_err_t wm_storage_counter_add(const char* key, uint32_t value);
+
 /*
  * Erase NVS storage for the WiFiManager namespace. All saved networks will
  * be deleted.
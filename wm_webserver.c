@@ -1,83 +1,616 @@
 #include "wm_webserver.h"
+#include "wm_www_assets.h"
+#include "lwip/sockets.h"
 
 static const char* TAG = "NetworkChoiceWebServer";
 
-static const char* index_html_head = "<!DOCTYPE html><html><head><meta name=\"viewport\" content=\"initial-scale=1\"><title>Select WiFi</title><style>*{border:none;border-radius:3px;font-family:sans-serif}form{display:flex;flex-direction:column;align-items:center}label,input{width:250px}input{border:1px solid;padding:7px}button{font:bold 16px sans-serif;padding:10px 40px}</style></head><body><form action=\"ssid\" method=\"post\"><label>SSID</label><input id=\"ssid\" type=\"text\" autocorrect=\"off\" autocapitalize=\"none\" name=\"ssid\"/><style>select{width:264px;height:30px;border:1px solid}option{padding:3px 10px}</style><select id=\"ssidlist\"><option hidden>Select network</option>";
-static const char* index_html_record = "<option>%s</option>";
-static const char* index_html_tail = "</select><script>var l=document.getElementById(\"ssidlist\");l.onchange=function(){document.getElementsByName(\"ssid\")[0].value=l.value;}</script><br><label>Password</label><input type=\"password\" autocorrect=\"off\" autocapitalize=\"none\" name=\"password\"/><br><button type=\"submit\">Connect</button></form></body></html>";
+static httpd_handle_t _server = NULL;
 
+// Gzipped assets embedded at build time, see CMakeLists.txt
+extern const uint8_t index_html_gz_start[] asm("_binary_index_html_gz_start");
+extern const uint8_t index_html_gz_end[]   asm("_binary_index_html_gz_end");
 
-static esp_err_t index_get_handler(httpd_req_t *req)
+typedef struct wm_www_asset_t {
+    const uint8_t* start;
+    const uint8_t* end;
+    const char* type;
+    const char* etag;
+} wm_www_asset_t;
+
+static const wm_www_asset_t index_asset = {
+    .start = index_html_gz_start,
+    .end   = index_html_gz_end,
+    .type  = "text/html",
+    .etag  = WM_WWW_INDEX_HTML_ETAG
+};
+
+static const char* networks_record_open = "<option>";
+static const char* networks_record_close = "</option>";
+
+// Worst case record: every SSID byte escaped as "&quot;"
+#define NETWORKS_RECORD_MAX_LEN (8 + 32*6 + 9)
+#define NETWORKS_CHUNK_LEN 256
+// Worst case record: every SSID byte escaped as "\u00XX", plus the other fields
+#define API_SCAN_RECORD_MAX_LEN (32*6 + 80)
+#define API_SCAN_CHUNK_LEN 384
+// Worst case provisioning status, escaped SSID included
+#define STATUS_JSON_MAX_LEN (32*6 + 80)
+#define SSE_EVENT_MAX_LEN (STATUS_JSON_MAX_LEN + 8)
+// Worst case WebSocket scan message, escaped SSID included
+#define WS_SCAN_MSG_MAX_LEN (32*6 + 96)
+#define WS_RX_MAX_LEN 64
+
+/*
+ * HTML-escape up to 'src_len' bytes of 'src' (stops at '\0') into 'dst'.
+ * 'dst' must have room for 6 bytes per source byte. Returns the escaped length.
+ */
+static size_t html_escape(char* dst, const char* src, size_t src_len) {
+    char* start = dst;
+    for(size_t i = 0; i < src_len && src[i] != '\0'; i++) {
+        const char* entity;
+        switch(src[i]) {
+            case '&':  entity = "&amp;";  break;
+            case '<':  entity = "&lt;";   break;
+            case '>':  entity = "&gt;";   break;
+            case '"':  entity = "&quot;"; break;
+            case '\'': entity = "&#39;";  break;
+            default:
+                *dst++ = src[i];
+                continue;
+        }
+        size_t len = strlen(entity);
+        memcpy(dst, entity, len);
+        dst += len;
+    }
+    return dst - start;
+}
+
+/*
+ * Serve an embedded asset (given in user_ctx). Clients revalidate it on every
+ * load, and get a bodiless 304 while their ETag matches.
+ */
+static esp_err_t asset_get_handler(httpd_req_t *req)
 {
-    // Get available Access Points
-    uint16_t ap_count = 20;
-    wifi_ap_record_t ap_records[ap_count];
-    ESP_ERROR_CHECK(wm_scan_networks(ap_records, &ap_count));
-
-    char* index_html;
-    index_html = (char *)malloc(3072 * sizeof(char));
-    int cursor = 0;
-    cursor += sprintf(index_html, index_html_head);
-    for(int ap = 0; ap < ap_count; ap++)
-        cursor += sprintf(index_html+cursor*sizeof(char), index_html_record, ap_records[ap].ssid);
-    
-    cursor += sprintf(index_html+cursor*sizeof(char), index_html_tail);
-    if(cursor >= 3072) index_html[3071] = '\0';
+    const wm_www_asset_t* asset = (const wm_www_asset_t*)req->user_ctx;
 
-    httpd_resp_send(req, index_html, cursor*sizeof(char));
-    free(index_html);
+    httpd_resp_set_hdr(req, "ETag", asset->etag);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
 
-    return ESP_OK;
+    char if_none_match[64];
+    if(httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) == ESP_OK
+            && (strstr(if_none_match, asset->etag) != NULL || strcmp(if_none_match, "*") == 0)) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    httpd_resp_set_type(req, asset->type);
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    return httpd_resp_send(req, (const char*)asset->start, asset->end - asset->start);
 }
 
 static const httpd_uri_t index_uri = {
     .uri       = "/",
     .method    = HTTP_GET,
-    .handler   = index_get_handler,
+    .handler   = asset_get_handler,
+    .user_ctx  = (void*)&index_asset
+};
+
+/*
+ * Nearby networks as <option> elements, loaded by the index page.
+ */
+static esp_err_t networks_get_handler(httpd_req_t *req)
+{
+    // Get available Access Points, refreshed in the background
+    uint16_t ap_count = WM_SCAN_MAX_NETWORKS;
+    wifi_ap_record_t ap_records[ap_count];
+    if(wm_scan_cache_get(ap_records, &ap_count, WM_SCAN_TIMEOUT_MS / portTICK_PERIOD_MS) != ESP_OK) {
+        ap_count = 0;
+    }
+
+    httpd_resp_set_type(req, "text/html");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+
+    // Records are batched in a small buffer, flushed whenever the next one may not fit
+    esp_err_t err;
+    char chunk[NETWORKS_CHUNK_LEN];
+    size_t cursor = 0;
+    for(int ap = 0; ap < ap_count; ap++) {
+        if(ap_records[ap].ssid[0] == '\0') continue; // Hidden network
+        if(cursor + NETWORKS_RECORD_MAX_LEN > sizeof(chunk)) {
+            err = httpd_resp_send_chunk(req, chunk, cursor);
+            if(err != ESP_OK) return err;
+            cursor = 0;
+        }
+        memcpy(chunk + cursor, networks_record_open, strlen(networks_record_open));
+        cursor += strlen(networks_record_open);
+        cursor += html_escape(chunk + cursor, (char*)ap_records[ap].ssid, sizeof(ap_records[ap].ssid));
+        memcpy(chunk + cursor, networks_record_close, strlen(networks_record_close));
+        cursor += strlen(networks_record_close);
+    }
+    if(cursor > 0) {
+        err = httpd_resp_send_chunk(req, chunk, cursor);
+        if(err != ESP_OK) return err;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static const httpd_uri_t networks_uri = {
+    .uri       = "/networks",
+    .method    = HTTP_GET,
+    .handler   = networks_get_handler,
     .user_ctx  = NULL
 };
 
-esp_err_t ssid_post_handler(httpd_req_t *req) {
-    char content[115];
-    memset(content, 0, 115*sizeof(char));
+/*
+ * JSON-escape up to 'src_len' bytes of 'src' (stops at '\0') into 'dst'.
+ * 'dst' must have room for 6 bytes per source byte. Returns the escaped length.
+ */
+static size_t json_escape(char* dst, const char* src, size_t src_len) {
+    char* start = dst;
+    for(size_t i = 0; i < src_len && src[i] != '\0'; i++) {
+        uint8_t c = (uint8_t)src[i];
+        if(c == '"' || c == '\\') {
+            *dst++ = '\\';
+            *dst++ = c;
+        } else if(c < 0x20) {
+            dst += sprintf(dst, "\\u%04x", c);
+        } else {
+            *dst++ = c;
+        }
+    }
+    return dst - start;
+}
+
+/*
+ * Fill 'best' with the indexes of the strongest record of each visible SSID,
+ * strongest first. Returns the number of indexes.
+ */
+static uint8_t scan_best_per_ssid(const wifi_ap_record_t* ap_records, uint16_t ap_count, uint8_t* best) {
+    uint8_t best_count = 0;
+    for(int ap = 0; ap < ap_count; ap++) {
+        if(ap_records[ap].ssid[0] == '\0') continue; // Hidden network
+        int i;
+        for(i = 0; i < best_count; i++) {
+            if(strcmp((char*)ap_records[best[i]].ssid, (char*)ap_records[ap].ssid) == 0) break;
+        }
+        if(i < best_count) {
+            if(ap_records[ap].rssi <= ap_records[best[i]].rssi) continue;
+            // Stronger BSSID of a known SSID: drop the old one, keep the list sorted below
+            memmove(&best[i], &best[i+1], best_count - i - 1);
+            best_count--;
+        }
+        // Insertion sort, strongest first
+        for(i = best_count; i > 0 && ap_records[best[i-1]].rssi < ap_records[ap].rssi; i--) {
+            best[i] = best[i-1];
+        }
+        best[i] = ap;
+        best_count++;
+    }
+    return best_count;
+}
+
+/*
+ * Nearby networks as a JSON array, one entry per SSID (its strongest BSSID),
+ * strongest first:
+ *   [{"ssid":"...","rssi":-40,"channel":6,"auth":3,"known":true},...]
+ * 'auth' is a wifi_auth_mode_t value. 'known' tells whether its credentials
+ * are stored.
+ */
+static esp_err_t api_scan_get_handler(httpd_req_t *req)
+{
+    uint16_t ap_count = WM_SCAN_MAX_NETWORKS;
+    wifi_ap_record_t ap_records[ap_count];
+    if(wm_scan_cache_get(ap_records, &ap_count, WM_SCAN_TIMEOUT_MS / portTICK_PERIOD_MS) != ESP_OK) {
+        ap_count = 0;
+    }
+
+    size_t stored_count = WM_STORAGE_MAX_NETWORKS;
+    wm_network_info_t stored_networks[stored_count];
+    if(wm_storage_read(stored_networks, &stored_count) != ESP_OK) stored_count = 0;
+
+    // Indexes of the strongest record of each SSID, sorted by RSSI
+    uint8_t best[WM_SCAN_MAX_NETWORKS];
+    uint8_t best_count = scan_best_per_ssid(ap_records, ap_count, best);
 
-    /* Truncate if content length larger than the buffer */
-    size_t recv_size = MIN(req->content_len, sizeof(content));
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
 
-    int ret = httpd_req_recv(req, content, recv_size);
-    if (ret < 0) {  // Check if connection was closed
-        if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
-            httpd_resp_send_408(req);
+    esp_err_t err;
+    char chunk[API_SCAN_CHUNK_LEN];
+    size_t cursor = 0;
+    chunk[cursor++] = '[';
+    for(int i = 0; i < best_count; i++) {
+        wifi_ap_record_t* record = &ap_records[best[i]];
+        if(cursor + API_SCAN_RECORD_MAX_LEN > sizeof(chunk)) {
+            err = httpd_resp_send_chunk(req, chunk, cursor);
+            if(err != ESP_OK) return err;
+            cursor = 0;
         }
-        return ESP_FAIL; // To ensure the socket is closed
+
+        bool known = false;
+        for(int stored = 0; stored < stored_count && !known; stored++) {
+            known = strncmp(stored_networks[stored].ssid, (char*)record->ssid, sizeof(stored_networks[stored].ssid)) == 0;
+        }
+
+        cursor += sprintf(chunk + cursor, "%s{\"ssid\":\"", i == 0 ? "" : ",");
+        cursor += json_escape(chunk + cursor, (char*)record->ssid, sizeof(record->ssid));
+        cursor += sprintf(chunk + cursor, "\",\"rssi\":%d,\"channel\":%d,\"auth\":%d,\"known\":%s}",
+            record->rssi, record->primary, record->authmode, known ? "true" : "false");
     }
-    
+    chunk[cursor++] = ']';
+
+    err = httpd_resp_send_chunk(req, chunk, cursor);
+    if(err != ESP_OK) return err;
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static const httpd_uri_t api_scan_uri = {
+    .uri       = "/api/scan",
+    .method    = HTTP_GET,
+    .handler   = api_scan_get_handler,
+    .user_ctx  = NULL
+};
+
+/*
+ * Server-Sent Events subscribers. Only touched from the httpd task: the
+ * handler, the session free callback and the queued broadcast work.
+ */
+static int _sse_fds[WM_SSE_MAX_SUBSCRIBERS] = { [0 ... WM_SSE_MAX_SUBSCRIBERS-1] = -1 };
+
+static const char* provision_state_names[] = {
+    [WM_PROVISION_IDLE]        = "idle",
+    [WM_PROVISION_ASSOCIATING] = "associating",
+    [WM_PROVISION_DHCP]        = "dhcp",
+    [WM_PROVISION_CONNECTED]   = "connected",
+    [WM_PROVISION_FAILED]      = "failed"
+};
+
+/*
+ * Format the current provisioning status as JSON into 'buf':
+ *   {"state":"dhcp","ssid":"...","reason":0,"ip":"0.0.0.0"}
+ * Returns its length.
+ */
+static size_t provision_status_json(char* buf, size_t len) {
+    wm_provision_status_t status;
+    wm_provision_get_status(&status);
+
+    char ssid[32*6 + 1];
+    ssid[json_escape(ssid, status.ssid, 32)] = '\0';
+
+    return snprintf(buf, len, "{\"state\":\"%s\",\"ssid\":\"%s\",\"reason\":%d,\"ip\":\"" IPSTR "\"}",
+        provision_state_names[status.state], ssid, status.reason, IP2STR(&status.ip));
+}
+
+/*
+ * Format the current provisioning status as an SSE event into 'buf'
+ * (SSE_EVENT_MAX_LEN bytes). Returns the event length.
+ */
+static size_t sse_status_event(char* buf) {
+    size_t len = sprintf(buf, "data: ");
+    len += provision_status_json(buf + len, STATUS_JSON_MAX_LEN);
+    len += sprintf(buf + len, "\n\n");
+    return len;
+}
+
+static void sse_unsubscribe(void* ctx) {
+    *(int*)ctx = -1;
+}
+
+static esp_err_t api_events_get_handler(httpd_req_t *req)
+{
+    int* slot = NULL;
+    for(int i = 0; i < WM_SSE_MAX_SUBSCRIBERS; i++) {
+        if(_sse_fds[i] < 0) {
+            slot = &_sse_fds[i];
+            break;
+        }
+    }
+    if(!slot) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_send(req, "Too many subscribers", HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+    }
+
+    char event[SSE_EVENT_MAX_LEN];
+    size_t len = sse_status_event(event);
+
+    httpd_resp_set_type(req, "text/event-stream");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    if(httpd_resp_send_chunk(req, event, len) != ESP_OK) return ESP_FAIL;
+
+    /* The terminating chunk is never sent: the socket is kept and further
+     * events are written to it directly, without blocking the server task */
+    *slot = httpd_req_to_sockfd(req);
+    req->sess_ctx = slot;
+    req->free_ctx = sse_unsubscribe;
+    return ESP_OK;
+}
+
+static const httpd_uri_t api_events_uri = {
+    .uri       = "/api/events",
+    .method    = HTTP_GET,
+    .handler   = api_events_get_handler,
+    .user_ctx  = NULL
+};
+
+static void sse_broadcast(void* arg) {
+    char event[SSE_EVENT_MAX_LEN];
+    size_t len = sse_status_event(event);
+
+    // Chunked framing, as the response was started with httpd_resp_send_chunk
+    char head[8];
+    int head_len = snprintf(head, sizeof(head), "%x\r\n", (unsigned)len);
+
+    for(int i = 0; i < WM_SSE_MAX_SUBSCRIBERS; i++) {
+        int fd = _sse_fds[i];
+        if(fd < 0) continue;
+
+        if(httpd_socket_send(_server, fd, head, head_len, 0) < 0
+                || httpd_socket_send(_server, fd, event, len, 0) < 0
+                || httpd_socket_send(_server, fd, "\r\n", 2, 0) < 0) {
+            ESP_LOGD(TAG, "Dropping events subscriber %d", fd);
+            httpd_sess_trigger_close(_server, fd);
+        }
+    }
+}
+
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+/*
+ * WebSocket push on /ws. Browsers get the nearby networks as diffs against
+ * what they were last sent, plus provisioning state changes:
+ *   {"type":"scan","op":"add","ssid":"...","rssi":-40,"channel":6,"auth":3}
+ *   {"type":"scan","op":"rssi","ssid":"...","rssi":-52}
+ *   {"type":"scan","op":"remove","ssid":"..."}
+ *   {"type":"state","status":{...}}
+ * Diffs are computed once per scan from the scan cache, whatever the number
+ * of clients. Only touched from the httpd task.
+ */
+typedef struct wm_ws_network_t {
+    char ssid[33];
+    // Last RSSI sent to clients
+    int8_t rssi;
+    uint8_t channel;
+    uint8_t auth;
+} wm_ws_network_t;
+
+static int _ws_fds[WM_WS_MAX_CLIENTS] = { [0 ... WM_WS_MAX_CLIENTS-1] = -1 };
+// Client got its initial snapshot and can take diffs
+static bool _ws_ready[WM_WS_MAX_CLIENTS];
+static wm_ws_network_t _ws_networks[WM_SCAN_MAX_NETWORKS];
+static uint8_t _ws_networks_count;
+
+/*
+ * Send a text message to a single client, or to all of them if 'fd' is -1
+ */
+static void ws_send(int fd, const char* msg, size_t len) {
+    httpd_ws_frame_t frame = {
+        .type = HTTPD_WS_TYPE_TEXT,
+        .payload = (uint8_t*)msg,
+        .len = len
+    };
+    for(int i = 0; i < WM_WS_MAX_CLIENTS; i++) {
+        if(_ws_fds[i] < 0) continue;
+        if(fd >= 0 ? _ws_fds[i] != fd : !_ws_ready[i]) continue;
+
+        if(httpd_ws_get_fd_info(_server, _ws_fds[i]) != HTTPD_WS_CLIENT_WEBSOCKET
+                || httpd_ws_send_frame_async(_server, _ws_fds[i], &frame) != ESP_OK) {
+            ESP_LOGD(TAG, "Dropping WebSocket client %d", _ws_fds[i]);
+            httpd_sess_trigger_close(_server, _ws_fds[i]);
+        }
+    }
+}
+
+static void ws_send_network(int fd, const char* op, const wm_ws_network_t* network) {
+    char msg[WS_SCAN_MSG_MAX_LEN];
+    size_t len = sprintf(msg, "{\"type\":\"scan\",\"op\":\"%s\",\"ssid\":\"", op);
+    len += json_escape(msg + len, network->ssid, sizeof(network->ssid));
+    if(strcmp(op, "add") == 0) {
+        len += sprintf(msg + len, "\",\"rssi\":%d,\"channel\":%d,\"auth\":%d}",
+            network->rssi, network->channel, network->auth);
+    } else if(strcmp(op, "rssi") == 0) {
+        len += sprintf(msg + len, "\",\"rssi\":%d}", network->rssi);
+    } else {
+        len += sprintf(msg + len, "\"}");
+    }
+    ws_send(fd, msg, len);
+}
+
+static void ws_send_status(int fd) {
+    char msg[STATUS_JSON_MAX_LEN + 32];
+    size_t len = sprintf(msg, "{\"type\":\"state\",\"status\":");
+    len += provision_status_json(msg + len, STATUS_JSON_MAX_LEN);
+    len += sprintf(msg + len, "}");
+    ws_send(fd, msg, len);
+}
+
+/*
+ * Diff the scan cache against what clients were last sent and broadcast
+ * the changes
+ */
+static void ws_scan_broadcast(void* arg) {
+    uint16_t ap_count = WM_SCAN_MAX_NETWORKS;
+    wifi_ap_record_t ap_records[ap_count];
+    if(wm_scan_cache_get(ap_records, &ap_count, 0) != ESP_OK) return;
+
+    uint8_t best[WM_SCAN_MAX_NETWORKS];
+    uint8_t best_count = scan_best_per_ssid(ap_records, ap_count, best);
+
+    wm_ws_network_t next[WM_SCAN_MAX_NETWORKS];
+    bool kept[WM_SCAN_MAX_NETWORKS] = { false };
+    for(int i = 0; i < best_count; i++) {
+        wifi_ap_record_t* record = &ap_records[best[i]];
+        wm_ws_network_t* network = &next[i];
+        memcpy(network->ssid, record->ssid, sizeof(record->ssid));
+        network->ssid[32] = '\0';
+        network->rssi = record->rssi;
+        network->channel = record->primary;
+        network->auth = record->authmode;
+
+        int old;
+        for(old = 0; old < _ws_networks_count; old++) {
+            if(strcmp(_ws_networks[old].ssid, network->ssid) == 0) break;
+        }
+        if(old == _ws_networks_count) {
+            ws_send_network(-1, "add", network);
+            continue;
+        }
+        kept[old] = true;
+        // Small fluctuations aren't worth a message, drift still adds up
+        if(abs(network->rssi - _ws_networks[old].rssi) >= WM_WS_RSSI_DELTA) {
+            ws_send_network(-1, "rssi", network);
+        } else {
+            network->rssi = _ws_networks[old].rssi;
+        }
+    }
+    for(int old = 0; old < _ws_networks_count; old++) {
+        if(!kept[old]) ws_send_network(-1, "remove", &_ws_networks[old]);
+    }
+
+    memcpy(_ws_networks, next, best_count * sizeof(next[0]));
+    _ws_networks_count = best_count;
+}
+
+/*
+ * Bring existing clients up to date, then send everything to the new one
+ */
+static void ws_welcome(void* arg) {
+    int fd = (int)(intptr_t)arg;
+    ws_scan_broadcast(NULL);
+    for(int i = 0; i < _ws_networks_count; i++) {
+        ws_send_network(fd, "add", &_ws_networks[i]);
+    }
+    ws_send_status(fd);
+
+    for(int i = 0; i < WM_WS_MAX_CLIENTS; i++) {
+        if(_ws_fds[i] == fd) _ws_ready[i] = true;
+    }
+}
+
+static void ws_unsubscribe(void* ctx) {
+    *(int*)ctx = -1;
+}
+
+static esp_err_t ws_handler(httpd_req_t *req)
+{
+    if(req->method == HTTP_GET) {
+        // Handshake done
+        int* slot = NULL;
+        for(int i = 0; i < WM_WS_MAX_CLIENTS && !slot; i++) {
+            if(_ws_fds[i] < 0) {
+                slot = &_ws_fds[i];
+                _ws_ready[i] = false;
+            }
+        }
+        if(!slot) return ESP_FAIL; // Too many clients, close it
+
+        *slot = httpd_req_to_sockfd(req);
+        req->sess_ctx = slot;
+        req->free_ctx = ws_unsubscribe;
+        return httpd_queue_work(req->handle, ws_welcome, (void*)(intptr_t)*slot);
+    }
+
+    // Nothing is expected from clients, just drain their frames
+    uint8_t buf[WS_RX_MAX_LEN];
+    httpd_ws_frame_t frame = { .payload = buf };
+    esp_err_t err = httpd_ws_recv_frame(req, &frame, 0);
+    if(err != ESP_OK) return err;
+    if(frame.len > sizeof(buf)) return ESP_FAIL;
+    return httpd_ws_recv_frame(req, &frame, frame.len);
+}
+
+static const httpd_uri_t ws_uri = {
+    .uri          = "/ws",
+    .method       = HTTP_GET,
+    .handler      = ws_handler,
+    .user_ctx     = NULL,
+    .is_websocket = true
+};
+#endif
+
+static void status_broadcast(void* arg) {
+    sse_broadcast(NULL);
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    ws_send_status(-1);
+#endif
+}
+
+void wm_webserver_notify_status() {
+    if(_server == NULL) return;
+    httpd_queue_work(_server, status_broadcast, NULL);
+}
+
+void wm_webserver_notify_scan() {
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    if(_server == NULL) return;
+    httpd_queue_work(_server, ws_scan_broadcast, NULL);
+#endif
+}
+
+static esp_err_t ssid_post_error(httpd_req_t *req, const char* status, const char* msg) {
+    httpd_resp_set_status(req, status);
+    httpd_resp_send(req, msg, HTTPD_RESP_USE_STRLEN);
+    return ESP_FAIL;
+}
+
+esp_err_t ssid_post_handler(httpd_req_t *req) {
+    // Reject before reading anything, the socket gets closed on ESP_FAIL
+    if(req->content_len > WM_FORM_MAX_BODY_LEN) {
+        return ssid_post_error(req, "413 Payload Too Large", "Body too large");
+    }
+
+    char content_type[32];
+    wm_form_type_t type = WM_FORM_URLENCODED;
+    if(httpd_req_get_hdr_value_str(req, "Content-Type", content_type, sizeof(content_type)) != ESP_ERR_NOT_FOUND
+            && strncasecmp(content_type, "application/json", 16) == 0) {
+        type = WM_FORM_JSON;
+    }
+
     wm_network_info_t network_info = wm_network_info_default;
-    if(httpd_query_key_value(content, "ssid", network_info.ssid, 32) == ESP_ERR_NOT_FOUND) {
-        httpd_resp_set_status(req, "400 Bad Request");
-        httpd_resp_send(req, "SSID required", HTTPD_RESP_USE_STRLEN);
-        return ESP_FAIL;
+    wm_form_parser_t parser;
+    wm_form_init(&parser, type, &network_info);
+
+    // Body is parsed as it arrives, no need to buffer it whole
+    char chunk[64];
+    size_t remaining = req->content_len;
+    while(remaining > 0) {
+        int ret = httpd_req_recv(req, chunk, MIN(remaining, sizeof(chunk)));
+        if (ret <= 0) {  // Check if connection was closed
+            if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+                httpd_resp_send_408(req);
+            }
+            return ESP_FAIL; // To ensure the socket is closed
+        }
+        esp_err_t err = wm_form_feed(&parser, chunk, ret);
+        if(err == ESP_ERR_INVALID_SIZE) return ssid_post_error(req, "400 Bad Request", "Field too long");
+        if(err != ESP_OK) return ssid_post_error(req, "400 Bad Request", "Malformed body");
+        remaining -= ret;
     }
-    if(strlen(network_info.ssid) < 1) {
-        httpd_resp_set_status(req, "400 Bad Request");
-        httpd_resp_send(req, "Empty SSID not valid", HTTPD_RESP_USE_STRLEN);
-        return ESP_FAIL;
+    if(wm_form_finish(&parser) != ESP_OK) return ssid_post_error(req, "400 Bad Request", "Malformed body");
+
+    if(!(parser.fields & WM_FORM_SSID_BIT)) {
+        return ssid_post_error(req, "400 Bad Request", "SSID required");
     }
-    if(httpd_query_key_value(content, "password", network_info.password, 64) == ESP_ERR_NOT_FOUND) {
-        httpd_resp_set_status(req, "400 Bad Request");
-        httpd_resp_send(req, "Password required", HTTPD_RESP_USE_STRLEN);
-        return ESP_FAIL;
+    if(network_info.ssid[0] == '\0') {
+        return ssid_post_error(req, "400 Bad Request", "Empty SSID not valid");
     }
-    ESP_LOGI(TAG, "Received credentials for SSID '%s'. Rebooting...", network_info.ssid);
-    httpd_resp_send(req, "OK, rebooting...", HTTPD_RESP_USE_STRLEN);
- 
-    /*ESP_ERROR_CHECK(esp_wifi_stop());
-    ESP_ERROR_CHECK(esp_wifi_restore());
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
-    ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config) );
-    ESP_ERROR_CHECK(esp_wifi_start());*/
+    if(!(parser.fields & WM_FORM_PASSWORD_BIT)) {
+        return ssid_post_error(req, "400 Bad Request", "Password required");
+    }
+    ESP_LOGI(TAG, "Received credentials for SSID '%.32s'. Connecting...", network_info.ssid);
 
-    wm_storage_save(&network_info);
+    // Credentials are stored once the connection succeeds
+    esp_err_t err = wm_provision_connect(&network_info);
+    if(err == ESP_ERR_INVALID_STATE) {
+        httpd_resp_set_status(req, "409 Conflict");
+        httpd_resp_send(req, "Already connecting", HTTPD_RESP_USE_STRLEN);
+        return ESP_OK;
+    }
+    if(err != ESP_OK) {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+    httpd_resp_set_status(req, "202 Accepted");
+    httpd_resp_send(req, "OK, connecting...", HTTPD_RESP_USE_STRLEN);
     
     return ESP_OK;
 }
@@ -89,15 +622,315 @@ httpd_uri_t ssid_uri = {
     .user_ctx = NULL
 };
 
+static wm_webserver_stats_t _wm_webserver_stats;
+
+/*
+ * Connection admission. Phones joining the AP open keep-alive sockets from
+ * background apps; cap the sockets each client (peer IPv4) can hold so the
+ * browser of the user provisioning the device still gets in. Sockets are
+ * closed to make room, least recently used first: a client's over its cap,
+ * and one of any client when the pool fills up, so there is always a free
+ * session for the next connection (httpd's own LRU purge is off, it would
+ * pick idle event streams first). Sockets following /api/events or /ws are
+ * never closed to make room. Only touched from the httpd task.
+ */
+typedef struct wm_socket_entry_t {
+    int fd;
+    uint32_t addr;
+    // Last data received, see wm_webserver_recv()
+    int64_t used_at;
+    // Answered a connectivity probe, closed after WM_WEBSERVER_PROBE_IDLE_MS idle
+    bool probe;
+    // Close requested, the session stays until it is processed
+    bool closing;
+} wm_socket_entry_t;
+
+static wm_socket_entry_t _sockets[WM_WEBSERVER_MAX_OPEN_SOCKETS];
+
+static wm_socket_entry_t* socket_entry(int sockfd) {
+    for(int i = 0; i < WM_WEBSERVER_MAX_OPEN_SOCKETS; i++) {
+        if(_sockets[i].fd == sockfd) return &_sockets[i];
+    }
+    return NULL;
+}
+
+static bool socket_is_stream(int sockfd) {
+    for(int i = 0; i < WM_SSE_MAX_SUBSCRIBERS; i++) {
+        if(_sse_fds[i] == sockfd) return true;
+    }
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+    for(int i = 0; i < WM_WS_MAX_CLIENTS; i++) {
+        if(_ws_fds[i] == sockfd) return true;
+    }
+#endif
+    return false;
+}
+
+// A request waiting to be read, the socket isn't idle whatever its last use
+static bool socket_has_pending(int sockfd) {
+    char byte;
+    return recv(sockfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
+/*
+ * Whether 'entry' should be closed before 'victim' to make room: idle
+ * sockets first, then sockets with a request waiting, least recently used
+ * first within each
+ */
+static bool socket_evict_before(wm_socket_entry_t* entry, bool pending, wm_socket_entry_t* victim, bool victim_pending) {
+    if(!victim) return true;
+    if(pending != victim_pending) return !pending;
+    return entry->used_at < victim->used_at;
+}
+
+static void socket_evict(httpd_handle_t hd, wm_socket_entry_t* entry, const char* why) {
+    ESP_LOGD(TAG, "Closing socket %d (%s)", entry->fd, why);
+    if(httpd_sess_trigger_close(hd, entry->fd) != ESP_OK) return;
+    entry->closing = true;
+    _wm_webserver_stats.evicted++;
+}
+
+/*
+ * Session receive function, keeps track of the last use of each socket
+ */
+static int wm_webserver_recv(httpd_handle_t hd, int sockfd, char* buf, size_t buf_len, int flags) {
+    if(buf == NULL) return HTTPD_SOCK_ERR_INVALID;
+    int ret = recv(sockfd, buf, buf_len, flags);
+    if(ret < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+            ? HTTPD_SOCK_ERR_TIMEOUT
+            : HTTPD_SOCK_ERR_FAIL;
+    }
+    wm_socket_entry_t* entry = socket_entry(sockfd);
+    if(entry) entry->used_at = esp_timer_get_time();
+    return ret;
+}
+
+/*
+ * Connectivity checks of each OS. Anything but their expected answer makes
+ * the OS open the portal, so they all get a bodiless redirect to it.
+ */
+static esp_err_t probe_get_handler(httpd_req_t *req)
+{
+    _wm_webserver_stats.probes[(uintptr_t)req->user_ctx]++;
+
+    httpd_resp_set_status(req, "302 Found");
+    httpd_resp_set_hdr(req, "Location", WM_DNS_HOST_URL);
+    httpd_resp_send(req, NULL, 0);
+
+    /* Probes come from background services: their socket is only kept for
+     * WM_WEBSERVER_PROBE_IDLE_MS, in case the OS opens the portal on it */
+    wm_socket_entry_t* entry = socket_entry(httpd_req_to_sockfd(req));
+    if(entry) entry->probe = true;
+    return ESP_OK;
+}
+
+#define PROBE_URI(path, client) \
+    { .uri = path, .method = HTTP_GET, .handler = probe_get_handler, .user_ctx = (void*)client }
+
+static const httpd_uri_t probe_uris[] = {
+    PROBE_URI("/generate_204",              WM_PROBE_ANDROID),
+    PROBE_URI("/gen_204",                   WM_PROBE_ANDROID),
+    PROBE_URI("/hotspot-detect.html",       WM_PROBE_APPLE),
+    PROBE_URI("/library/test/success.html", WM_PROBE_APPLE),
+    PROBE_URI("/connecttest.txt",           WM_PROBE_WINDOWS),
+    PROBE_URI("/ncsi.txt",                  WM_PROBE_WINDOWS),
+    PROBE_URI("/redirect",                  WM_PROBE_WINDOWS),
+    PROBE_URI("/success.txt",               WM_PROBE_FIREFOX),
+    PROBE_URI("/canonical.html",            WM_PROBE_FIREFOX),
+};
+
+#ifdef CONFIG_WM_WEBSERVER_STATS
+/*
+ * Handler instrumentation (CONFIG_WM_WEBSERVER_STATS). Handlers are
+ * registered through register_uri() and called by timed_handler(), which
+ * finds the real handler and its context in its user_ctx.
+ */
+typedef struct wm_timed_uri_t {
+    esp_err_t (*handler)(httpd_req_t *req);
+    void* user_ctx;
+} wm_timed_uri_t;
+
+static wm_timed_uri_t _timed_uris[WM_WEBSERVER_MAX_URI_HANDLERS];
+static uint8_t _timed_uris_count;
+
+static void stats_request_done(int64_t started) {
+    uint32_t elapsed = esp_timer_get_time() - started;
+    _wm_webserver_stats.requests++;
+    _wm_webserver_stats.request_time_us += elapsed;
+    if(elapsed > _wm_webserver_stats.request_time_max_us) {
+        _wm_webserver_stats.request_time_max_us = elapsed;
+    }
+
+    uint32_t stack_free = uxTaskGetStackHighWaterMark(NULL);
+    if(_wm_webserver_stats.stack_free_min == 0 || stack_free < _wm_webserver_stats.stack_free_min) {
+        _wm_webserver_stats.stack_free_min = stack_free;
+    }
+}
+
+static esp_err_t timed_handler(httpd_req_t *req) {
+    wm_timed_uri_t* timed = req->user_ctx;
+    req->user_ctx = timed->user_ctx;
+
+    int64_t started = esp_timer_get_time();
+    esp_err_t err = timed->handler(req);
+    stats_request_done(started);
+    return err;
+}
+
+static esp_err_t register_uri(const httpd_uri_t* uri) {
+    if(_timed_uris_count >= WM_WEBSERVER_MAX_URI_HANDLERS) return ESP_ERR_NO_MEM;
+    wm_timed_uri_t* timed = &_timed_uris[_timed_uris_count++];
+    timed->handler = uri->handler;
+    timed->user_ctx = uri->user_ctx;
+
+    httpd_uri_t timed_uri = *uri;
+    timed_uri.handler = timed_handler;
+    timed_uri.user_ctx = timed;
+    return httpd_register_uri_handler(_server, &timed_uri);
+}
+
+/*
+ * Session send function, counts what is written to clients
+ */
+static int wm_webserver_send(httpd_handle_t hd, int sockfd, const char* buf, size_t buf_len, int flags) {
+    if(buf == NULL) return HTTPD_SOCK_ERR_INVALID;
+    int ret = send(sockfd, buf, buf_len, flags);
+    if(ret < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+            ? HTTPD_SOCK_ERR_TIMEOUT
+            : HTTPD_SOCK_ERR_FAIL;
+    }
+    _wm_webserver_stats.bytes_sent += ret;
+    return ret;
+}
+#else
+static esp_err_t register_uri(const httpd_uri_t* uri) {
+    return httpd_register_uri_handler(_server, uri);
+}
+#endif
+
+void wm_webserver_get_stats(wm_webserver_stats_t* stats) {
+    *stats = _wm_webserver_stats;
+    stats->heap_free_min = esp_get_minimum_free_heap_size();
+}
+
+void wm_webserver_reset_stats() {
+    memset(&_wm_webserver_stats, 0, sizeof(_wm_webserver_stats));
+}
+
 esp_err_t http_404_error_handler(httpd_req_t *req, httpd_err_code_t err)
 {
+#ifdef CONFIG_WM_WEBSERVER_STATS
+    int64_t started = esp_timer_get_time();
+#endif
     httpd_resp_set_hdr(req, "Location", WM_DNS_HOST_URL);
     httpd_resp_set_status(req, "302 Found");
     const char* resp = "Moved temporarily";
     httpd_resp_send(req, resp, strlen(resp));
+#ifdef CONFIG_WM_WEBSERVER_STATS
+    stats_request_done(started);
+#endif
     return ESP_FAIL;
 }
 
+static bool socket_peer_addr(int sockfd, uint32_t* addr) {
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    if(getpeername(sockfd, (struct sockaddr*)&peer, &peer_len) != 0) return false;
+
+    if(peer.ss_family == AF_INET) {
+        *addr = ((struct sockaddr_in*)&peer)->sin_addr.s_addr;
+        return true;
+    }
+    if(peer.ss_family == AF_INET6) {
+        // IPv4-mapped address of a dual-stack listener
+        memcpy(addr, &((struct sockaddr_in6*)&peer)->sin6_addr.s6_addr[12], sizeof(*addr));
+        return true;
+    }
+    return false;
+}
+
+static esp_err_t wm_webserver_open_fn(httpd_handle_t hd, int sockfd) {
+    uint32_t addr;
+    if(!socket_peer_addr(sockfd, &addr)) {
+        _wm_webserver_stats.rejected++;
+        return ESP_FAIL;
+    }
+
+    int64_t now = esp_timer_get_time();
+    wm_socket_entry_t* new_entry = NULL;
+    wm_socket_entry_t* client_lru = NULL;
+    wm_socket_entry_t* lru = NULL;
+    bool client_lru_pending = false, lru_pending = false;
+    int client_sockets = 0;
+    int free_entries = 0;
+    for(int i = 0; i < WM_WEBSERVER_MAX_OPEN_SOCKETS; i++) {
+        wm_socket_entry_t* entry = &_sockets[i];
+        if(entry->fd < 0) {
+            free_entries++;
+            if(!new_entry) new_entry = entry;
+            continue;
+        }
+        // Sessions being closed will be free soon
+        if(entry->closing) {
+            free_entries++;
+            continue;
+        }
+        // The portal may have been opened on a probe socket
+        bool stream = socket_is_stream(entry->fd);
+        if(entry->probe && !stream && now - entry->used_at >= WM_WEBSERVER_PROBE_IDLE_MS * 1000LL) {
+            socket_evict(hd, entry, "idle probe");
+            free_entries++;
+            continue;
+        }
+        if(entry->addr == addr) client_sockets++;
+        if(stream) continue;
+
+        bool pending = socket_has_pending(entry->fd);
+        if(entry->addr == addr && socket_evict_before(entry, pending, client_lru, client_lru_pending)) {
+            client_lru = entry;
+            client_lru_pending = pending;
+        }
+        if(socket_evict_before(entry, pending, lru, lru_pending)) {
+            lru = entry;
+            lru_pending = pending;
+        }
+    }
+    // Sessions being closed stay in use until their close is processed
+    if(!new_entry) {
+        _wm_webserver_stats.rejected++;
+        return ESP_FAIL;
+    }
+    // A client whose sockets are all event streams gets in anyway, streams have their own limits
+    if(client_sockets >= WM_WEBSERVER_MAX_CLIENT_SOCKETS && client_lru) {
+        socket_evict(hd, client_lru, "client over its socket cap");
+        if(lru == client_lru) lru = NULL;
+        free_entries++;
+    }
+    // Taking the last free session, make room for the next connection
+    if(free_entries == 1 && lru) socket_evict(hd, lru, "least recently used");
+
+    new_entry->fd = sockfd;
+    new_entry->addr = addr;
+    new_entry->used_at = now;
+    new_entry->probe = false;
+    new_entry->closing = false;
+    esp_err_t err = httpd_sess_set_recv_override(hd, sockfd, wm_webserver_recv);
+#ifdef CONFIG_WM_WEBSERVER_STATS
+    if(err == ESP_OK) err = httpd_sess_set_send_override(hd, sockfd, wm_webserver_send);
+#endif
+    return err;
+}
+
+static void wm_webserver_close_fn(httpd_handle_t hd, int sockfd) {
+    for(int i = 0; i < WM_WEBSERVER_MAX_OPEN_SOCKETS; i++) {
+        if(_sockets[i].fd == sockfd) _sockets[i].fd = -1;
+    }
+    // Closing is left to us once close_fn is set
+    close(sockfd);
+}
+
 void wm_start_webserver() {
     wifi_mode_t mode;
     ESP_ERROR_CHECK(esp_wifi_get_mode(&mode));
@@ -115,20 +948,49 @@ void wm_start_webserver() {
     
     ESP_ERROR_CHECK(esp_wifi_start());
 
-    httpd_handle_t server = NULL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    // Scan handlers keep scan records and stored networks on the stack
+    config.stack_size = WM_WEBSERVER_STACK_SIZE;
+    config.max_uri_handlers = WM_WEBSERVER_MAX_URI_HANDLERS;
+    // Admission policy, see wm_webserver_open_fn()
+    config.max_open_sockets = WM_WEBSERVER_MAX_OPEN_SOCKETS;
+    config.lru_purge_enable = false;
+    config.recv_wait_timeout = WM_WEBSERVER_SOCKET_TIMEOUT_S;
+    config.send_wait_timeout = WM_WEBSERVER_SOCKET_TIMEOUT_S;
+    config.open_fn = wm_webserver_open_fn;
+    config.close_fn = wm_webserver_close_fn;
+    for(int i = 0; i < WM_WEBSERVER_MAX_OPEN_SOCKETS; i++) _sockets[i].fd = -1;
+#ifdef CONFIG_WM_WEBSERVER_STATS
+    _timed_uris_count = 0;
+#endif
 
     // Start the httpd server
     ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
-    if (httpd_start(&server, &config) == ESP_OK) {
+    if (httpd_start(&_server, &config) == ESP_OK) {
         // Set URI handlers
         ESP_LOGI(TAG, "Registering URI handlers");
-        httpd_register_uri_handler(server, &index_uri);
-        httpd_register_uri_handler(server, &ssid_uri);
-        httpd_register_err_handler(server, HTTPD_404_NOT_FOUND, http_404_error_handler);
+        register_uri(&index_uri);
+        register_uri(&networks_uri);
+        register_uri(&api_scan_uri);
+        register_uri(&ssid_uri);
+        register_uri(&api_events_uri);
+#ifdef CONFIG_HTTPD_WS_SUPPORT
+        register_uri(&ws_uri);
+#endif
+        for(int i = 0; i < sizeof(probe_uris)/sizeof(probe_uris[0]); i++) {
+            register_uri(&probe_uris[i]);
+        }
+        httpd_register_err_handler(_server, HTTPD_404_NOT_FOUND, http_404_error_handler);
         return;// server;
     }
 
     ESP_LOGI(TAG, "Error starting server!");
     //return NULL;
 }
+
+void wm_stop_webserver() {
+    if(_server == NULL) return;
+    ESP_LOGI(TAG, "Stopping server");
+    httpd_stop(_server);
+    _server = NULL;
+}
@@ -13,7 +13,82 @@
 
 #include "wifi_manager.h"
 #include "wm_dns.h"
+#include "wm_form.h"
 
 #include "sdkconfig.h"
 
-void wm_start_webserver();
\ No newline at end of file
+#define WM_WEBSERVER_STACK_SIZE 6144
+// Portal pages, APIs and OS connectivity probes
+#define WM_WEBSERVER_MAX_URI_HANDLERS 16
+// Must stay below CONFIG_LWIP_MAX_SOCKETS minus the 3 httpd uses internally
+#define WM_WEBSERVER_MAX_OPEN_SOCKETS 7
+// Sockets a single client can keep open, its least recently used one is closed past this
+#define WM_WEBSERVER_MAX_CLIENT_SOCKETS 3
+#define WM_WEBSERVER_SOCKET_TIMEOUT_S 3
+// Idle time after which a socket that answered a connectivity probe is closed,
+// checked when new connections come in
+#define WM_WEBSERVER_PROBE_IDLE_MS 2000
+// Clients following provisioning progress on /api/events
+#define WM_SSE_MAX_SUBSCRIBERS 3
+// Browsers following scan results and state on /ws (needs CONFIG_HTTPD_WS_SUPPORT)
+#define WM_WS_MAX_CLIENTS 4
+// RSSI change (dB) worth pushing to WebSocket clients
+#define WM_WS_RSSI_DELTA 5
+
+typedef enum {
+    WM_PROBE_ANDROID = 0,
+    WM_PROBE_APPLE,
+    WM_PROBE_WINDOWS,
+    WM_PROBE_FIREFOX,
+    WM_PROBE_MAX
+} wm_probe_client_t;
+
+typedef struct wm_webserver_stats_t {
+    // Connectivity probe requests, per client OS
+    uint32_t probes[WM_PROBE_MAX];
+    // Connections refused on open
+    uint32_t rejected;
+    // Sockets closed to make room: over their client's cap, least recently
+    // used when the pool is full, or idle after a probe
+    uint32_t evicted;
+
+    // Only counted with CONFIG_WM_WEBSERVER_STATS, 0 otherwise:
+    // requests served and time spent in their handlers
+    uint32_t requests;
+    uint64_t request_time_us;
+    uint32_t request_time_max_us;
+    // Bytes written to clients, headers included
+    uint32_t bytes_sent;
+    // Lowest free stack seen in the server task after a request
+    uint32_t stack_free_min;
+    // Lowest free heap since boot, always filled in
+    uint32_t heap_free_min;
+} wm_webserver_stats_t;
+
+
+void wm_start_webserver();
+void wm_stop_webserver();
+
+/*
+ * Push the current provisioning status to /api/events subscribers.
+ * Safe to call from any task.
+ */
+void wm_webserver_notify_status();
+
+/*
+ * Push scan cache changes to /ws clients. Called whenever a scan completes.
+ * Safe to call from any task.
+ */
+void wm_webserver_notify_scan();
+
+/*
+ * Get webserver counters since boot or the last reset. Request timing and
+ * bytes sent need CONFIG_WM_WEBSERVER_STATS.
+ *
+ * Meant to be read around a load run from a client generator (probe and
+ * page-load traffic): requests/bytes over the run give the served rate and
+ * throughput, request_time_* the on-device service time, stack_free_min
+ * and heap_free_min the headroom left.
+ */
+void wm_webserver_get_stats(wm_webserver_stats_t* stats);
+void wm_webserver_reset_stats();